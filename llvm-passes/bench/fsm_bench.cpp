@@ -0,0 +1,746 @@
+// Microbenchmarks and a differential check for the FSM library, built
+// against build/libfsm.a without LLVM.
+//
+//     fsm-bench [--quick] [--threads N] [--json FILE]   time every workload
+//     fsm-bench --check [ITERATIONS] [--seed N]         compare with reference
+//
+// The check builds random NFAs and runs the library's ε-removal,
+// determinization and minimization next to deliberately naive reference
+// versions; any automaton whose language differs is printed and the exit
+// status is 1.
+
+#include "../include/FSM.h"
+#include "../include/AutomatonFormat.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+    // Workloads
+
+    // `states` states over `symbols` symbols, each but the start entered
+    // from an earlier state so all are reachable, plus `extraEdges` edges
+    // between random states. An edge is ε with probability `epsilonShare`.
+    fsm::Automaton randomNFA(std::mt19937 &rng, uint32_t states, uint32_t extraEdges, uint32_t symbols, double epsilonShare) {
+        fsm::Automaton nfa;
+        for(uint32_t state = 0; state < states; state++) {
+            nfa.addState(rng() % 7 == 0);
+        }
+        nfa.start = 0;
+        std::uniform_real_distribution<double> coin(0.0, 1.0);
+        auto label = [&]() {
+            return coin(rng) < epsilonShare ? fsm::Alphabet::epsilon : 1 + rng() % symbols;
+        };
+        for(uint32_t state = 1; state < states; state++) {
+            nfa.addEdge(rng() % state, state, label());
+        }
+        for(uint32_t edge = 0; edge < extraEdges; edge++) {
+            fsm::stateId from = rng() % states;
+            nfa.addEdge(from, rng() % states, label());
+        }
+        nfa.finalize();
+        return nfa;
+    }
+
+    // A chain of `length` states joined by ε, with a labelled edge every
+    // tenth step and an ε back edge every thousandth: the shape straight-line
+    // code without libc calls gives the CFG passes.
+    fsm::Automaton epsilonChain(uint32_t length) {
+        fsm::Automaton nfa;
+        for(uint32_t state = 0; state < length; state++) {
+            nfa.addState(false);
+        }
+        nfa.start = 0;
+        for(uint32_t state = 0; state + 1 < length; state++) {
+            nfa.addEdge(state, state + 1, state % 10 == 0 ? 1 + state % 5 : fsm::Alphabet::epsilon);
+            if(state % 1000 == 999) nfa.addEdge(state, state - 900, fsm::Alphabet::epsilon);
+        }
+        nfa.setFinal(length - 1);
+        nfa.finalize();
+        return nfa;
+    }
+
+    // Every state has `fanout` edges on distinct symbols out of `symbols`,
+    // so the move lists are long but the subsets stay small: the cost is in
+    // handling wide alphabets, not in the number of DFA states.
+    fsm::Automaton denseAlphabet(std::mt19937 &rng, uint32_t states, uint32_t symbols, uint32_t fanout) {
+        fsm::Automaton nfa;
+        for(uint32_t state = 0; state < states; state++) {
+            nfa.addState(rng() % 5 == 0);
+        }
+        nfa.start = 0;
+        for(uint32_t state = 0; state < states; state++) {
+            fsm::symbolId first = rng() % symbols;
+            for(uint32_t edge = 0; edge < fanout; edge++) {
+                nfa.addEdge(state, rng() % states, 1 + (first + edge * 7) % symbols);
+            }
+        }
+        nfa.finalize();
+        return nfa;
+    }
+
+    // (a|b)* a (a|b)^(n-1): the n-th symbol from the end is an a. n+1 NFA
+    // states, 2^n states in the minimal DFA.
+    fsm::Automaton nthFromLast(uint32_t n, bool withEpsilons) {
+        const fsm::symbolId a = 1, b = 2;
+        fsm::Automaton nfa;
+        for(uint32_t state = 0; state <= n; state++) {
+            nfa.addState(state == n);
+        }
+        nfa.start = 0;
+        nfa.addEdge(0, 0, a);
+        nfa.addEdge(0, 0, b);
+        nfa.addEdge(0, 1, a);
+        for(uint32_t state = 1; state < n; state++) {
+            nfa.addEdge(state, state + 1, a);
+            nfa.addEdge(state, state + 1, b);
+        }
+        if(withEpsilons) {
+            // The same language with every state also reachable by ε from
+            // its predecessor's ε-free copy, as call/return edges look.
+            fsm::Automaton padded;
+            for(uint32_t state = 0; state < 2 * (n + 1); state++) {
+                padded.addState(state == 2 * n + 1);
+            }
+            padded.start = 0;
+            for(uint32_t state = 0; state <= n; state++) {
+                padded.addEdge(2 * state, 2 * state + 1, fsm::Alphabet::epsilon);
+            }
+            nfa.finalize();
+            for(fsm::stateId state = 0; state <= n; state++) {
+                for(uint32_t edge = nfa.edgeBegin(state); edge < nfa.edgeEnd(state); edge++) {
+                    padded.addEdge(2 * state + 1, 2 * nfa.target(edge), nfa.label(edge));
+                }
+            }
+            padded.finalize();
+            return padded;
+        }
+        nfa.finalize();
+        return nfa;
+    }
+
+    // Reference algorithms: the textbook definitions, with no attempt at speed.
+
+    std::set<fsm::stateId> referenceClosure(const fsm::Automaton &nfa, const std::set<fsm::stateId> &from) {
+        std::set<fsm::stateId> closure = from;
+        std::vector<fsm::stateId> work(from.begin(), from.end());
+        while(!work.empty()) {
+            fsm::stateId state = work.back();
+            work.pop_back();
+            for(uint32_t edge = nfa.edgeBegin(state); edge < nfa.edgeEnd(state); edge++) {
+                if(nfa.label(edge) == fsm::Alphabet::epsilon && closure.insert(nfa.target(edge)).second) {
+                    work.push_back(nfa.target(edge));
+                }
+            }
+        }
+        return closure;
+    }
+
+    // Subset construction straight from an NFA with ε edges.
+    fsm::Automaton referenceDeterminize(const fsm::Automaton &nfa) {
+        fsm::Automaton dfa;
+        std::map<std::set<fsm::stateId>, fsm::stateId> ids;
+        std::vector<std::set<fsm::stateId>> sets;
+        auto idOf = [&](const std::set<fsm::stateId> &states) {
+            auto found = ids.find(states);
+            if(found != ids.end()) return found->second;
+            bool isFinal = false;
+            for(fsm::stateId state : states) isFinal = isFinal || nfa.isFinal(state);
+            fsm::stateId id = dfa.addState(isFinal);
+            ids[states] = id;
+            sets.push_back(states);
+            return id;
+        };
+        dfa.start = idOf(referenceClosure(nfa, {nfa.start}));
+        for(fsm::stateId current = 0; current < sets.size(); current++) {
+            std::map<fsm::symbolId, std::set<fsm::stateId>> moves;
+            for(fsm::stateId state : sets[current]) {
+                for(uint32_t edge = nfa.edgeBegin(state); edge < nfa.edgeEnd(state); edge++) {
+                    if(nfa.label(edge) != fsm::Alphabet::epsilon) moves[nfa.label(edge)].insert(nfa.target(edge));
+                }
+            }
+            for(auto &[label, targets] : moves) {
+                fsm::stateId to = idOf(referenceClosure(nfa, targets));
+                dfa.addEdge(current, to, label);
+            }
+        }
+        dfa.finalize();
+        return dfa;
+    }
+
+    // Whether two partial DFAs accept the same words and have the same
+    // live prefixes: a walk over the product that fails on the first
+    // difference in finality or in the set of outgoing labels.
+    bool sameLanguage(const fsm::Automaton &left, const fsm::Automaton &right) {
+        if(left.start == fsm::Automaton::noState || right.start == fsm::Automaton::noState) {
+            return left.start == right.start;
+        }
+        std::set<std::pair<fsm::stateId, fsm::stateId>> seen = {{left.start, right.start}};
+        std::vector<std::pair<fsm::stateId, fsm::stateId>> work = {{left.start, right.start}};
+        while(!work.empty()) {
+            auto [l, r] = work.back();
+            work.pop_back();
+            if(left.isFinal(l) != right.isFinal(r)) return false;
+            std::map<fsm::symbolId, fsm::stateId> leftMoves;
+            for(uint32_t edge = left.edgeBegin(l); edge < left.edgeEnd(l); edge++) {
+                leftMoves[left.label(edge)] = left.target(edge);
+            }
+            if(leftMoves.size() != right.edgeEnd(r) - right.edgeBegin(r)) return false;
+            for(uint32_t edge = right.edgeBegin(r); edge < right.edgeEnd(r); edge++) {
+                auto found = leftMoves.find(right.label(edge));
+                if(found == leftMoves.end()) return false;
+                std::pair<fsm::stateId, fsm::stateId> next = {found->second, right.target(edge)};
+                if(seen.insert(next).second) work.push_back(next);
+            }
+        }
+        return true;
+    }
+
+    // Whether the partial DFA `outer` accepts every word and live prefix of
+    // `inner`, as an over-approximation must.
+    bool includesLanguage(const fsm::Automaton &outer, const fsm::Automaton &inner) {
+        if(inner.start == fsm::Automaton::noState) return true;
+        if(outer.start == fsm::Automaton::noState) return false;
+        std::set<std::pair<fsm::stateId, fsm::stateId>> seen = {{outer.start, inner.start}};
+        std::vector<std::pair<fsm::stateId, fsm::stateId>> work = {{outer.start, inner.start}};
+        while(!work.empty()) {
+            auto [o, i] = work.back();
+            work.pop_back();
+            if(inner.isFinal(i) && !outer.isFinal(o)) return false;
+            for(uint32_t edge = inner.edgeBegin(i); edge < inner.edgeEnd(i); edge++) {
+                fsm::stateId next = outer.next(o, inner.label(edge));
+                if(next == fsm::Automaton::noState) return false;
+                if(seen.insert({next, inner.target(edge)}).second) work.push_back({next, inner.target(edge)});
+            }
+        }
+        return true;
+    }
+
+    bool sameStructure(const fsm::Automaton &left, const fsm::Automaton &right) {
+        if(left.numStates() != right.numStates() || left.numEdges() != right.numEdges() || left.start != right.start) {
+            return false;
+        }
+        for(fsm::stateId state = 0; state < left.numStates(); state++) {
+            if(left.isFinal(state) != right.isFinal(state) || left.edgeBegin(state) != right.edgeBegin(state)) return false;
+        }
+        for(uint32_t edge = 0; edge < left.numEdges(); edge++) {
+            if(left.target(edge) != right.target(edge) || left.label(edge) != right.label(edge)) return false;
+        }
+        return true;
+    }
+
+    void printAutomaton(const fsm::Automaton &nfa) {
+        std::printf("  start %u\n", nfa.start);
+        for(fsm::stateId state = 0; state < nfa.numStates(); state++) {
+            std::printf("  %u%s:", state, nfa.isFinal(state) ? " (final)" : "");
+            for(uint32_t edge = nfa.edgeBegin(state); edge < nfa.edgeEnd(state); edge++) {
+                std::printf(" %u->%u", nfa.label(edge), nfa.target(edge));
+            }
+            std::printf("\n");
+        }
+    }
+
+    // Labels 1..symbols of the generated automata, named by their number,
+    // which also serves as their libc ID in the images.
+    fsm::Alphabet numberedAlphabet(uint32_t symbols) {
+        fsm::Alphabet alphabet;
+        for(uint32_t symbol = 1; symbol <= symbols; symbol++) {
+            alphabet.intern(std::to_string(symbol));
+        }
+        return alphabet;
+    }
+
+    uint32_t numberedLibcId(const std::string &label) {
+        return static_cast<uint32_t>(std::stoul(label));
+    }
+
+    // The smallest budget bitParallelImage builds an image within: that of
+    // 1-bit chunks, two entries per position.
+    size_t oneBitFollowBytes(const fsm::Automaton &nfa) {
+        size_t positions = fsm::countPositions(nfa);
+        return positions * 2 * ((positions + 63) / 64) * sizeof(uint64_t);
+    }
+
+    // Steps a bit-parallel image through events given as libc IDs.
+    class bitParallelRun {
+        public:
+            explicit bitParallelRun(const std::vector<char> &image)
+                : nfa(fsm_bitnfa_open(image.data(), image.size())), active(nfa->num_words), next(nfa->num_words) {
+                reset();
+            }
+
+            void reset() {
+                const uint64_t *initial = FSM_TABLE_SECTION(nfa, initial_offset, uint64_t);
+                active.assign(initial, initial + nfa->num_words);
+            }
+            bool step(uint32_t libcId) {
+                uint32_t symbol = fsm_bitnfa_symbol_for_libc(nfa, libcId);
+                if(symbol == FSM_NO_SYMBOL || !fsm_bitnfa_step(nfa, active.data(), next.data(), symbol)) return false;
+                active.swap(next);
+                return true;
+            }
+            bool isFinal() const {
+                const uint64_t *finals = FSM_TABLE_SECTION(nfa, final_offset, uint64_t);
+                for(uint32_t word = 0; word < nfa->num_words; word++) {
+                    if(active[word] & finals[word]) return true;
+                }
+                return false;
+            }
+        private:
+            const fsm_bitnfa_header *nfa;
+            std::vector<uint64_t> active;
+            std::vector<uint64_t> next;
+    };
+
+    // The same for a lazily determinized NFA, whose labels are the events.
+    class lazyRun {
+        public:
+            lazyRun(const fsm::Automaton &nfa, size_t cacheBytes) : dfa(nfa, cacheBytes) {reset();}
+
+            void reset() {state = dfa.start();}
+            bool step(uint32_t label) {
+                state = dfa.step(state, label);
+                return state != fsm::LazyDFA::dead;
+            }
+            bool isFinal() const {return dfa.isFinal(state);}
+            size_t flushes() const {return dfa.flushes();}
+            size_t cachedStates() const {return dfa.cachedStates();}
+        private:
+            fsm::LazyDFA dfa;
+            fsm::LazyDFA::handle state;
+    };
+
+    // Random walks through `dfa`, mostly along its edges, that must be
+    // accepted, rejected and end in a final state exactly when the DFA does.
+    template<typename Run>
+    bool sameRuns(const fsm::Automaton &dfa, Run &&run, uint32_t symbols, std::mt19937 &rng) {
+        for(unsigned walk = 0; walk < 20; walk++) {
+            run.reset();
+            fsm::stateId state = dfa.start;
+            for(unsigned length = 0; length < 30; length++) {
+                if(state == fsm::Automaton::noState) {
+                    if(run.step(1 + rng() % symbols)) return false;
+                    break;
+                }
+                if(run.isFinal() != dfa.isFinal(state)) return false;
+                fsm::symbolId label = 1 + rng() % symbols;
+                if(dfa.edgeBegin(state) != dfa.edgeEnd(state) && rng() % 5 != 0) {
+                    label = dfa.label(dfa.edgeBegin(state) + rng() % (dfa.edgeEnd(state) - dfa.edgeBegin(state)));
+                }
+                fsm::stateId next = dfa.next(state, label);
+                if(run.step(label) != (next != fsm::Automaton::noState)) return false;
+                if(next == fsm::Automaton::noState) break;
+                state = next;
+            }
+        }
+        return true;
+    }
+
+    int runCheck(unsigned iterations, unsigned seed) {
+        std::mt19937 rng(seed);
+        unsigned failures = 0;
+        auto fail = [&](const char *what, const fsm::Automaton &nfa) {
+            if(++failures <= 5) {
+                std::printf("mismatch: %s\n", what);
+                printAutomaton(nfa);
+            }
+        };
+
+        for(unsigned iteration = 0; iteration < iterations; iteration++) {
+            uint32_t states = 1 + rng() % 24;
+            uint32_t edges = rng() % (3 * states + 1);
+            uint32_t symbols = 1 + rng() % 4;
+            fsm::Automaton nfa = randomNFA(rng, states, edges, symbols, (rng() % 4) * 0.2);
+
+            std::vector<fsm::stateId> closure = fsm::epsilonClosure(nfa, nfa.start);
+            std::set<fsm::stateId> expected = referenceClosure(nfa, {nfa.start});
+            if(std::vector<fsm::stateId>(expected.begin(), expected.end()) != closure) {
+                fail("epsilonClosure", nfa);
+            }
+
+            fsm::Automaton reference = referenceDeterminize(nfa);
+            fsm::Automaton withoutEpsilons = nfa;
+            fsm::removeEpsilonTransitions(withoutEpsilons);
+            for(fsm::stateId state = 0; state < withoutEpsilons.numStates(); state++) {
+                for(uint32_t edge = withoutEpsilons.edgeBegin(state); edge < withoutEpsilons.edgeEnd(state); edge++) {
+                    if(withoutEpsilons.label(edge) == fsm::Alphabet::epsilon) fail("removeEpsilonTransitions left an ε edge", nfa);
+                }
+            }
+            fsm::Automaton dfa = fsm::mergeEquivalentStates(withoutEpsilons);
+            if(!sameLanguage(dfa, reference)) fail("removeEpsilonTransitions + mergeEquivalentStates", nfa);
+            if(!sameStructure(dfa, fsm::mergeEquivalentStates(withoutEpsilons, 4))) {
+                fail("mergeEquivalentStates differs between 1 and 4 threads", nfa);
+            }
+
+            fsm::Alphabet alphabet = numberedAlphabet(symbols);
+            if(!sameRuns(dfa, bitParallelRun(fsm::bitParallelImage(withoutEpsilons, alphabet, numberedLibcId)), symbols, rng) ||
+               !sameRuns(dfa, bitParallelRun(fsm::bitParallelImage(withoutEpsilons, alphabet, numberedLibcId,
+                                                                   oneBitFollowBytes(withoutEpsilons))), symbols, rng)) {
+                fail("bitParallelImage", nfa);
+            }
+            // A cache of a few states flushes on most misses.
+            if(!sameRuns(dfa, lazyRun(withoutEpsilons, 1 << 20), symbols, rng) ||
+               !sameRuns(dfa, lazyRun(withoutEpsilons, 512), symbols, rng)) {
+                fail("LazyDFA", nfa);
+            }
+            if(fsm::mergeEquivalentStates(withoutEpsilons, 1, dfa.numStates()).numStates() != dfa.numStates() ||
+               (dfa.numStates() > 1 && fsm::mergeEquivalentStates(withoutEpsilons, 1, dfa.numStates() - 1).start != fsm::Automaton::noState)) {
+                fail("mergeEquivalentStates state limit", nfa);
+            }
+            fsm::approximation approximated;
+            if(!sameStructure(fsm::determinizeWithin(withoutEpsilons, 1, dfa.numStates(), &approximated), dfa) ||
+               approximated.applied) {
+                fail("determinizeWithin a budget that fits", nfa);
+            }
+            if(dfa.numStates() > 8) {
+                size_t budget = dfa.numStates() / 2;
+                fsm::Automaton within = fsm::determinizeWithin(withoutEpsilons, 1, budget, &approximated);
+                if(!approximated.applied || (within.numStates() > budget && within.numStates() > 8) ||
+                   !includesLanguage(within, reference) ||
+                   (approximated.rounds == fsm::approximation::exact && !sameLanguage(within, reference))) {
+                    fail("determinizeWithin over-approximation", nfa);
+                }
+            }
+
+            fsm::Automaton minimized = fsm::minimizeDFA(dfa);
+            if(!sameLanguage(minimized, reference)) fail("minimizeDFA", nfa);
+            if(minimized.numStates() > dfa.numStates()) fail("minimizeDFA grew the automaton", nfa);
+
+            fsm::Automaton cleared = dfa;
+            cleared.clear();
+            if(cleared.numStates() != 0 || cleared.numEdges() != 0) fail("Automaton::clear", nfa);
+        }
+
+        // Bit-parallel images over several words, against the library's DFA.
+        for(unsigned iteration = 0; iteration < iterations / 20; iteration++) {
+            uint32_t states = 40 + rng() % 160;
+            uint32_t symbols = 2 + rng() % 6;
+            fsm::Automaton nfa = randomNFA(rng, states, states, symbols, 0.2);
+            fsm::removeEpsilonTransitions(nfa);
+            fsm::Automaton dfa = fsm::mergeEquivalentStates(nfa, 1, 100000);
+            if(dfa.start == fsm::Automaton::noState) continue;
+            fsm::Alphabet alphabet = numberedAlphabet(symbols);
+            if(!sameRuns(dfa, bitParallelRun(fsm::bitParallelImage(nfa, alphabet, numberedLibcId)), symbols, rng) ||
+               !sameRuns(dfa, bitParallelRun(fsm::bitParallelImage(nfa, alphabet, numberedLibcId, oneBitFollowBytes(nfa))),
+                         symbols, rng)) {
+                fail("bitParallelImage with several words", nfa);
+            }
+            if(!fsm::bitParallelImage(nfa, alphabet, numberedLibcId, oneBitFollowBytes(nfa) - 1).empty()) {
+                fail("bitParallelImage over its follow-table budget", nfa);
+            }
+            if(!sameRuns(dfa, lazyRun(nfa, 4096), symbols, rng)) fail("LazyDFA with flushes", nfa);
+        }
+
+        // The blow-up family has a known minimal size.
+        for(uint32_t n = 1; n <= 12; n++) {
+            for(bool withEpsilons : {false, true}) {
+                fsm::Automaton nfa = nthFromLast(n, withEpsilons);
+                fsm::Automaton dfa = nfa;
+                fsm::removeEpsilonTransitions(dfa);
+                dfa = fsm::minimizeDFA(fsm::mergeEquivalentStates(dfa));
+                if(dfa.numStates() != (1u << n)) fail("minimal DFA of the n-th-from-last family", nfa);
+            }
+            fsm::Automaton nfa = nthFromLast(n, false);
+            fsm::approximation approximated;
+            fsm::Automaton within = fsm::determinizeWithin(nfa, 1, 64, &approximated);
+            if(approximated.applied != (n > 6) || !includesLanguage(within, fsm::mergeEquivalentStates(nfa))) {
+                fail("determinizeWithin on the n-th-from-last family", nfa);
+            }
+            // Not even the coarsest quotient fits one state; it is kept
+            // rather than giving up.
+            within = fsm::determinizeWithin(nfa, 1, 1, &approximated);
+            if(within.start == fsm::Automaton::noState || !approximated.applied ||
+               !includesLanguage(within, fsm::mergeEquivalentStates(nfa))) {
+                fail("determinizeWithin a budget of one state", nfa);
+            }
+        }
+
+        // An automaton without a start state, as an empty fragment or a
+        // module without a reachable entry gives, accepts nothing.
+        fsm::Automaton empty;
+        empty.addState(true);
+        empty.finalize();
+        if(fsm::mergeEquivalentStates(empty).start != fsm::Automaton::noState ||
+           fsm::minimizeDFA(empty).start != fsm::Automaton::noState) {
+            fail("determinizing an automaton without a start state", empty);
+        }
+        fsm::approximation emptyApproximated;
+        if(fsm::determinizeWithin(empty, 1, 1, &emptyApproximated).start != fsm::Automaton::noState ||
+           emptyApproximated.applied) {
+            fail("determinizeWithin an automaton without a start state", empty);
+        }
+        fsm::Automaton host;
+        host.addState();
+        if(fsm::embed(host, empty, fsm::Alphabet::epsilon, 0) != fsm::Automaton::noState || host.numStates() != 1) {
+            fail("embedding an automaton without a start state", empty);
+        }
+        std::ostringstream dot;
+        fsm::writeDot(empty, numberedAlphabet(1), dot);
+        if(dot.str().find("->") != std::string::npos) fail("writeDot of an automaton without a start state", empty);
+
+        // Tables are opened in place, so a damaged one must be turned away
+        // before anything reads through its offsets.
+        fsm::Automaton family = nthFromLast(4, false);
+        std::vector<char> nfaImage = fsm::tableImage(family, numberedAlphabet(2), numberedLibcId);
+        std::vector<char> dfaImage = fsm::tableImage(fsm::mergeEquivalentStates(family), numberedAlphabet(2),
+                                                     numberedLibcId);
+        if(!fsm_table_open(dfaImage.data(), dfaImage.size()) || fsm_table_open(nfaImage.data(), nfaImage.size()) ||
+           !fsm_table_open_nfa(nfaImage.data(), nfaImage.size())) {
+            fail("opening deterministic and nondeterministic tables", family);
+        }
+        auto damaged = [&](const std::function<void(fsm_table_header&, std::vector<char>&)> &damage) {
+            std::vector<char> image = dfaImage;
+            fsm_table_header header;
+            std::memcpy(&header, image.data(), sizeof(header));
+            damage(header, image);
+            std::memcpy(image.data(), &header, sizeof(header));
+            return fsm_table_open_nfa(image.data(), image.size()) != nullptr;
+        };
+        auto patch = [](std::vector<char> &image, uint64_t offset, uint32_t value) {
+            std::memcpy(image.data() + offset, &value, sizeof(value));
+        };
+        if(!damaged([](fsm_table_header&, std::vector<char>&) {}) ||
+           damaged([](fsm_table_header &header, std::vector<char> &image) {
+               image.resize(image.size() - 8);
+               header.file_size = image.size();
+           }) ||
+           damaged([](fsm_table_header &header, std::vector<char>&) {header.edge_targets_offset = header.file_size;}) ||
+           damaged([](fsm_table_header &header, std::vector<char>&) {header.edge_labels_offset += 2;}) ||
+           damaged([](fsm_table_header &header, std::vector<char>&) {header.libc_map_size = UINT32_MAX;}) ||
+           damaged([](fsm_table_header &header, std::vector<char>&) {header.num_states++;}) ||
+           damaged([&](fsm_table_header &header, std::vector<char> &image) {
+               patch(image, header.edge_targets_offset, header.num_states);
+           }) ||
+           damaged([&](fsm_table_header &header, std::vector<char> &image) {
+               patch(image, header.symbol_names_offset + sizeof(uint32_t), header.string_bytes + 1);
+           }) ||
+           damaged([&](fsm_table_header &header, std::vector<char> &image) {
+               patch(image, header.edge_offsets_offset + header.num_states * sizeof(uint32_t), header.num_edges + 1);
+           })) {
+            fail("opening a damaged table", family);
+        }
+
+        std::printf("%u random automata and the blow-up family checked: %u mismatches\n", iterations, failures);
+        return failures == 0 ? 0 : 1;
+    }
+
+    // Benchmarks
+
+    struct measurement {
+        std::string workload;
+        std::string stage;
+        double milliseconds;
+        size_t states;
+        size_t edges;
+    };
+
+    double millisecondsSince(std::chrono::steady_clock::time_point begin) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    // Runs every stage on `nfa` in pipeline order, each on the previous
+    // stage's result, as the passes do.
+    void measurePipeline(const std::string &workload, const fsm::Automaton &nfa, unsigned threads,
+                         std::vector<measurement> &results) {
+        auto record = [&](const char *stage, double ms, const fsm::Automaton &result) {
+            results.push_back({workload, stage, ms, result.numStates(), result.numEdges()});
+            std::printf("%-28s %-22s %10.3f ms %10zu states %10zu edges\n",
+                        workload.c_str(), stage, ms, size_t(result.numStates()), result.numEdges());
+        };
+
+        auto begin = std::chrono::steady_clock::now();
+        size_t closed = 0;
+        for(fsm::stateId state = 0; state < nfa.numStates() && state < 1000; state++) {
+            closed += fsm::epsilonClosure(nfa, state).size();
+        }
+        double closureMs = millisecondsSince(begin);
+        results.push_back({workload, "epsilonClosure x1000", closureMs, closed, 0});
+        std::printf("%-28s %-22s %10.3f ms %10zu states in closures\n", workload.c_str(), "epsilonClosure x1000", closureMs, closed);
+
+        fsm::Automaton withoutEpsilons = nfa;
+        begin = std::chrono::steady_clock::now();
+        fsm::removeEpsilonTransitions(withoutEpsilons);
+        record("removeEpsilon", millisecondsSince(begin), withoutEpsilons);
+
+        begin = std::chrono::steady_clock::now();
+        fsm::Automaton dfa = fsm::mergeEquivalentStates(withoutEpsilons, 1);
+        record("determinize", millisecondsSince(begin), dfa);
+
+        if(threads != 1) {
+            begin = std::chrono::steady_clock::now();
+            fsm::Automaton parallel = fsm::mergeEquivalentStates(withoutEpsilons, threads);
+            record("determinize (threads)", millisecondsSince(begin), parallel);
+        }
+
+        begin = std::chrono::steady_clock::now();
+        fsm::Automaton minimized = fsm::minimizeDFA(dfa);
+        record("minimize", millisecondsSince(begin), minimized);
+
+        // A budget of a tenth of the DFA, which forces the quotient.
+        if(dfa.numStates() >= 1000) {
+            begin = std::chrono::steady_clock::now();
+            fsm::Automaton within = fsm::determinizeWithin(withoutEpsilons, 1, dfa.numStates() / 10);
+            record("determinize (budget)", millisecondsSince(begin), within);
+        }
+
+        begin = std::chrono::steady_clock::now();
+        withoutEpsilons.clear();
+        record("clear", millisecondsSince(begin), withoutEpsilons);
+    }
+
+    // Per-event cost of the enforcement forms on the same events: the
+    // minimized DFA's table, stepped the way __fsm_enforce does, the
+    // bit-parallel image and the lazy DFA. `states` is the DFA's size, the
+    // NFA's position count or the states cached at the end, `edges` the
+    // image or cache size in bytes.
+    void measureSteps(const std::string &workload, const fsm::Automaton &nfa, uint32_t symbols,
+                      std::vector<measurement> &results) {
+        const uint32_t events = 1000000;
+        fsm::Automaton withoutEpsilons = nfa;
+        fsm::removeEpsilonTransitions(withoutEpsilons);
+        fsm::Alphabet alphabet = numberedAlphabet(symbols);
+        std::vector<char> tableImage = fsm::tableImage(fsm::minimizeDFA(fsm::mergeEquivalentStates(withoutEpsilons)),
+                                                       alphabet, numberedLibcId);
+        std::vector<char> bitImage = fsm::bitParallelImage(withoutEpsilons, alphabet, numberedLibcId);
+        const fsm_table_header *table = fsm_table_open(tableImage.data(), tableImage.size());
+        const fsm_bitnfa_header *bits = fsm_bitnfa_open(bitImage.data(), bitImage.size());
+
+        std::mt19937 rng(7);
+        std::vector<uint32_t> trace(events);
+        for(uint32_t &event : trace) event = 1 + rng() % symbols;
+
+        auto record = [&](const char *stage, double ms, size_t size, size_t bytes, uint32_t accepted) {
+            results.push_back({workload, stage, ms, size, bytes});
+            std::printf("%-28s %-22s %10.3f ms %10zu states %10zu bytes %8u accepted\n",
+                        workload.c_str(), stage, ms, size, bytes, accepted);
+        };
+
+        auto begin = std::chrono::steady_clock::now();
+        uint32_t state = table->start_state;
+        uint32_t accepted = 0;
+        for(uint32_t event : trace) {
+            uint32_t symbol = fsm_table_symbol_for_libc(table, event);
+            uint32_t next = symbol == FSM_NO_SYMBOL ? FSM_NO_STATE : fsm_table_step(table, state, symbol);
+            if(next == FSM_NO_STATE) {
+                state = table->start_state;
+            } else {
+                state = next;
+                accepted++;
+            }
+        }
+        record("dfa step x1M", millisecondsSince(begin), table->num_states, tableImage.size(), accepted);
+
+        begin = std::chrono::steady_clock::now();
+        bitParallelRun run(bitImage);
+        accepted = 0;
+        for(uint32_t event : trace) {
+            if(run.step(event)) {
+                accepted++;
+            } else {
+                run.reset();
+            }
+        }
+        record("bit-parallel step x1M", millisecondsSince(begin), bits->num_positions, bitImage.size(), accepted);
+
+        // States are built as the events reach them, within a 1 MiB cache.
+        const size_t cacheBytes = size_t(1) << 20;
+        begin = std::chrono::steady_clock::now();
+        lazyRun lazy(withoutEpsilons, cacheBytes);
+        accepted = 0;
+        for(uint32_t event : trace) {
+            if(lazy.step(event)) {
+                accepted++;
+            } else {
+                lazy.reset();
+            }
+        }
+        record("lazy dfa step x1M", millisecondsSince(begin), lazy.cachedStates(), cacheBytes, accepted);
+    }
+
+    void writeJson(const std::string &path, const std::vector<measurement> &results) {
+        std::ofstream out(path);
+        out << "{\n  \"schema\": 1,\n  \"results\": [\n";
+        for(size_t i = 0; i < results.size(); i++) {
+            const measurement &m = results[i];
+            out << "    {\"workload\": \"" << m.workload << "\", \"stage\": \"" << m.stage << "\", \"ms\": " << m.milliseconds
+                << ", \"states\": " << m.states << ", \"edges\": " << m.edges << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    int runBenchmarks(bool quick, unsigned threads, const std::string &jsonPath) {
+        std::vector<measurement> results;
+        std::mt19937 rng(1);
+        uint32_t scale = quick ? 10 : 1;
+
+        // Random NFAs get extra edges on a third of their states; the sparse
+        // ones, with an extra edge on one state in fifty, go to a million.
+        for(uint32_t states : {1000u, 2000u, 4000u}) {
+            states /= scale;
+            measurePipeline("random " + std::to_string(states), randomNFA(rng, states, states / 3, 8, 0.4), threads, results);
+        }
+        for(uint32_t states : {100000u, 1000000u}) {
+            states /= scale;
+            measurePipeline("sparse random " + std::to_string(states),
+                            randomNFA(rng, states, states / 50, 8, 0.6), threads, results);
+        }
+        for(uint32_t length : {100000u, 1000000u}) {
+            length /= scale;
+            measurePipeline("epsilon chain " + std::to_string(length), epsilonChain(length), threads, results);
+        }
+        for(uint32_t symbols : {64u, 1024u}) {
+            measurePipeline("dense " + std::to_string(symbols) + " symbols",
+                            denseAlphabet(rng, 2000 / scale, symbols, 32), threads, results);
+        }
+        for(uint32_t n : {12u, 16u, 20u}) {
+            if(quick && n > 16) break;
+            measurePipeline("nth-from-last " + std::to_string(n), nthFromLast(n, false), threads, results);
+            measurePipeline("nth-from-last " + std::to_string(n) + " +eps", nthFromLast(n, true), threads, results);
+            measureSteps("nth-from-last " + std::to_string(n), nthFromLast(n, false), 2, results);
+        }
+        for(uint32_t states : {100u, 1000u}) {
+            measureSteps("random " + std::to_string(states), randomNFA(rng, states, states / 3, 8, 0.4), 8, results);
+        }
+
+        if(!jsonPath.empty()) writeJson(jsonPath, results);
+        return 0;
+    }
+}
+
+int main(int argc, char **argv) {
+    std::setvbuf(stdout, nullptr, _IOLBF, 0);
+    bool check = false;
+    bool quick = false;
+    unsigned iterations = 5000;
+    unsigned seed = 1;
+    unsigned threads = 0;
+    std::string jsonPath;
+    for(int i = 1; i < argc; i++) {
+        if(!std::strcmp(argv[i], "--check")) {
+            check = true;
+            if(i + 1 < argc && argv[i + 1][0] != '-') iterations = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--quick")) {
+            quick = true;
+        } else if(!std::strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--json") && i + 1 < argc) {
+            jsonPath = argv[++i];
+        } else {
+            std::fprintf(stderr, "usage: %s [--quick] [--threads N] [--json FILE] | --check [ITERATIONS] [--seed N]\n", argv[0]);
+            return 2;
+        }
+    }
+    return check ? runCheck(iterations, seed) : runBenchmarks(quick, threads, jsonPath);
+}
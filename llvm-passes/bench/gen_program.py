@@ -0,0 +1,249 @@
+import argparse
+import random
+
+# Synthetic programs for the pass benchmarks. One random program is drawn
+# from the parameters below and written both as C and as LLVM IR, so the
+# benchmarks run where only opt is installed while the C version can still
+# go through a real front end.
+#
+#   functions       defined functions besides main
+#   depth           nesting depth of if/else inside a function
+#   loops           nesting depth of loops inside a function
+#   recursion       share of functions that call themselves or a later one
+#   libc_density    chance that a statement is a libc call
+#
+# Calls to defined functions only go to earlier functions unless the caller
+# was picked for recursion, so call graph SCCs stay as rare as asked.
+
+# name, C return type, IR return type, IR parameters, C arguments, IR arguments
+LIBC_CALLS = [
+    ("getpid", "int", "i32", "", "", ""),
+    ("getppid", "int", "i32", "", "", ""),
+    ("getuid", "unsigned", "i32", "", "", ""),
+    ("rand", "int", "i32", "", "", ""),
+    ("sched_yield", "int", "i32", "", "", ""),
+    ("puts", "int", "i32", "i8*", "bench_text", "i8* getelementptr inbounds ([6 x i8], [6 x i8]* @bench_text, i64 0, i64 0)"),
+    ("strlen", "unsigned long", "i64", "i8*", "bench_text", "i8* getelementptr inbounds ([6 x i8], [6 x i8]* @bench_text, i64 0, i64 0)"),
+    ("close", "int", "i32", "i32", "-1", "i32 -1"),
+    ("usleep", "int", "i32", "i32", "0", "i32 0"),
+    ("abs", "int", "i32", "i32", "0", "i32 0"),
+]
+
+
+class program:
+    def __init__(self, args):
+        self.args = args
+        self.rng = random.Random(args.seed)
+        self.recursive = set(f for f in range(args.functions) if self.rng.random() < args.recursion)
+        self.bodies = [self.block(f, args.depth, args.loops, 0) for f in range(args.functions)]
+
+    # Statements: ("libc", index), ("call", callee), ("if", then, else),
+    # ("loop", trips, body).
+    def block(self, func, depth, loops, level):
+        statements = []
+        for _ in range(self.rng.randint(1, 3)):
+            statements.append(self.statement(func, depth, loops, level))
+        return statements
+
+    def statement(self, func, depth, loops, level):
+        roll = self.rng.random()
+        if roll < self.args.libc_density:
+            return ("libc", self.rng.randrange(len(LIBC_CALLS)))
+        if depth > 0 and roll < self.args.libc_density + 0.3:
+            return ("if", self.block(func, depth - 1, loops, level + 1), self.block(func, depth - 1, loops, level + 1))
+        if loops > 0 and roll < self.args.libc_density + 0.5:
+            return ("loop", self.rng.randint(2, 8), self.block(func, depth, loops - 1, level + 1))
+        return ("call", self.callee(func))
+
+    def callee(self, func):
+        if func in self.recursive and self.rng.random() < 0.5:
+            return self.rng.randrange(func, self.args.functions)
+        if func == 0:
+            return None
+        return self.rng.randrange(func)
+
+    def roots(self):
+        # main calls the functions nothing else calls, newest first, so
+        # every function is reachable.
+        called = set()
+
+        def walk(statements):
+            for statement in statements:
+                if statement[0] == "call" and statement[1] is not None:
+                    called.add(statement[1])
+                elif statement[0] == "if":
+                    walk(statement[1])
+                    walk(statement[2])
+                elif statement[0] == "loop":
+                    walk(statement[2])
+
+        for body in self.bodies:
+            walk(body)
+        return [f for f in reversed(range(self.args.functions)) if f not in called]
+
+
+def emit_c(prog):
+    out = ["#include <stdlib.h>", "#include <stdio.h>", "#include <string.h>", "#include <sched.h>", "#include <unistd.h>", "",
+           "volatile int bench_cond;", "static const char bench_text[] = \"bench\";", ""]
+    for f in range(prog.args.functions):
+        out.append(f"void f{f}(void);")
+    out.append("")
+
+    def block(statements, indent):
+        pad = "    " * indent
+        for statement in statements:
+            if statement[0] == "libc":
+                name, _, _, _, cargs, _ = LIBC_CALLS[statement[1]]
+                out.append(f"{pad}(void){name}({cargs});")
+            elif statement[0] == "call":
+                if statement[1] is not None:
+                    out.append(f"{pad}if(bench_cond) f{statement[1]}();")
+            elif statement[0] == "if":
+                out.append(f"{pad}if(bench_cond) {{")
+                block(statement[1], indent + 1)
+                out.append(f"{pad}}} else {{")
+                block(statement[2], indent + 1)
+                out.append(f"{pad}}}")
+            else:
+                var = f"i{indent}"
+                out.append(f"{pad}for(int {var} = 0; {var} < {statement[1]}; {var}++) {{")
+                block(statement[2], indent + 1)
+                out.append(f"{pad}}}")
+
+    for f, body in enumerate(prog.bodies):
+        out.append(f"void f{f}(void) {{")
+        block(body, 1)
+        out.append("}")
+        out.append("")
+    out.append("int main(void) {")
+    for f in prog.roots():
+        out.append(f"    f{f}();")
+    out.append("    return 0;")
+    out.append("}")
+    return "\n".join(out) + "\n"
+
+
+class irFunction:
+    def __init__(self):
+        self.lines = []
+        self.next_value = 0
+        self.next_block = 0
+
+    def value(self):
+        self.next_value += 1
+        return f"%v{self.next_value}"
+
+    def label(self, kind):
+        self.next_block += 1
+        return f"{kind}{self.next_block}"
+
+    def emit(self, line):
+        self.lines.append("  " + line)
+
+    def begin(self, label):
+        self.lines.append(f"{label}:")
+
+
+def emit_ir(prog, source_name):
+    out = [f"source_filename = \"{source_name}\"", "",
+           "@bench_cond = global i32 0, align 4",
+           "@bench_text = private unnamed_addr constant [6 x i8] c\"bench\\00\", align 1", ""]
+
+    def condition(fn):
+        loaded = fn.value()
+        fn.emit(f"{loaded} = load volatile i32, i32* @bench_cond, align 4")
+        taken = fn.value()
+        fn.emit(f"{taken} = icmp ne i32 {loaded}, 0")
+        return taken
+
+    def block(fn, statements):
+        for statement in statements:
+            if statement[0] == "libc":
+                name, _, ret, _, _, irargs = LIBC_CALLS[statement[1]]
+                fn.emit(f"{fn.value()} = call {ret} @{name}({irargs})")
+            elif statement[0] == "call":
+                if statement[1] is None:
+                    continue
+                taken = condition(fn)
+                then, done = fn.label("call"), fn.label("after")
+                fn.emit(f"br i1 {taken}, label %{then}, label %{done}")
+                fn.begin(then)
+                fn.emit(f"call void @f{statement[1]}()")
+                fn.emit(f"br label %{done}")
+                fn.begin(done)
+            elif statement[0] == "if":
+                taken = condition(fn)
+                then, other, done = fn.label("then"), fn.label("else"), fn.label("endif")
+                fn.emit(f"br i1 {taken}, label %{then}, label %{other}")
+                fn.begin(then)
+                block(fn, statement[1])
+                fn.emit(f"br label %{done}")
+                fn.begin(other)
+                block(fn, statement[2])
+                fn.emit(f"br label %{done}")
+                fn.begin(done)
+            else:
+                counter = fn.value()
+                fn.lines.insert(1, f"  {counter} = alloca i32, align 4")
+                fn.emit(f"store i32 0, i32* {counter}, align 4")
+                head, body, done = fn.label("loop"), fn.label("body"), fn.label("endloop")
+                fn.emit(f"br label %{head}")
+                fn.begin(head)
+                current = fn.value()
+                fn.emit(f"{current} = load i32, i32* {counter}, align 4")
+                more = fn.value()
+                fn.emit(f"{more} = icmp slt i32 {current}, {statement[1]}")
+                fn.emit(f"br i1 {more}, label %{body}, label %{done}")
+                fn.begin(body)
+                block(fn, statement[2])
+                now = fn.value()
+                fn.emit(f"{now} = load i32, i32* {counter}, align 4")
+                step = fn.value()
+                fn.emit(f"{step} = add nsw i32 {now}, 1")
+                fn.emit(f"store i32 {step}, i32* {counter}, align 4")
+                fn.emit(f"br label %{head}")
+                fn.begin(done)
+
+    for f, body in enumerate(prog.bodies):
+        fn = irFunction()
+        fn.begin("entry")
+        block(fn, body)
+        fn.emit("ret void")
+        out.append(f"define void @f{f}() {{")
+        out.extend(fn.lines)
+        out.append("}")
+        out.append("")
+
+    out.append("define i32 @main() {")
+    out.append("entry:")
+    for f in prog.roots():
+        out.append(f"  call void @f{f}()")
+    out.append("  ret i32 0")
+    out.append("}")
+    out.append("")
+    for name, _, ret, params, _, _ in LIBC_CALLS:
+        out.append(f"declare {ret} @{name}({params})")
+    return "\n".join(out) + "\n"
+
+
+def main():
+    parser = argparse.ArgumentParser(description = "Generate a synthetic benchmark program as C and LLVM IR.")
+    parser.add_argument("--functions", type = int, default = 100)
+    parser.add_argument("--depth", type = int, default = 2)
+    parser.add_argument("--loops", type = int, default = 1)
+    parser.add_argument("--recursion", type = float, default = 0.05)
+    parser.add_argument("--libc-density", type = float, default = 0.4)
+    parser.add_argument("--seed", type = int, default = 1)
+    parser.add_argument("--out", required = True, help = "output path without extension; writes <out>.c and <out>.ll")
+    args = parser.parse_args()
+
+    prog = program(args)
+    source_name = args.out.rsplit("/", 1)[-1] + ".c"
+    with open(args.out + ".c", "w") as f:
+        f.write(emit_c(prog))
+    with open(args.out + ".ll", "w") as f:
+        f.write(emit_ir(prog, source_name))
+
+
+if __name__ == "__main__":
+    main()
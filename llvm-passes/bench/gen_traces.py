@@ -0,0 +1,94 @@
+import argparse
+import array
+import random
+import struct
+import sys
+
+# Recordings for fsm-trace-check: random walks over a transition table
+# (AutomatonFormat.h), written as a .fsmtrace file (TraceFormat.h). A walk
+# stops in a final state or at --max-length events; a share of the traces
+# gets one event replaced by an event that state does not allow, so the
+# checker has violations to find.
+
+TABLE_HEADER = struct.Struct("=10I9Q")
+TABLE_MAGIC = 0x544d5346
+TRACE_MAGIC = 0x52545346
+TRACE_VERSION = 1
+TRACE_END = 0xffffffff
+NO_LIBC_ID = 0xffffffff
+
+
+def load_table(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    (magic, _, num_states, num_symbols, num_edges, start, _, _, _, _,
+     libc_ids_at, _, _, finals_at, offsets_at, labels_at, targets_at, _, _) = TABLE_HEADER.unpack_from(data)
+    if magic != TABLE_MAGIC:
+        sys.exit(f"{path}: not a transition table")
+
+    def section(offset, count, code):
+        values = array.array(code)
+        values.frombytes(data[offset:offset + count * values.itemsize])
+        return values
+
+    finals = section(finals_at, (num_states + 63) // 64, "Q")
+    offsets = section(offsets_at, num_states + 1, "I")
+    labels = section(labels_at, num_edges, "I")
+    targets = section(targets_at, num_edges, "I")
+    return {
+        "start": start,
+        "events": section(libc_ids_at, num_symbols, "I"),
+        "final": [bool(finals[s // 64] >> (s % 64) & 1) for s in range(num_states)],
+        "edges": [list(zip(labels[offsets[s]:offsets[s + 1]], targets[offsets[s]:offsets[s + 1]])) for s in range(num_states)],
+    }
+
+
+def walk(table, rng, max_length, broken):
+    trace = array.array("I")
+    state = table["start"]
+    events = table["events"]
+    while len(trace) < max_length:
+        edges = [(label, target) for label, target in table["edges"][state] if events[label] != NO_LIBC_ID]
+        if not edges or (table["final"][state] and rng.random() < 0.1):
+            break
+        label, state = rng.choice(edges)
+        trace.append(events[label])
+    if broken:
+        state = table["start"]
+        position = rng.randrange(len(trace) + 1)
+        for event in trace[:position]:
+            state = next(target for label, target in table["edges"][state] if events[label] == event)
+        allowed = {events[label] for label, _ in table["edges"][state]}
+        illegal = [event for event in set(events) | {0} if event not in allowed and event != NO_LIBC_ID]
+        if illegal:
+            trace.insert(position, rng.choice(sorted(illegal)))
+    return trace
+
+
+def main():
+    parser = argparse.ArgumentParser(description = "Write random traces of a transition table as a .fsmtrace recording.")
+    parser.add_argument("--table", required = True, help = "<stem>_cfg.fsmt written with table")
+    parser.add_argument("--traces", type = int, default = 100000)
+    parser.add_argument("--max-length", type = int, default = 64)
+    parser.add_argument("--broken", type = float, default = 0.001, help = "share of traces with an illegal event")
+    parser.add_argument("--seed", type = int, default = 1)
+    parser.add_argument("--text", action = "store_true", help = "one trace per line instead of the binary format")
+    parser.add_argument("--out", required = True)
+    args = parser.parse_args()
+
+    table = load_table(args.table)
+    rng = random.Random(args.seed)
+    with open(args.out, "w" if args.text else "wb") as out:
+        if not args.text:
+            out.write(struct.pack("=2I", TRACE_MAGIC, TRACE_VERSION))
+        for _ in range(args.traces):
+            trace = walk(table, rng, args.max_length, rng.random() < args.broken)
+            if args.text:
+                out.write(" ".join(map(str, trace)) + "\n")
+            else:
+                trace.append(TRACE_END)
+                out.write(trace.tobytes())
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,215 @@
+import argparse
+import datetime
+import json
+import os
+import platform
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from types import SimpleNamespace
+
+import gen_program
+
+# Runs the CFG passes over synthetic programs and given bitcode, and writes
+# wall time, peak RSS and the time of each engine stage to a JSON file.
+# Stage times come from the stage timers in CFGEngine.cpp, read back from
+# opt's -time-trace output; a stage that did not run is left out.
+
+STAGES = {
+    "CFGBuildGraph": "graph_build",
+    "CFGRemoveEpsilon": "epsilon_removal",
+    "CFGDeterminize": "determinization",
+    "CFGMinimize": "minimization",
+    "CFGWriteDot": "dot_dump",
+    "CFGWriteTable": "table_write",
+}
+
+# name -> (plugins, pipeline with {} for the CFG pass parameters)
+PASSES = {
+    "libc": (["LibcPass.so"], "libc-cfg-pass{}"),
+    "syscall": (["InstrumentPass.so", "SyscallPass.so"], "instrument-pass,syscall-cfg-pass{}"),
+    "cfg": (["InstrumentPass.so", "CFGPass.so"], "instrument-pass,cfg-pass{}"),
+}
+
+SCHEMA_VERSION = 1
+
+
+def synthetic_corpus(work, sizes, seed):
+    inputs = []
+    for size in sizes:
+        args = SimpleNamespace(functions = size, depth = 2, loops = 1, recursion = 0.05, libc_density = 0.4, seed = seed)
+        prog = gen_program.program(args)
+        name = f"synth_{size}"
+        with open(os.path.join(work, name + ".ll"), "w") as f:
+            f.write(gen_program.emit_ir(prog, name + ".c"))
+        inputs.append({"input": name, "path": os.path.join(work, name + ".ll"), "generator": vars(args)})
+    return inputs
+
+
+def real_corpus(paths):
+    inputs = []
+    for path in paths:
+        if os.path.isdir(path):
+            for root, _, files in os.walk(path):
+                for name in sorted(files):
+                    if name.endswith((".bc", ".ll")):
+                        inputs.append({"input": os.path.relpath(os.path.join(root, name), path), "path": os.path.join(root, name)})
+        else:
+            inputs.append({"input": os.path.basename(path), "path": path})
+    return inputs
+
+
+def run_once(opt, build, pass_name, variant, path, work, timeout):
+    plugins, pipeline = PASSES[pass_name]
+    cwd = tempfile.mkdtemp(dir = work)
+    trace = os.path.join(cwd, "trace.json")
+    command = [opt]
+    command += [f"-load-pass-plugin={os.path.join(build, plugin)}" for plugin in plugins]
+    command += [f"-passes={pipeline.format(f'<{variant}>' if variant else '')}", os.path.abspath(path), "-o", "/dev/null",
+                "--time-trace", "--time-trace-granularity=0", f"--time-trace-file={trace}"]
+
+    begin = time.perf_counter()
+    child = subprocess.Popen(command, cwd = cwd, stdout = subprocess.DEVNULL, stderr = subprocess.PIPE)
+    timer = threading.Timer(timeout, child.kill)
+    timer.start()
+    stderr = child.stderr.read()
+    _, status, usage = os.wait4(child.pid, 0)
+    wall = time.perf_counter() - begin
+    timer.cancel()
+    child.returncode = os.waitstatus_to_exitcode(status)
+    if wall >= timeout:
+        shutil.rmtree(cwd)
+        return {"wall_ms": wall * 1000.0, "peak_rss_kb": usage.ru_maxrss, "stages_ms": {}, "timed_out": True}
+    if child.returncode != 0:
+        shutil.rmtree(cwd)
+        raise RuntimeError(f"{' '.join(command)} failed:\n{stderr.decode(errors = 'replace')}")
+
+    stages = {}
+    with open(trace) as f:
+        for event in json.load(f)["traceEvents"]:
+            stage = STAGES.get(event.get("name"))
+            if stage and event.get("ph") == "X":
+                stages[stage] = stages.get(stage, 0.0) + event["dur"] / 1000.0
+    shutil.rmtree(cwd)
+    # ru_maxrss is in KiB on Linux.
+    return {"wall_ms": wall * 1000.0, "peak_rss_kb": usage.ru_maxrss, "stages_ms": stages}
+
+
+def summarize(runs):
+    stages = {}
+    for stage in STAGES.values():
+        values = [run["stages_ms"][stage] for run in runs if stage in run["stages_ms"]]
+        if values:
+            stages[stage] = round(statistics.median(values), 3)
+    summary = {
+        "runs": len(runs),
+        "wall_ms": round(statistics.median(run["wall_ms"] for run in runs), 3),
+        "peak_rss_kb": max(run["peak_rss_kb"] for run in runs),
+        "stages_ms": stages,
+    }
+    if any(run.get("timed_out") for run in runs):
+        summary["timed_out"] = True
+    return summary
+
+
+def describe_host(opt):
+    info = {"host": platform.node(), "cpus": os.cpu_count(), "platform": platform.platform()}
+    try:
+        version = subprocess.run([opt, "--version"], capture_output = True, text = True).stdout
+        info["opt"] = next(line.strip() for line in version.splitlines() if "version" in line)
+    except (OSError, StopIteration):
+        pass
+    commit = subprocess.run(["git", "rev-parse", "HEAD"], capture_output = True, text = True)
+    if commit.returncode == 0:
+        info["commit"] = commit.stdout.strip()
+    return info
+
+
+def compare(results, baseline_path, threshold):
+    """Prints results whose wall time or peak RSS grew by more than
+    `threshold` over the baseline file. Returns how many did."""
+    with open(baseline_path) as f:
+        baseline = {(r["input"], r["pass"], r["options"]): r for r in json.load(f)["results"]}
+    regressions = 0
+    for result in results:
+        old = baseline.get((result["input"], result["pass"], result["options"]))
+        if not old:
+            continue
+        for metric in ("wall_ms", "peak_rss_kb"):
+            if old[metric] > 0 and result[metric] > old[metric] * (1 + threshold):
+                regressions += 1
+                print(f"regression: {result['input']} {result['pass']}<{result['options']}> {metric} "
+                      f"{old[metric]} -> {result[metric]}")
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description = "Benchmark the CFG passes.")
+    parser.add_argument("--build", default = "build", help = "directory with the pass plugins")
+    parser.add_argument("--work", default = None, help = "directory for generated programs (default: a temporary one)")
+    parser.add_argument("--out", required = True, help = "JSON file to write")
+    parser.add_argument("--synthetic", default = "100,1000,5000", help = "comma-separated function counts, or empty")
+    parser.add_argument("--seed", type = int, default = 1)
+    parser.add_argument("--corpus", nargs = "*", default = [], help = ".bc/.ll files or directories to search for them")
+    parser.add_argument("--passes", default = ",".join(PASSES), help = "comma-separated subset of " + ", ".join(PASSES))
+    # A summary still holds a copy of a callee for every path to it through
+    # the call graph, so summaries are left out unless asked for.
+    parser.add_argument("--variants", default = ",minimize",
+                        help = "comma-separated pass parameters, ';' between several; empty for the defaults")
+    parser.add_argument("--repeat", type = int, default = 3)
+    parser.add_argument("--timeout", type = float, default = 300, help = "seconds before a run is killed and recorded as timed out")
+    parser.add_argument("--opt", default = "opt")
+    parser.add_argument("--baseline", help = "earlier results to compare against")
+    parser.add_argument("--threshold", type = float, default = 0.10, help = "relative growth reported as a regression")
+    args = parser.parse_args()
+
+    # opt runs in a scratch directory per run, since the passes write their
+    # outputs to the working directory.
+    build = os.path.abspath(args.build)
+    work = os.path.abspath(args.work or tempfile.mkdtemp(prefix = "cfg-bench-"))
+    os.makedirs(work, exist_ok = True)
+    sizes = [int(size) for size in args.synthetic.split(",") if size]
+    inputs = synthetic_corpus(work, sizes, args.seed) + real_corpus(args.corpus)
+
+    results = []
+    for item in inputs:
+        for pass_name in args.passes.split(","):
+            for variant in args.variants.split(","):
+                runs = []
+                for _ in range(args.repeat):
+                    runs.append(run_once(args.opt, build, pass_name, variant, item["path"], work, args.timeout))
+                    if runs[-1].get("timed_out"):
+                        break
+                result = {"input": item["input"], "pass": pass_name, "options": variant}
+                if "generator" in item:
+                    result["generator"] = item["generator"]
+                result.update(summarize(runs))
+                results.append(result)
+                stages = " ".join(f"{stage}={ms:.1f}" for stage, ms in result["stages_ms"].items())
+                if result.get("timed_out"):
+                    stages = "timed out"
+                print(f"{item['input']:>24} {pass_name:>8} {variant or '-':>20} {result['wall_ms']:10.1f} ms "
+                      f"{result['peak_rss_kb'] / 1024:8.1f} MiB  {stages}", flush = True)
+
+    report = {
+        "schema": SCHEMA_VERSION,
+        "timestamp": datetime.datetime.now(datetime.timezone.utc).isoformat(timespec = "seconds"),
+        "environment": describe_host(args.opt),
+        "results": results,
+    }
+    with open(args.out, "w") as f:
+        json.dump(report, f, indent = 2)
+        f.write("\n")
+    if not args.work:
+        shutil.rmtree(work)
+
+    if args.baseline and compare(results, args.baseline, args.threshold):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,97 @@
+import argparse
+import datetime
+import json
+import os
+import platform
+import statistics
+import subprocess
+import sys
+import time
+
+# Runs builds of test/threads.c with a growing number of threads, each doing
+# the same work, and writes the wall time of each to a JSON file. Monitor
+# state lives in each thread's TLS, so with no more threads than cores an
+# enforced build should take about as long for 8 threads as for 1, and keep
+# the same overhead over the plain build at every count; time that grows
+# with the thread count means the threads contend for something.
+
+SCHEMA_VERSION = 1
+
+
+def run_once(exe, threads, iterations, timeout):
+    started = time.perf_counter()
+    try:
+        proc = subprocess.run([exe, str(threads), str(iterations)], capture_output = True, text = True, timeout = timeout)
+    except subprocess.TimeoutExpired:
+        return None
+    wall_ms = (time.perf_counter() - started) * 1000
+    if proc.returncode != 0:
+        sys.exit(f"{exe} {threads} {iterations} failed with {proc.returncode}:\n{proc.stderr}")
+    return wall_ms
+
+
+def main():
+    parser = argparse.ArgumentParser(description = "Measure how builds of the threaded test program scale with threads.")
+    parser.add_argument("builds", nargs = "+", help = "name=executable, e.g. plain=test/threads inline=test/threads.enforced")
+    parser.add_argument("--threads", default = "1,2,4,8", help = "comma-separated thread counts")
+    parser.add_argument("--iterations", type = int, default = 1000000, help = "loop iterations per thread")
+    parser.add_argument("--repeat", type = int, default = 5)
+    parser.add_argument("--timeout", type = float, default = 300)
+    parser.add_argument("--out", required = True, help = "JSON file to write")
+    args = parser.parse_args()
+
+    builds = []
+    for build in args.builds:
+        name, sep, exe = build.partition("=")
+        if not sep or not os.access(exe, os.X_OK):
+            sys.exit(f"not a name=executable pair: {build}")
+        builds.append((name, os.path.abspath(exe)))
+    counts = [int(count) for count in args.threads.split(",") if count]
+    if max(counts) > (os.cpu_count() or 1):
+        print(f"note: {os.cpu_count()} CPUs, so runs with more threads share cores and slow down regardless", file = sys.stderr)
+
+    results = []
+    for name, exe in builds:
+        single = None
+        for threads in counts:
+            times = [run_once(exe, threads, args.iterations, args.timeout) for _ in range(args.repeat)]
+            if None in times:
+                results.append({"build": name, "threads": threads, "timed_out": True})
+                print(f"{name:>12} {threads:>4} threads  timed out", flush = True)
+                continue
+            wall_ms = statistics.median(times)
+            single = single or wall_ms
+            result = {
+                "build": name,
+                "threads": threads,
+                "wall_ms": round(wall_ms, 3),
+                "min_ms": round(min(times), 3),
+                # Iterations per second each thread gets through.
+                "per_thread_rate": round(args.iterations / wall_ms * 1000),
+                # Wall time relative to the first thread count; 1.0 is perfect scaling.
+                "slowdown": round(wall_ms / single, 3),
+            }
+            results.append(result)
+            print(f"{name:>12} {threads:>4} threads {wall_ms:10.1f} ms {result['per_thread_rate']:>12}/s per thread "
+                  f"x{result['slowdown']:.2f}", flush = True)
+
+    # Overhead of every build over the first one at the same thread count.
+    base = {r["threads"]: r["wall_ms"] for r in results if r["build"] == builds[0][0] and "wall_ms" in r}
+    for result in results:
+        if "wall_ms" in result and base.get(result["threads"]):
+            result["overhead"] = round(result["wall_ms"] / base[result["threads"]], 3)
+
+    report = {
+        "schema": SCHEMA_VERSION,
+        "timestamp": datetime.datetime.now(datetime.timezone.utc).isoformat(timespec = "seconds"),
+        "environment": {"host": platform.node(), "cpus": os.cpu_count(), "platform": platform.platform()},
+        "iterations": args.iterations,
+        "results": results,
+    }
+    with open(args.out, "w") as f:
+        json.dump(report, f, indent = 2)
+        f.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,276 @@
+#pragma once
+
+/*
+ * Flat binary transition table written by the CFG passes (<stem>_cfg.fsmt).
+ *
+ * The file is meant to be mmap'ed and used in place: a fixed header followed
+ * by 8-byte aligned sections, all located by byte offsets from the start of
+ * the file. Integers are in the writer's native byte order; a consumer on a
+ * different byte order sees a bad magic and rejects the file.
+ *
+ * Transitions are stored in CSR form: the outgoing edges of state s are
+ * edge_labels/edge_targets[edge_offsets[s] .. edge_offsets[s + 1]), sorted by
+ * label. Labels are indices into the table's own alphabet; symbol_libc_ids
+ * maps each of them to the libc ID assigned in DummySyscalls.h, and libc_map
+ * is the inverse, indexed by libc ID.
+ *
+ * The CFG passes' lazy option writes the ε-free NFA instead of the DFA, in
+ * which a state may have several edges with one label. Such a table has
+ * FSM_TABLE_NONDETERMINISTIC set; fsm_table_step() cannot run it, so
+ * fsm_table_open() rejects it and only fsm_table_open_nfa() takes it.
+ *
+ * This header is plain C so the enforcement runtime can include it.
+ *
+ * Traps and inline enforcement step the table before each call is made.
+ * The event ring of mode=ring is checked in batches, each one before the
+ * next call that enters the kernel (see EventRing.h).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FSM_TABLE_MAGIC   0x544d5346u /* "FSMT" */
+#define FSM_TABLE_VERSION 2u
+#define FSM_NO_STATE      0xffffffffu
+#define FSM_NO_SYMBOL     0xffffffffu
+#define FSM_NO_LIBC_ID    0xffffffffu
+
+/* fsm_table_header.flags */
+#define FSM_TABLE_NONDETERMINISTIC 0x1u
+
+/*
+ * Event IDs from FSM_LOOP_EVENT_BASE up are not libc calls but loop
+ * boundaries inserted by syscall-cfg-pass<hoist-loops>: loop k of a module
+ * reports FSM_LOOP_EVENT_BASE + 2k on entry and FSM_LOOP_EVENT_BASE + 2k + 1
+ * on exit. The base leaves room above the libc IDs of DummySyscalls.h.
+ */
+#define FSM_LOOP_EVENT_BASE 0x1000u
+
+/*
+ * A thread the program starts with pthread_create() or thrd_create()
+ * reports FSM_THREAD_EVENT_BASE + k before anything else, where k numbers
+ * the module's thread start routines (threadEntryFunctions() in
+ * EntryPoints.cpp). Out of the start state that event leads into the
+ * automaton of routine k, so one table holds the automata of all threads
+ * and each thread steps its own state through it. Up to
+ * FSM_MAX_THREAD_ENTRIES routines fit between the libc IDs and the loop
+ * events.
+ */
+#define FSM_THREAD_EVENT_BASE  0xc00u
+#define FSM_MAX_THREAD_ENTRIES 0x400u
+
+struct fsm_table_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_states;
+    uint32_t num_symbols;
+    uint32_t num_edges;
+    uint32_t start_state;
+    uint32_t libc_map_size;
+    uint32_t string_bytes;
+    uint32_t flags;
+    uint32_t reserved;
+
+    uint64_t symbol_libc_ids_offset; /* uint32_t[num_symbols] */
+    uint64_t symbol_names_offset;    /* uint32_t[num_symbols + 1], offsets into strings */
+    uint64_t strings_offset;         /* char[string_bytes], labels without terminators */
+    uint64_t final_bitmap_offset;    /* uint64_t[(num_states + 63) / 64] */
+    uint64_t edge_offsets_offset;    /* uint32_t[num_states + 1] */
+    uint64_t edge_labels_offset;     /* uint32_t[num_edges] */
+    uint64_t edge_targets_offset;    /* uint32_t[num_edges] */
+    uint64_t libc_map_offset;        /* uint32_t[libc_map_size], libc ID -> symbol */
+    uint64_t file_size;
+};
+
+#define FSM_TABLE_SECTION(table, offset, type) \
+    ((const type *)((const char *)(table) + (table)->offset))
+
+/* Whether `count` elements of `width` bytes at `offset` lie inside the file, aligned. */
+static inline int fsm_table_section_fits(const struct fsm_table_header *table, uint64_t offset,
+                                         uint64_t count, uint64_t width) {
+    if(offset % width != 0 || offset < sizeof(struct fsm_table_header) || offset > table->file_size) return 0;
+    return count <= (table->file_size - offset) / width;
+}
+
+/*
+ * Returns the table header if `data` holds a well-formed table, NULL
+ * otherwise. The automaton may be nondeterministic. Every section must lie
+ * inside the file and every offset, label, target and symbol must be in
+ * range, so the accessors below never read outside `data`; a table is
+ * checked once, in time linear in its size. `data` must be 8-byte aligned.
+ */
+static inline const struct fsm_table_header *fsm_table_open_nfa(const void *data, size_t size) {
+    const struct fsm_table_header *table = (const struct fsm_table_header *)data;
+    if(data == NULL || size < sizeof(struct fsm_table_header)) return NULL;
+    if(table->magic != FSM_TABLE_MAGIC || table->version != FSM_TABLE_VERSION) return NULL;
+    if(table->file_size != size) return NULL;
+    if(table->num_states != 0 && table->start_state >= table->num_states) return NULL;
+    if(!fsm_table_section_fits(table, table->symbol_libc_ids_offset, table->num_symbols, sizeof(uint32_t)) ||
+       !fsm_table_section_fits(table, table->symbol_names_offset, (uint64_t)table->num_symbols + 1, sizeof(uint32_t)) ||
+       !fsm_table_section_fits(table, table->strings_offset, table->string_bytes, 1) ||
+       !fsm_table_section_fits(table, table->final_bitmap_offset, ((uint64_t)table->num_states + 63) / 64,
+                               sizeof(uint64_t)) ||
+       !fsm_table_section_fits(table, table->edge_offsets_offset, (uint64_t)table->num_states + 1, sizeof(uint32_t)) ||
+       !fsm_table_section_fits(table, table->edge_labels_offset, table->num_edges, sizeof(uint32_t)) ||
+       !fsm_table_section_fits(table, table->edge_targets_offset, table->num_edges, sizeof(uint32_t)) ||
+       !fsm_table_section_fits(table, table->libc_map_offset, table->libc_map_size, sizeof(uint32_t))) {
+        return NULL;
+    }
+
+    const uint32_t *names = FSM_TABLE_SECTION(table, symbol_names_offset, uint32_t);
+    for(uint32_t symbol = 0; symbol < table->num_symbols; symbol++) {
+        if(names[symbol] > names[symbol + 1] || names[symbol + 1] > table->string_bytes) return NULL;
+    }
+    const uint32_t *map = FSM_TABLE_SECTION(table, libc_map_offset, uint32_t);
+    for(uint32_t libc_id = 0; libc_id < table->libc_map_size; libc_id++) {
+        if(map[libc_id] != FSM_NO_SYMBOL && map[libc_id] >= table->num_symbols) return NULL;
+    }
+    /* Labels ascend within a state, strictly unless the table says it may repeat them. */
+    const uint32_t *offsets = FSM_TABLE_SECTION(table, edge_offsets_offset, uint32_t);
+    const uint32_t *labels = FSM_TABLE_SECTION(table, edge_labels_offset, uint32_t);
+    const uint32_t *targets = FSM_TABLE_SECTION(table, edge_targets_offset, uint32_t);
+    uint32_t repeat = (table->flags & FSM_TABLE_NONDETERMINISTIC) ? 1u : 0u;
+    if(offsets[0] != 0 || offsets[table->num_states] != table->num_edges) return NULL;
+    for(uint32_t state = 0; state < table->num_states; state++) {
+        if(offsets[state] > offsets[state + 1]) return NULL;
+        for(uint32_t edge = offsets[state]; edge < offsets[state + 1]; edge++) {
+            if(labels[edge] >= table->num_symbols || targets[edge] >= table->num_states) return NULL;
+            if(edge > offsets[state] && labels[edge] + repeat <= labels[edge - 1]) return NULL;
+        }
+    }
+    return table;
+}
+
+/* fsm_table_open_nfa() for the DFA tables fsm_table_step() can run. */
+static inline const struct fsm_table_header *fsm_table_open(const void *data, size_t size) {
+    const struct fsm_table_header *table = fsm_table_open_nfa(data, size);
+    if(table == NULL || (table->flags & FSM_TABLE_NONDETERMINISTIC)) return NULL;
+    return table;
+}
+
+static inline int fsm_table_is_final(const struct fsm_table_header *table, uint32_t state) {
+    const uint64_t *bitmap = FSM_TABLE_SECTION(table, final_bitmap_offset, uint64_t);
+    return (int)((bitmap[state / 64] >> (state % 64)) & 1u);
+}
+
+static inline uint32_t fsm_table_symbol_for_libc(const struct fsm_table_header *table, uint32_t libc_id) {
+    if(libc_id >= table->libc_map_size) return FSM_NO_SYMBOL;
+    return FSM_TABLE_SECTION(table, libc_map_offset, uint32_t)[libc_id];
+}
+
+/* Next state after `symbol`, or FSM_NO_STATE if the transition is illegal. */
+static inline uint32_t fsm_table_step(const struct fsm_table_header *table, uint32_t state, uint32_t symbol) {
+    const uint32_t *offsets = FSM_TABLE_SECTION(table, edge_offsets_offset, uint32_t);
+    const uint32_t *labels = FSM_TABLE_SECTION(table, edge_labels_offset, uint32_t);
+    uint32_t low = offsets[state];
+    uint32_t high = offsets[state + 1];
+    while(low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if(labels[middle] < symbol) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if(low < offsets[state + 1] && labels[low] == symbol) {
+        return FSM_TABLE_SECTION(table, edge_targets_offset, uint32_t)[low];
+    }
+    return FSM_NO_STATE;
+}
+
+/*
+ * Bit-parallel NFA image written by instrument-pass<engine=bitnfa> for
+ * modules whose DFA would be too large.
+ *
+ * The ε-free NFA is put in Glushkov form: position 0 stands for the start
+ * state, and every other position for one (state, label) pair that an edge
+ * enters, so all edges into a position carry the same label. A run keeps
+ * the set of positions it may be in as a bitset of num_words words and
+ * steps with
+ *
+ *     next = follow(active) & symbol_masks[symbol]
+ *
+ * where follow() is the union of the successors of every active position.
+ * It is looked up chunk_bits positions at a time: follow_tables holds, for
+ * chunk c and every value v of its bits, the union of the successors of
+ * the positions set in v, at [(c << chunk_bits) + v][0 .. num_words).
+ * An empty result means the event is illegal. Symbols, names and the libc
+ * map are laid out as in fsm_table_header.
+ */
+
+#define FSM_BITNFA_MAGIC   0x424d5346u /* "FSMB" */
+#define FSM_BITNFA_VERSION 1u
+
+struct fsm_bitnfa_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_positions;
+    uint32_t num_words;
+    uint32_t num_symbols;
+    uint32_t chunk_bits;             /* 1, 2, 4 or 8, so no chunk spans two words */
+    uint32_t libc_map_size;
+    uint32_t string_bytes;
+
+    uint64_t symbol_libc_ids_offset; /* uint32_t[num_symbols] */
+    uint64_t symbol_names_offset;    /* uint32_t[num_symbols + 1], offsets into strings */
+    uint64_t strings_offset;         /* char[string_bytes] */
+    uint64_t initial_offset;         /* uint64_t[num_words] */
+    uint64_t final_offset;           /* uint64_t[num_words] */
+    uint64_t symbol_masks_offset;    /* uint64_t[num_symbols][num_words] */
+    uint64_t follow_tables_offset;   /* uint64_t[num_chunks << chunk_bits][num_words] */
+    uint64_t libc_map_offset;        /* uint32_t[libc_map_size], libc ID -> symbol */
+    uint64_t file_size;
+};
+
+/* Returns the header if `data` holds a well-formed bit-parallel image, NULL otherwise. */
+static inline const struct fsm_bitnfa_header *fsm_bitnfa_open(const void *data, size_t size) {
+    const struct fsm_bitnfa_header *nfa = (const struct fsm_bitnfa_header *)data;
+    if(data == NULL || size < sizeof(struct fsm_bitnfa_header)) return NULL;
+    if(nfa->magic != FSM_BITNFA_MAGIC || nfa->version != FSM_BITNFA_VERSION) return NULL;
+    if(nfa->file_size != size) return NULL;
+    if(nfa->num_words != (nfa->num_positions + 63) / 64) return NULL;
+    if(nfa->chunk_bits == 0 || nfa->chunk_bits > 8 || 64 % nfa->chunk_bits != 0) return NULL;
+    return nfa;
+}
+
+static inline uint32_t fsm_bitnfa_symbol_for_libc(const struct fsm_bitnfa_header *nfa, uint32_t libc_id) {
+    if(libc_id >= nfa->libc_map_size) return FSM_NO_SYMBOL;
+    return FSM_TABLE_SECTION(nfa, libc_map_offset, uint32_t)[libc_id];
+}
+
+/*
+ * Writes the positions reachable from `active` over `symbol` to `next`
+ * (num_words words each, not overlapping) and returns 0 if there are
+ * none, i.e. the event is illegal. Chunks without an active position are
+ * skipped, so the cost grows with the active set, not with the automaton;
+ * the word loops are left to the compiler to vectorize.
+ */
+static inline int fsm_bitnfa_step(const struct fsm_bitnfa_header *nfa, const uint64_t *active,
+                                  uint64_t *next, uint32_t symbol) {
+    const uint64_t *follow = FSM_TABLE_SECTION(nfa, follow_tables_offset, uint64_t);
+    const uint64_t *mask = FSM_TABLE_SECTION(nfa, symbol_masks_offset, uint64_t) + (size_t)symbol * nfa->num_words;
+    uint32_t words = nfa->num_words;
+    uint32_t bits = nfa->chunk_bits;
+    /* chunk_bits is a power of two: divide by shifting */
+    uint32_t log_bits = (uint32_t)__builtin_ctz(bits);
+    uint64_t chunk_mask = ((uint64_t)1 << bits) - 1;
+    uint64_t any = 0;
+    uint32_t w, i;
+    for(i = 0; i < words; i++) next[i] = 0;
+    for(w = 0; w < words; w++) {
+        uint64_t pending = active[w];
+        while(pending != 0) {
+            uint32_t shift = ((uint32_t)__builtin_ctzll(pending) >> log_bits) << log_bits;
+            uint64_t value = (pending >> shift) & chunk_mask;
+            size_t chunk = ((size_t)w * 64 + shift) >> log_bits;
+            const uint64_t *row = follow + ((chunk << bits) + value) * words;
+            for(i = 0; i < words; i++) next[i] |= row[i];
+            pending &= ~(chunk_mask << shift);
+        }
+    }
+    for(i = 0; i < words; i++) {
+        next[i] &= mask[i];
+        any |= next[i];
+    }
+    return any != 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+/*
+ * Per-thread event buffer written by instrument-pass<mode=ring>.
+ *
+ * Every instrumented libc call appends its libc ID (DummySyscalls.h) to the
+ * calling thread's ring instead of trapping with syscall(470, id). A kernel
+ * consumer reads the ring on each syscall entry. The generated code hands
+ * the ring over by calling __fsm_ring_flush() when it is full, when a
+ * thread returns from its start routine, and right before every call that
+ * enters the kernel: syscall(), inline-asm syscalls, the libc syscall
+ * wrappers and stream I/O such as write(), execve(), fork() or printf(),
+ * and noreturn calls such as exit(). Such a call's own event is appended
+ * first, so the monitor has checked it before the call runs. The monitor
+ * checks the whole batch against the automaton and resets `count`.
+ *
+ * Libc calls that enter the kernel only now and then, such as malloc(),
+ * do not flush; a kernel consumer still sees their events at that syscall,
+ * the user-space stand-in only at the next flush.
+ *
+ * The layout is fixed so a kernel-side monitor can map the ring directly;
+ * runtime/FSMRing.c is a user-space stand-in for that consumer.
+ */
+
+#include <stdint.h>
+
+#define FSM_RING_CAPACITY 256u
+
+struct fsm_event_ring {
+    uint32_t count;                     /* events[0 .. count) are pending */
+    uint32_t events[FSM_RING_CAPACITY]; /* libc IDs, oldest first */
+};
@@ -11,21 +11,230 @@
 #include <numeric>
 #include <algorithm>
 #include <memory>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 namespace fsm {
-    struct nfaNode {
-        uint64_t nodeId;
-        bool isFinalState;
-        std::vector<std::pair<nfaNode*, std::string>> edges;
+    using symbolId = uint32_t;
+    using stateId = uint32_t;
 
-        nfaNode(uint64_t id, bool isFinal) : nodeId(id), isFinalState(isFinal) {}
+    // Interns transition labels into dense integer IDs. ID 0 is reserved for
+    // epsilon so the algorithms never have to look at the label text.
+    class Alphabet {
+        public:
+            static constexpr symbolId epsilon = 0;
+
+            Alphabet();
+            symbolId intern(const std::string &label);
+            const std::string& label(symbolId id) const;
+            size_t size() const {return labels.size();}
+        private:
+            std::unordered_map<std::string, symbolId> ids;
+            std::vector<const std::string*> labels;
+    };
+
+    // Owns all states of an automaton in flat arrays, addressed by index.
+    // Edges are appended to a build list while the graph is constructed and
+    // packed into CSR form (offsets + target/label arrays) by finalize();
+    // the accessors below are only valid on a finalized automaton.
+    class Automaton {
+        public:
+            static constexpr stateId noState = UINT32_MAX;
+
+            stateId start = noState;
+
+            stateId addState(bool isFinal = false);
+            void addEdge(stateId from, stateId to, symbolId label);
+            void setFinal(stateId state, bool isFinal = true) {finals[state] = isFinal;}
+            void finalize();
+            void clear();
+
+            bool isFinalized() const {return finalized;}
+            stateId numStates() const {return static_cast<stateId>(finals.size());}
+            size_t numEdges() const {return finalized ? targets.size() : pending.size();}
+            bool isFinal(stateId state) const {return finals[state] != 0;}
+
+            uint32_t edgeBegin(stateId state) const {return offsets[state];}
+            uint32_t edgeEnd(stateId state) const {return offsets[state + 1];}
+            stateId target(uint32_t edge) const {return targets[edge];}
+            symbolId label(uint32_t edge) const {return labels[edge];}
+            // Target of the edge labelled `label` out of `state`, or noState.
+            // Meant for DFAs; linear in the state's out-degree.
+            stateId next(stateId state, symbolId label) const;
+        private:
+            struct pendingEdge {
+                stateId from;
+                stateId to;
+                symbolId label;
+            };
+
+            bool finalized = false;
+            std::vector<uint8_t> finals;
+            std::vector<pendingEdge> pending;
+            std::vector<uint32_t> offsets;
+            std::vector<stateId> targets;
+            std::vector<symbolId> labels;
+    };
+
+    // Fixed set of worker threads that execute one indexed loop at a time.
+    // The calling thread takes part as worker 0, so a pool of size 1 runs
+    // everything inline.
+    class ThreadPool {
+        public:
+            explicit ThreadPool(unsigned numThreads);
+            ~ThreadPool();
+            ThreadPool(const ThreadPool&) = delete;
+            ThreadPool& operator=(const ThreadPool&) = delete;
+
+            unsigned size() const {return static_cast<unsigned>(workers.size()) + 1;}
+            void parallelFor(size_t count, const std::function<void(size_t index, unsigned worker)> &body);
+        private:
+            void workerLoop(unsigned worker);
+            void runJob(unsigned worker);
+
+            std::vector<std::thread> workers;
+            std::mutex lock;
+            std::condition_variable wakeUp;
+            std::condition_variable finished;
+            const std::function<void(size_t, unsigned)> *job = nullptr;
+            size_t jobCount = 0;
+            std::atomic<size_t> nextIndex{0};
+            unsigned activeWorkers = 0;
+            uint64_t generation = 0;
+            bool stopping = false;
+    };
+
+    std::vector<stateId> epsilonClosure(const Automaton &nfa, stateId state);
+
+    void removeEpsilonTransitions(Automaton &nfa);
+
+    // Subset construction. The frontier is expanded level by level across
+    // `numThreads` workers (0 = one per hardware thread); the result is
+    // renumbered breadth-first, so it does not depend on the thread count.
+    // An `nfa` without a start state gives an automaton without states.
+    // With a nonzero `maxStates` the construction gives up once it has
+    // created more states than that and returns an automaton without any
+    // (start == noState).
+    Automaton mergeEquivalentStates(const Automaton &nfa, unsigned numThreads = 1, size_t maxStates = 0);
+
+    // Quotient of an ε-free `nfa` by the states that agree on their next
+    // `rounds` steps: starting from final states, dead ends and the rest,
+    // each round splits states whose edges reach different classes under
+    // some label. A cheap stand-in for k-tails. Every word `nfa` accepts,
+    // or can start, the quotient does too, and it can stop wherever `nfa`
+    // can; with enough rounds the partition is the bisimulation one and the
+    // language is unchanged, and `stable` is set.
+    Automaton tailQuotient(const Automaton &nfa, unsigned rounds, bool *stable = nullptr);
+
+    // How determinizeWithin kept to its budget.
+    struct approximation {
+        static constexpr unsigned exact = UINT32_MAX;
+
+        // Whether the DFA is that of a quotient.
+        bool applied = false;
+        // The rounds of tailQuotient that fit, exact for the bisimulation
+        // quotient, which over-approximates nothing.
+        unsigned rounds = exact;
+        stateId quotientStates = 0;
     };
 
-    std::set<nfaNode*> epsilonClosure(nfaNode* node);
+    // mergeEquivalentStates with at most `maxStates` states (0 = no limit).
+    // When the DFA of `nfa` is larger, that of its tailQuotient is built
+    // instead, with as many rounds as fit, so the result accepts more than
+    // `nfa` but never less; the coarsest quotient, of at most eight states,
+    // is kept even over the budget. An `nfa` without a start state gives an
+    // empty automaton. `approximated` says what happened.
+    Automaton determinizeWithin(const Automaton &nfa, unsigned numThreads, size_t maxStates,
+                                approximation *approximated = nullptr);
+
+    // Subset construction on demand, after RE2's lazy DFA: a DFA state is
+    // created when a run first reaches it, and each of its transitions is
+    // computed once and memoized. States live in a cache of `cacheBytes`;
+    // when it is full it is flushed and refilled by the runs that go on.
+    // `nfa` must be ε-free and finalized, and outlive the LazyDFA. Not
+    // thread-safe: give every thread its own.
+    class LazyDFA {
+        public:
+            // A cached state, valid until the cache is flushed. start() and
+            // step() may flush, and the state either returns is valid, so a
+            // run can always continue from where it is.
+            using handle = uint32_t;
+            static constexpr handle dead = UINT32_MAX;
+
+            LazyDFA(const Automaton &nfa, size_t cacheBytes);
+            ~LazyDFA();
+            LazyDFA(LazyDFA&&) noexcept;
+            LazyDFA& operator=(LazyDFA&&) noexcept;
+
+            handle start();
+            // The state after `label`, or dead if no NFA state has a move on it.
+            handle step(handle from, symbolId label);
+            bool isFinal(handle state) const;
+            // Whether any NFA state of `state` has an outgoing edge.
+            bool hasMoves(handle state) const;
+            // The sorted NFA states `state` stands for.
+            const std::vector<stateId>& states(handle state) const;
+
+            size_t cachedStates() const;
+            size_t flushes() const;
+        private:
+            struct cache;
+            std::unique_ptr<cache> self;
+    };
+
+    // Merges language-equivalent states of a (partial) DFA by partition
+    // refinement. Missing transitions are kept missing, so the set of accepted
+    // prefixes is preserved as well as the accepted language.
+    Automaton minimizeDFA(const Automaton &dfa);
+
+    // For every state of `nfa`, the sorted set of states `dfa` can be in
+    // while a run of `nfa` is there. `dfa` must accept at least the language
+    // of `nfa`, e.g. because it was built from it.
+    std::vector<std::vector<stateId>> trackStates(const Automaton &nfa, const Automaton &dfa);
+
+    // Copies `fragment` into `into` and returns the copy of its start state.
+    // Edges labelled `marker` become epsilon edges to `continuation`, which
+    // is how a function summary returns to its call site. A fragment without
+    // a start state accepts nothing: nothing is copied and noState returned.
+    stateId embed(Automaton &into, const Automaton &fragment, symbolId marker, stateId continuation);
+
+    // A `dfa` without a start state is written as a graph without edges.
+    void writeDot(const Automaton &dfa, const Alphabet &alphabet, std::ostream &out);
+
+    // Loads the edges of a graph written by writeDot(), interning its labels
+    // into `alphabet`. The dot output does not mark final states, so none
+    // are set; the start state is the source of the first edge. Returns
+    // false if the file is missing or has no edges.
+    bool readDot(const std::string &path, Alphabet &alphabet, Automaton &dfa);
+
+    // Serializes a DFA into the flat table described in AutomatonFormat.h.
+    // `libcIdOf` maps a label to its DummySyscalls.h ID, or FSM_NO_LIBC_ID.
+    // An ε-free NFA is written too, flagged FSM_TABLE_NONDETERMINISTIC.
+    std::vector<char> tableImage(const Automaton &dfa, const Alphabet &alphabet,
+                                 const std::function<uint32_t(const std::string&)> &libcIdOf);
+    bool writeTable(const Automaton &dfa, const Alphabet &alphabet,
+                    const std::function<uint32_t(const std::string&)> &libcIdOf,
+                    const std::string &path);
 
-    void removeEpsilonTransitions(nfaNode* startNode);
+    // Number of positions of the bit-parallel form of `nfa`: the start plus
+    // one per distinct (target state, label) pair of its edges. `nfa` must
+    // be ε-free.
+    uint32_t countPositions(const Automaton &nfa);
 
-    nfaNode* mergeEquivalentStates(nfaNode* startNode);
+    // Serializes an ε-free NFA into the bit-parallel image described in
+    // AutomatonFormat.h, with the widest follow-table chunks that keep the
+    // tables within `maxFollowBytes`. Returns an empty image if not even
+    // 1-bit chunks fit, so the caller can enforce a DFA instead.
+    std::vector<char> bitParallelImage(const Automaton &nfa, const Alphabet &alphabet,
+                                       const std::function<uint32_t(const std::string&)> &libcIdOf,
+                                       size_t maxFollowBytes = size_t(1) << 20);
 
-    void clearGraph(nfaNode* startNode);
+    // Loads a table written by writeTable(), deterministic or not, interning
+    // its labels into `alphabet`. Returns false if the file is missing or
+    // malformed.
+    bool readTable(const std::string &path, Alphabet &alphabet, Automaton &dfa);
 }
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Counters and stage timers shared by the FSM code and the passes. Inside a
+// pass (FSM_WITH_LLVM) a counter is an LLVM statistic, shown by -stats and
+// -stats-json, and a stage shows up in -time-trace and -time-passes. In the
+// standalone library counters are plain atomics and stages are only timed
+// for their `elapsedMs` sink.
+
+#ifdef FSM_WITH_LLVM
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+
+#include <optional>
+
+// Needs DEBUG_TYPE, like STATISTIC. Counted even when NDEBUG turns plain
+// STATISTICs into no-ops, since production builds are the ones to watch.
+#define FSM_STATISTIC(var, desc) ALWAYS_ENABLED_STATISTIC(var, desc)
+#else
+#define FSM_STATISTIC(var, desc) static fsm::statistic var
+#endif
+
+namespace fsm {
+    class statistic {
+        public:
+            statistic& operator++() {value.fetch_add(1, std::memory_order_relaxed); return *this;}
+            statistic& operator+=(uint64_t amount) {value.fetch_add(amount, std::memory_order_relaxed); return *this;}
+            void updateMax(uint64_t candidate) {
+                uint64_t current = value.load(std::memory_order_relaxed);
+                while(candidate > current && !value.compare_exchange_weak(current, candidate, std::memory_order_relaxed)) {}
+            }
+            uint64_t getValue() const {return value.load(std::memory_order_relaxed);}
+        private:
+            std::atomic<uint64_t> value{0};
+    };
+
+    // Times the enclosing scope as the stage `name`; `detail` tells stages
+    // of the same name apart in a trace. Adds the elapsed time to
+    // `*elapsedMs` if given.
+    class stageTimer {
+        public:
+#ifdef FSM_WITH_LLVM
+            stageTimer(const char *name, llvm::StringRef detail = "", double *elapsedMs = nullptr)
+                : trace(name, detail), elapsedMs(elapsedMs), begin(std::chrono::steady_clock::now()) {
+                if(llvm::TimePassesIsEnabled) {
+                    region.emplace(name, name, "cfg-stages", "CFG pass stages");
+                }
+            }
+#else
+            stageTimer(const char*, const char* = "", double *elapsedMs = nullptr)
+                : elapsedMs(elapsedMs), begin(std::chrono::steady_clock::now()) {}
+#endif
+            ~stageTimer() {
+                if(elapsedMs) {
+                    *elapsedMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+                }
+            }
+            stageTimer(const stageTimer&) = delete;
+            stageTimer& operator=(const stageTimer&) = delete;
+        private:
+#ifdef FSM_WITH_LLVM
+            llvm::TimeTraceScope trace;
+            std::optional<llvm::NamedRegionTimer> region;
+#endif
+            double *elapsedMs;
+            std::chrono::steady_clock::time_point begin;
+    };
+}
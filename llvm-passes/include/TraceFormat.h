@@ -0,0 +1,26 @@
+#pragma once
+
+/*
+ * Recorded event streams checked offline by fsm-trace-check (*.fsmtrace).
+ *
+ * A recording is a fixed header followed by 32-bit events in the writer's
+ * native byte order: the libc IDs, FSM_LOOP_EVENT_BASE loop events or
+ * FSM_THREAD_EVENT_BASE thread events that an instrumented binary passed to
+ * syscall(470, id). Each trace ends with FSM_TRACE_END, so a recorder can
+ * append traces as they finish without knowing their length up front.
+ * Events after the last FSM_TRACE_END form a trace of their own, cut short
+ * when the recording stopped.
+ *
+ * This header is plain C so recorders in the runtime can include it.
+ */
+
+#include <stdint.h>
+
+#define FSM_TRACE_MAGIC   0x52545346u /* "FSTR" */
+#define FSM_TRACE_VERSION 1u
+#define FSM_TRACE_END     0xffffffffu
+
+struct fsm_trace_header {
+    uint32_t magic;
+    uint32_t version;
+};
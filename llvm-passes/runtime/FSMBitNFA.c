@@ -0,0 +1,41 @@
+/*
+ * Enforcement runtime for modules that instrument-pass<mode=inline> gave a
+ * bit-parallel NFA instead of a transition table (engine=bitnfa, or
+ * engine=auto when the DFA would be too large).
+ *
+ * The pass embeds the image as __fsm_bitnfa_image and gives each thread
+ * __fsm_bitnfa_active: the active positions in the first num_words words
+ * and scratch space for the next set in the second, so a step touches no
+ * shared writable memory.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/AutomatonFormat.h"
+
+extern const unsigned char __fsm_bitnfa_image[];
+extern __thread uint64_t __fsm_bitnfa_active[];
+
+static const struct fsm_bitnfa_header *fsm_bitnfa(void) {
+    return (const struct fsm_bitnfa_header *)__fsm_bitnfa_image;
+}
+
+__attribute__((cold, noreturn))
+static void fsm_bitnfa_violation(uint32_t libc_id) {
+    fprintf(stderr, "fsm: illegal libc call (libc id %u) for the bit-parallel monitor\n", libc_id);
+    abort();
+}
+
+void __fsm_enforce_bitnfa(uint32_t libc_id) {
+    const struct fsm_bitnfa_header *nfa = fsm_bitnfa();
+    uint64_t *active = __fsm_bitnfa_active;
+    uint64_t *next = active + nfa->num_words;
+    uint32_t symbol = fsm_bitnfa_symbol_for_libc(nfa, libc_id);
+    if(symbol == FSM_NO_SYMBOL || !fsm_bitnfa_step(nfa, active, next, symbol)) {
+        fsm_bitnfa_violation(libc_id);
+    }
+    memcpy(active, next, nfa->num_words * sizeof(uint64_t));
+}
@@ -0,0 +1,148 @@
+/*
+ * User-space stand-in for the monitor side of instrument-pass<mode=ring>.
+ *
+ * A kernel monitor would read each thread's ring on syscall entry; here
+ * __fsm_ring_flush(), which the generated code calls before every call that
+ * enters the kernel, does the same check in-process so ring-instrumented
+ * binaries can be tested on an unpatched kernel. The automaton is the table
+ * embedded with instrument-pass<mode=ring;table=...>, or else the file named
+ * by $FSM_TABLE. Without either, events are only counted.
+ *
+ * Everything a flush writes is the calling thread's own: its ring, its
+ * monitor state and its counters, so threads never share a cache line on
+ * the way. The generated code flushes what is left in a thread's ring when
+ * its start routine returns or before it calls pthread_exit(); the thread
+ * adds its counters to the totals when it exits, the main thread flushes
+ * and adds them when the program does.
+ *
+ * Set $FSM_RING_STATS to print the number of events and flushes at exit,
+ * counting the threads that have exited by then.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/AutomatonFormat.h"
+#include "../include/EventRing.h"
+
+__thread struct fsm_event_ring __fsm_ring;
+
+extern const unsigned char __fsm_table_image[] __attribute__((weak));
+
+static __thread uint32_t monitor_state = FSM_NO_STATE;
+static __thread uint64_t thread_events;
+static __thread uint64_t thread_flushes;
+static __thread int thread_registered;
+
+static const struct fsm_table_header *table;
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_once = PTHREAD_ONCE_INIT;
+static uint64_t total_events;
+static uint64_t total_flushes;
+
+static const struct fsm_table_header *map_table(void) {
+    if(__fsm_table_image) {
+        return (const struct fsm_table_header *)__fsm_table_image;
+    }
+    const char *path = getenv("FSM_TABLE");
+    if(!path) return NULL;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(data == MAP_FAILED) return NULL;
+    const struct fsm_table_header *opened = fsm_table_open(data, (size_t)st.st_size);
+    if(!opened) {
+        fprintf(stderr, "fsm: %s is not a transition table\n", path);
+        munmap(data, (size_t)st.st_size);
+    }
+    return opened;
+}
+
+static void load_table(void) {
+    table = map_table();
+}
+
+__attribute__((cold, noreturn))
+static void ring_violation(uint32_t state, uint32_t libc_id, uint32_t position, uint32_t count) {
+    fprintf(stderr, "fsm: illegal libc call (libc id %u) in monitor state %u, event %u of %u in batch\n",
+            libc_id, state, position + 1, count);
+    abort();
+}
+
+static void fold_counters(void) {
+    __atomic_fetch_add(&total_events, thread_events, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total_flushes, thread_flushes, __ATOMIC_RELAXED);
+    thread_events = 0;
+    thread_flushes = 0;
+}
+
+void __fsm_ring_flush(void);
+
+static void ring_at_thread_exit(void *unused) {
+    (void)unused;
+    if(__fsm_ring.count > 0) {
+        __fsm_ring_flush();
+    }
+    fold_counters();
+}
+
+static void create_thread_exit_key(void) {
+    pthread_key_create(&thread_exit_key, ring_at_thread_exit);
+}
+
+/* Once per thread, on its first flush. */
+__attribute__((noinline))
+static void register_thread(void) {
+    thread_registered = 1;
+    pthread_once(&thread_exit_once, create_thread_exit_key);
+    pthread_setspecific(thread_exit_key, &thread_registered);
+}
+
+void __fsm_ring_flush(void) {
+    struct fsm_event_ring *ring = &__fsm_ring;
+    uint32_t count = ring->count;
+    ring->count = 0;
+
+    if(!thread_registered) {
+        register_thread();
+    }
+    pthread_once(&table_once, load_table);
+    thread_events += count;
+    thread_flushes++;
+    if(!table) return;
+
+    uint32_t state = monitor_state == FSM_NO_STATE ? table->start_state : monitor_state;
+    for(uint32_t i = 0; i < count; i++) {
+        uint32_t symbol = fsm_table_symbol_for_libc(table, ring->events[i]);
+        uint32_t next = symbol == FSM_NO_SYMBOL ? FSM_NO_STATE : fsm_table_step(table, state, symbol);
+        if(next == FSM_NO_STATE) {
+            ring_violation(state, ring->events[i], i, count);
+        }
+        state = next;
+    }
+    monitor_state = state;
+}
+
+__attribute__((destructor))
+static void ring_at_exit(void) {
+    if(__fsm_ring.count > 0) {
+        __fsm_ring_flush();
+    }
+    fold_counters();
+    if(getenv("FSM_RING_STATS")) {
+        fprintf(stderr, "fsm: %llu events in %llu flushes\n",
+                (unsigned long long)total_events, (unsigned long long)total_flushes);
+    }
+}
@@ -0,0 +1,38 @@
+/*
+ * Enforcement runtime for binaries built with instrument-pass<mode=inline>.
+ *
+ * The pass embeds the transition table as __fsm_table_image and keeps the
+ * monitor state of each thread in __fsm_state. Small tables are stepped
+ * inline by the generated code and only call __fsm_violation on an illegal
+ * transition; large tables call __fsm_enforce for every event.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../include/AutomatonFormat.h"
+
+extern const unsigned char __fsm_table_image[];
+extern __thread uint32_t __fsm_state;
+
+static const struct fsm_table_header *fsm_table(void) {
+    return (const struct fsm_table_header *)__fsm_table_image;
+}
+
+__attribute__((cold, noreturn))
+void __fsm_violation(uint32_t state, uint32_t libc_id) {
+    fprintf(stderr, "fsm: illegal libc call (libc id %u) in monitor state %u\n", libc_id, state);
+    abort();
+}
+
+void __fsm_enforce(uint32_t libc_id) {
+    const struct fsm_table_header *table = fsm_table();
+    uint32_t state = __fsm_state;
+    uint32_t symbol = fsm_table_symbol_for_libc(table, libc_id);
+    uint32_t next = symbol == FSM_NO_SYMBOL ? FSM_NO_STATE : fsm_table_step(table, state, symbol);
+    if(next == FSM_NO_STATE) {
+        __fsm_violation(state, libc_id);
+    }
+    __fsm_state = next;
+}
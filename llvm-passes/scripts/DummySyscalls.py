@@ -1,27 +1,29 @@
-import subprocess
-import os
+import libc_table
 
-command = "nm -D /usr/lib/x86_64-linux-gnu/libc.so.6 | grep -E ' (T|W) ' | awk '{print $3}' | cut -d@ -f1 | sort -u"
-
-result = subprocess.run(command, shell = True, capture_output = True, text = True)
-
-callnames = result.stdout.splitlines()
-callnames.sort()
-
-call_map = {name: i for i, name in enumerate(callnames)}
+displacements, slots, ids, fingerprint = libc_table.build()
 
 header = []
 header.append("#pragma once")
-header.append("#include <string>")
-header.append("#include <unordered_map>")
+header.append("#include <cstdint>")
+header.append("")
+header.append("#include \"AutomatonFormat.h\"")
+header.append("#include \"CallNames.h\"")
+header.append("")
+header.append("// Stable libc ID (scripts/libc_ids.txt) of every slot of libc_names.")
+header.append(f"static_assert(libc_table_fingerprint == {fingerprint:#010x},")
+header.append("              \"CallNames.h and DummySyscalls.h were generated from different libc tables\");")
+header.append("")
+header.append("// Thread and loop events are numbered above every libc ID.")
+header.append(f"static_assert({max(ids.values())} < FSM_THREAD_EVENT_BASE,")
+header.append("              \"libc IDs reach into the thread and loop event IDs\");")
 header.append("")
-header.append("static const std::unordered_map<std::string, int> dummy_syscall_map = {")
-for name in callnames:
-    header.append(f"    {{\"{name}\", {call_map[name]}}},")
+header.append("static constexpr int32_t libc_ids[libc_table_size] = {")
+for i in range(0, len(slots), 16):
+    header.append("    " + ", ".join(str(ids[name]) for name in slots[i:i + 16]) + ",")
 header.append("};")
 header.append("")
 
 out_path = "include/DummySyscalls.h"
 
 with open(out_path, "w") as f: 
-    f.write("\n".join(header))
\ No newline at end of file
+    f.write("\n".join(header))
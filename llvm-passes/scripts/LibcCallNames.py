@@ -1,24 +1,46 @@
-import subprocess
+import libc_table
 
-command = "nm -D /usr/lib/x86_64-linux-gnu/libc.so.6 | grep -E ' (T|W) ' | awk '{print $3}' | cut -d@ -f1 | sort -u"
-
-result = subprocess.run(command, shell = True, capture_output = True, text = True)
-
-callnames = result.stdout
+displacements, slots, ids, fingerprint = libc_table.build()
 
 header = []
 header.append("#pragma once")
-header.append("#include <unordered_set>")
-header.append("#include <string>")
+header.append("#include <cstdint>")
+header.append("#include <string_view>")
 header.append("")
-header.append("static const std::unordered_set<std::string> libc_callnames = {")
-
-for line in callnames.splitlines():
-    header.append(f"    \"{line}\",")
-
+header.append("// Minimal perfect hash over the exported libc symbols, generated by")
+header.append("// scripts/LibcCallNames.py. Everything is constexpr: nothing is built when")
+header.append("// a pass is loaded and a lookup neither allocates nor walks a chain.")
+header.append("")
+header.append(f"static constexpr uint32_t libc_table_size = {len(slots)};")
+header.append(f"static constexpr uint32_t libc_table_fingerprint = {fingerprint:#010x};")
+header.append("")
+header.append("static constexpr int32_t libc_displacements[libc_table_size] = {")
+for i in range(0, len(displacements), 16):
+    header.append("    " + ", ".join(str(d) for d in displacements[i:i + 16]) + ",")
+header.append("};")
+header.append("")
+header.append("static constexpr std::string_view libc_names[libc_table_size] = {")
+for name in slots:
+    header.append(f"    \"{name}\",")
 header.append("};")
 header.append("")
+header.append("static constexpr uint32_t libcNameHash(uint32_t seed, std::string_view name) {")
+header.append(f"    uint32_t hash = {libc_table.FNV_OFFSET:#010x}u ^ seed;")
+header.append("    for(char c : name) {")
+header.append(f"        hash = (hash ^ static_cast<unsigned char>(c)) * {libc_table.FNV_PRIME:#010x}u;")
+header.append("    }")
+header.append("    return hash;")
+header.append("}")
+header.append("")
+header.append("// Slot of `name` in libc_names, or -1 if it is not a libc function.")
+header.append("static constexpr int libcSlot(std::string_view name) {")
+header.append("    int32_t displacement = libc_displacements[libcNameHash(0, name) % libc_table_size];")
+header.append("    uint32_t slot = displacement < 0 ? static_cast<uint32_t>(-displacement - 1)")
+header.append("                                     : libcNameHash(static_cast<uint32_t>(displacement), name) % libc_table_size;")
+header.append("    return libc_names[slot] == name ? static_cast<int>(slot) : -1;")
+header.append("}")
+header.append("")
 
 out_path = "include/CallNames.h"
 with open(out_path, "w") as f:
-    f.write("\n".join(header))
\ No newline at end of file
+    f.write("\n".join(header))
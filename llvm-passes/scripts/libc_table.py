@@ -0,0 +1,100 @@
+import os
+import subprocess
+import sys
+
+# Shared by LibcCallNames.py and DummySyscalls.py: the exported libc symbols,
+# their stable IDs and a minimal perfect hash over them. Both generators build
+# the same table, so CallNames.h owns the lookup and DummySyscalls.h only adds
+# the IDs per slot.
+
+command = "nm -D /usr/lib/x86_64-linux-gnu/libc.so.6 | grep -E ' (T|W) ' | awk '{print $3}' | cut -d@ -f1 | sort -u"
+
+# One name per line; the line number is the name's libc ID. Names are only
+# ever appended, so IDs baked into instrumented binaries and transition
+# tables survive a libc upgrade. Names that disappear keep their ID.
+REGISTRY = os.path.join(os.path.dirname(os.path.abspath(__file__)), "libc_ids.txt")
+
+# FSM_THREAD_EVENT_BASE in AutomatonFormat.h: event IDs from here up are
+# thread and loop events, so libc IDs must stay below it. DummySyscalls.h
+# asserts the same against the header.
+EVENT_BASE = 0xc00
+
+FNV_OFFSET = 0x811c9dc5
+FNV_PRIME = 0x01000193
+
+
+def name_hash(seed, name):
+    h = FNV_OFFSET ^ seed
+    for byte in name.encode():
+        h = ((h ^ byte) * FNV_PRIME) & 0xffffffff
+    return h
+
+
+def libc_names():
+    result = subprocess.run(command, shell = True, capture_output = True, text = True)
+    return sorted(set(result.stdout.splitlines()))
+
+
+def stable_ids(names):
+    registry = []
+    if os.path.exists(REGISTRY):
+        with open(REGISTRY) as f:
+            registry = [line.strip() for line in f if line.strip()]
+    known = set(registry)
+    added = [name for name in names if name not in known]
+    if added:
+        registry.extend(added)
+        with open(REGISTRY, "w") as f:
+            f.write("\n".join(registry) + "\n")
+        print(f"Registered {len(added)} new libc names in {REGISTRY}")
+    if len(registry) > EVENT_BASE:
+        sys.exit(f"{REGISTRY} holds {len(registry)} names, but libc IDs must stay below "
+                 f"FSM_THREAD_EVENT_BASE ({EVENT_BASE:#x}); move the event bases up")
+    ids = {name: i for i, name in enumerate(registry)}
+    return {name: ids[name] for name in names}
+
+
+def perfect_hash(names):
+    """Hash-and-displace: bucket keys by name_hash(0, key), then, biggest
+    bucket first, find a seed that puts all of its keys in free slots.
+    Buckets of one key store their slot directly as -slot - 1."""
+    n = len(names)
+    buckets = [[] for _ in range(n)]
+    for name in names:
+        buckets[name_hash(0, name) % n].append(name)
+
+    displacements = [0] * n
+    slots = [None] * n
+    order = sorted(range(n), key = lambda b: len(buckets[b]), reverse = True)
+    for b in order:
+        bucket = buckets[b]
+        if len(bucket) <= 1:
+            break
+        seed = 1
+        while True:
+            taken = [name_hash(seed, name) % n for name in bucket]
+            if len(set(taken)) == len(taken) and all(slots[slot] is None for slot in taken):
+                break
+            seed += 1
+        displacements[b] = seed
+        for name, slot in zip(bucket, taken):
+            slots[slot] = name
+
+    free = [slot for slot in range(n) if slots[slot] is None]
+    for b in order:
+        if len(buckets[b]) != 1:
+            continue
+        slot = free.pop()
+        displacements[b] = -slot - 1
+        slots[slot] = buckets[b][0]
+    return displacements, slots
+
+
+def build():
+    names = libc_names()
+    ids = stable_ids(names)
+    displacements, slots = perfect_hash(names)
+    fingerprint = FNV_OFFSET
+    for name in slots:
+        fingerprint = name_hash(fingerprint, name)
+    return displacements, slots, ids, fingerprint
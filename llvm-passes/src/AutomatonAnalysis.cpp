@@ -0,0 +1,108 @@
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/Compiler.h"
+
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "../include/FSM.h"
+#include "../include/FSMStats.h"
+
+#define DEBUG_TYPE "automaton-analysis"
+
+FSM_STATISTIC(NumAnalysisBuilds, "Module automata built by AutomatonAnalysis");
+
+namespace cfgengine {
+    // A determinized, unminimized automaton and the labels on its edges.
+    // An analysis that leaves determinization to its user fills in the
+    // ε-free NFA instead.
+    struct builtAutomaton {
+        fsm::Alphabet alphabet;
+        fsm::Automaton dfa;
+        fsm::Automaton nfa;
+        automatonReport report;
+    };
+
+    template<typename Policy>
+    struct policyAutomaton : builtAutomaton {};
+
+    // The whole-module automata of `Policies`, built in one walk over the IR
+    // and kept by the module analysis manager until a pass changes the
+    // module. Summaries depend on per-pass options and are not cached here.
+    //
+    // This is a cache within one plugin, not across them. Every plugin
+    // compiles its own copy of this file, and Key is hidden so each copy
+    // keeps its own analysis instead of depending on which plugin the
+    // dynamic linker binds the symbol to. Only a pass of the same plugin
+    // asking again for the same policies on an unchanged module reuses the
+    // automata; instrument-pass, syscall-cfg-pass and the other plugins
+    // each build their own.
+    template<typename... Policies>
+    class LLVM_LIBRARY_VISIBILITY AutomatonAnalysis : public llvm::AnalysisInfoMixin<AutomatonAnalysis<Policies...>> {
+        public:
+            class Result {
+                public:
+                    template<typename Policy>
+                    const builtAutomaton& get() const {return std::get<policyAutomaton<Policy>>(automata);}
+
+                    // The automata are derived from every call in the module,
+                    // so nothing short of preserving this analysis keeps them.
+                    bool invalidate(llvm::Module&, const llvm::PreservedAnalyses &preserved,
+                                    llvm::ModuleAnalysisManager::Invalidator&) {
+                        auto checker = preserved.getChecker<AutomatonAnalysis>();
+                        return !(checker.preserved() || checker.template preservedSet<llvm::AllAnalysesOn<llvm::Module>>());
+                    }
+                private:
+                    friend class AutomatonAnalysis;
+                    std::tuple<policyAutomaton<Policies>...> automata;
+            };
+
+            explicit AutomatonAnalysis(bool determinize = true) : determinize(determinize) {
+                // The result does not depend on the thread count, so use them all.
+                options.threads = 0;
+            }
+
+            Result run(llvm::Module &Mod, llvm::ModuleAnalysisManager&) {
+                ++NumAnalysisBuilds;
+                Result result;
+                cfgEngine<Policies...> engine(options, "automaton-analysis");
+                engine.buildGraphs(Mod);
+                auto extract = [&](auto &builder, builtAutomaton &out) {
+                    if(determinize) {
+                        out.dfa = builder.determinize(Mod);
+                    } else {
+                        out.nfa = builder.removeEpsilons();
+                    }
+                    out.alphabet = std::move(builder.alphabet);
+                    out.report = builder.report;
+                };
+                (extract(engine.template automaton<Policies>(), std::get<policyAutomaton<Policies>>(result.automata)), ...);
+                return result;
+            }
+        private:
+            friend llvm::AnalysisInfoMixin<AutomatonAnalysis>;
+            static llvm::AnalysisKey Key;
+            engineOptions options;
+            bool determinize;
+    };
+
+    template<typename... Policies>
+    llvm::AnalysisKey AutomatonAnalysis<Policies...>::Key;
+
+    // Minimizes the cached automaton of `Policy` if asked and writes it out,
+    // the way automatonBuilder::determinize and dumpGraph would.
+    template<typename Policy>
+    static void writeCachedAutomaton(llvm::Module &Mod, const engineOptions &options, const std::string &diagName,
+                                     const builtAutomaton &automaton, const std::string &baseName) {
+        automatonReport report = automaton.report;
+        if(options.minimize) {
+            fsm::Automaton dfa = minimizeReported(automaton.dfa, Mod, diagName, report);
+            writeOutputs<Policy>(options, Mod, diagName, baseName, dfa, automaton.alphabet, report);
+        } else {
+            writeOutputs<Policy>(options, Mod, diagName, baseName, automaton.dfa, automaton.alphabet, report);
+        }
+    }
+}
+
+#undef DEBUG_TYPE
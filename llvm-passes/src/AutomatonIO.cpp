@@ -0,0 +1,361 @@
+#include "../include/FSM.h"
+#include "../include/AutomatonFormat.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+void fsm::writeDot(const fsm::Automaton &dfa, const fsm::Alphabet &alphabet, std::ostream &out) {
+    std::vector<bool> visited(dfa.numStates(), false);
+    std::queue<fsm::stateId> q;
+    if(dfa.start != fsm::Automaton::noState) {
+        q.push(dfa.start);
+        visited[dfa.start] = true;
+    }
+
+    out << "digraph CFG {\n";
+    out << "    rankdir=LR;\n";
+    out << "    node [shape=circle];\n";
+
+    while(!q.empty()) {
+        fsm::stateId currentNode = q.front();
+        q.pop();
+        for(uint32_t edge = dfa.edgeBegin(currentNode); edge < dfa.edgeEnd(currentNode); edge++) {
+            fsm::stateId neighbor = dfa.target(edge);
+            out << "    " << currentNode << " -> " << neighbor << " [label=\"" << alphabet.label(dfa.label(edge)) << "\"];\n";
+            if(!visited[neighbor]) {
+                visited[neighbor] = true;
+                q.push(neighbor);
+            }
+        }
+    }
+
+    out << "}\n";
+}
+
+bool fsm::readDot(const std::string &path, fsm::Alphabet &alphabet, fsm::Automaton &dfa) {
+    std::ifstream infile(path);
+    if(!infile) return false;
+
+    // writeDot() emits one `from -> to [label="..."];` line per edge and
+    // leaves labels unescaped, so the label runs up to the last quote.
+    struct dotEdge {
+        fsm::stateId from;
+        fsm::stateId to;
+        fsm::symbolId label;
+    };
+    std::vector<dotEdge> edges;
+    fsm::stateId numStates = 0;
+    std::string line;
+    while(std::getline(infile, line)) {
+        size_t arrow = line.find(" -> ");
+        size_t labelBegin = line.find("[label=\"");
+        size_t labelEnd = line.rfind("\"]");
+        if(arrow == std::string::npos || labelBegin == std::string::npos || labelEnd == std::string::npos ||
+           labelEnd < labelBegin + 8) {
+            continue;
+        }
+        char *end;
+        unsigned long from = std::strtoul(line.c_str(), &end, 10);
+        if(end != line.c_str() + arrow) return false;
+        const char *toBegin = line.c_str() + arrow + 4;
+        unsigned long to = std::strtoul(toBegin, &end, 10);
+        if(end == toBegin || from >= fsm::Automaton::noState || to >= fsm::Automaton::noState) return false;
+        fsm::symbolId label = alphabet.intern(line.substr(labelBegin + 8, labelEnd - labelBegin - 8));
+        edges.push_back({static_cast<fsm::stateId>(from), static_cast<fsm::stateId>(to), label});
+        numStates = std::max(numStates, static_cast<fsm::stateId>(std::max(from, to) + 1));
+    }
+    if(edges.empty()) return false;
+
+    dfa.clear();
+    for(fsm::stateId state = 0; state < numStates; state++) {
+        dfa.addState();
+    }
+    for(auto const& edge : edges) {
+        dfa.addEdge(edge.from, edge.to, edge.label);
+    }
+    dfa.start = edges.front().from;
+    dfa.finalize();
+    return true;
+}
+
+namespace {
+    // The symbol sections both image formats share: the labels an automaton
+    // actually uses, in first-seen edge order, with their libc IDs and names.
+    struct imageSymbols {
+        std::vector<uint32_t> symbolOf;
+        std::vector<fsm::symbolId> symbols;
+        std::vector<uint32_t> symbolLibcIds;
+        std::vector<uint32_t> nameOffsets = {0};
+        std::string strings;
+        std::vector<uint32_t> libcMap;
+    };
+
+    imageSymbols collectSymbols(const fsm::Automaton &automaton, const fsm::Alphabet &alphabet,
+                                const std::function<uint32_t(const std::string&)> &libcIdOf) {
+        imageSymbols result;
+        result.symbolOf.assign(alphabet.size(), FSM_NO_SYMBOL);
+        for(uint32_t edge = 0; edge < automaton.numEdges(); edge++) {
+            if(result.symbolOf[automaton.label(edge)] == FSM_NO_SYMBOL) {
+                result.symbolOf[automaton.label(edge)] = static_cast<uint32_t>(result.symbols.size());
+                result.symbols.push_back(automaton.label(edge));
+            }
+        }
+
+        uint32_t libcMapSize = 0;
+        for(fsm::symbolId symbol : result.symbols) {
+            uint32_t libcId = libcIdOf(alphabet.label(symbol));
+            result.symbolLibcIds.push_back(libcId);
+            if(libcId != FSM_NO_LIBC_ID) {
+                libcMapSize = std::max(libcMapSize, libcId + 1);
+            }
+            result.strings += alphabet.label(symbol);
+            result.nameOffsets.push_back(static_cast<uint32_t>(result.strings.size()));
+        }
+        result.libcMap.assign(libcMapSize, FSM_NO_SYMBOL);
+        for(uint32_t symbol = 0; symbol < result.symbols.size(); symbol++) {
+            if(result.symbolLibcIds[symbol] != FSM_NO_LIBC_ID) {
+                result.libcMap[result.symbolLibcIds[symbol]] = symbol;
+            }
+        }
+        return result;
+    }
+
+    // Appends 8-byte aligned sections to an image and returns their offsets.
+    class imageWriter {
+        public:
+            explicit imageWriter(size_t headerSize) : image(headerSize) {}
+
+            uint64_t append(const void *data, size_t bytes) {
+                size_t offset = (image.size() + 7) & ~size_t(7);
+                image.resize(offset + bytes);
+                if(bytes > 0) {
+                    std::memcpy(image.data() + offset, data, bytes);
+                }
+                return static_cast<uint64_t>(offset);
+            }
+            template<typename T>
+            uint64_t append(const std::vector<T> &section) {return append(section.data(), section.size() * sizeof(T));}
+            uint64_t append(const std::string &section) {return append(section.data(), section.size());}
+
+            // Pads the image and returns it with `header` copied to the front.
+            template<typename Header>
+            std::vector<char> finish(Header &header) {
+                image.resize((image.size() + 7) & ~size_t(7));
+                header.file_size = image.size();
+                std::memcpy(image.data(), &header, sizeof(header));
+                return std::move(image);
+            }
+        private:
+            std::vector<char> image;
+    };
+}
+
+std::vector<char> fsm::tableImage(const fsm::Automaton &dfa, const fsm::Alphabet &alphabet,
+                                  const std::function<uint32_t(const std::string&)> &libcIdOf) {
+    // The table's alphabet only holds the labels the DFA actually uses,
+    // in first-seen order.
+    imageSymbols sym = collectSymbols(dfa, alphabet, libcIdOf);
+
+    std::vector<uint64_t> finalBitmap((dfa.numStates() + 63) / 64, 0);
+    std::vector<uint32_t> edgeOffsets = {0};
+    std::vector<uint32_t> edgeLabels;
+    std::vector<uint32_t> edgeTargets;
+    std::vector<std::pair<uint32_t, fsm::stateId>> sortedEdges;
+    bool deterministic = true;
+    for(fsm::stateId state = 0; state < dfa.numStates(); state++) {
+        if(dfa.isFinal(state)) {
+            finalBitmap[state / 64] |= uint64_t(1) << (state % 64);
+        }
+        sortedEdges.clear();
+        for(uint32_t edge = dfa.edgeBegin(state); edge < dfa.edgeEnd(state); edge++) {
+            sortedEdges.push_back({sym.symbolOf[dfa.label(edge)], dfa.target(edge)});
+        }
+        std::sort(sortedEdges.begin(), sortedEdges.end());
+        for(size_t i = 1; i < sortedEdges.size(); i++) {
+            if(sortedEdges[i].first == sortedEdges[i - 1].first) deterministic = false;
+        }
+        for(auto const& edge : sortedEdges) {
+            edgeLabels.push_back(edge.first);
+            edgeTargets.push_back(edge.second);
+        }
+        edgeOffsets.push_back(static_cast<uint32_t>(edgeLabels.size()));
+    }
+
+    fsm_table_header header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = FSM_TABLE_MAGIC;
+    header.version = FSM_TABLE_VERSION;
+    header.num_states = dfa.numStates();
+    header.num_symbols = static_cast<uint32_t>(sym.symbols.size());
+    header.num_edges = static_cast<uint32_t>(edgeLabels.size());
+    header.start_state = dfa.start;
+    header.libc_map_size = static_cast<uint32_t>(sym.libcMap.size());
+    header.string_bytes = static_cast<uint32_t>(sym.strings.size());
+    header.flags = deterministic ? 0 : FSM_TABLE_NONDETERMINISTIC;
+
+    imageWriter writer(sizeof(header));
+    header.symbol_libc_ids_offset = writer.append(sym.symbolLibcIds);
+    header.symbol_names_offset = writer.append(sym.nameOffsets);
+    header.strings_offset = writer.append(sym.strings);
+    header.final_bitmap_offset = writer.append(finalBitmap);
+    header.edge_offsets_offset = writer.append(edgeOffsets);
+    header.edge_labels_offset = writer.append(edgeLabels);
+    header.edge_targets_offset = writer.append(edgeTargets);
+    header.libc_map_offset = writer.append(sym.libcMap);
+    return writer.finish(header);
+}
+
+namespace {
+    // Positions of the bit-parallel form: 0 for the start, then the sorted,
+    // distinct (target state, label) pairs of the edges, numbered from 1.
+    std::vector<std::pair<fsm::stateId, fsm::symbolId>> enteredPairs(const fsm::Automaton &nfa) {
+        std::vector<std::pair<fsm::stateId, fsm::symbolId>> entered;
+        entered.reserve(nfa.numEdges());
+        for(uint32_t edge = 0; edge < nfa.numEdges(); edge++) {
+            entered.push_back({nfa.target(edge), nfa.label(edge)});
+        }
+        std::sort(entered.begin(), entered.end());
+        entered.erase(std::unique(entered.begin(), entered.end()), entered.end());
+        return entered;
+    }
+}
+
+uint32_t fsm::countPositions(const fsm::Automaton &nfa) {
+    return static_cast<uint32_t>(enteredPairs(nfa).size() + 1);
+}
+
+std::vector<char> fsm::bitParallelImage(const fsm::Automaton &nfa, const fsm::Alphabet &alphabet,
+                                        const std::function<uint32_t(const std::string&)> &libcIdOf,
+                                        size_t maxFollowBytes) {
+    imageSymbols sym = collectSymbols(nfa, alphabet, libcIdOf);
+    std::vector<std::pair<fsm::stateId, fsm::symbolId>> entered = enteredPairs(nfa);
+    uint32_t numPositions = static_cast<uint32_t>(entered.size() + 1);
+    uint32_t words = (numPositions + 63) / 64;
+    // Chosen first, so an NFA over the budget builds nothing: its successor
+    // rows alone would take half the 1-bit tables.
+    uint32_t chunkBits = 0;
+    for(uint32_t bits : {8u, 4u, 2u, 1u}) {
+        size_t chunks = (numPositions + bits - 1) / bits;
+        if((chunks << bits) * words * sizeof(uint64_t) <= maxFollowBytes) {
+            chunkBits = bits;
+            break;
+        }
+    }
+    if(chunkBits == 0) return {};
+    auto setBit = [](uint64_t *bits, uint32_t position) {bits[position / 64] |= uint64_t(1) << (position % 64);};
+    auto positionOf = [&entered](fsm::stateId state, fsm::symbolId label) {
+        return static_cast<uint32_t>(std::lower_bound(entered.begin(), entered.end(), std::make_pair(state, label)) -
+                                     entered.begin() + 1);
+    };
+
+    std::vector<uint64_t> initial(words, 0);
+    std::vector<uint64_t> finals(words, 0);
+    std::vector<uint64_t> symbolMasks(sym.symbols.size() * words, 0);
+    setBit(initial.data(), 0);
+    if(nfa.start != fsm::Automaton::noState && nfa.isFinal(nfa.start)) {
+        setBit(finals.data(), 0);
+    }
+    for(uint32_t position = 1; position < numPositions; position++) {
+        if(nfa.isFinal(entered[position - 1].first)) {
+            setBit(finals.data(), position);
+        }
+        setBit(&symbolMasks[sym.symbolOf[entered[position - 1].second] * size_t(words)], position);
+    }
+
+    // Successors of every position: those its state's edges enter.
+    std::vector<uint64_t> successors(size_t(numPositions) * words, 0);
+    for(uint32_t position = 0; position < numPositions; position++) {
+        fsm::stateId state = position == 0 ? nfa.start : entered[position - 1].first;
+        if(state == fsm::Automaton::noState) continue;
+        for(uint32_t edge = nfa.edgeBegin(state); edge < nfa.edgeEnd(state); edge++) {
+            setBit(&successors[size_t(position) * words], positionOf(nfa.target(edge), nfa.label(edge)));
+        }
+    }
+
+    // Each entry is the entry without its lowest bit plus that bit's row.
+    size_t numChunks = (numPositions + chunkBits - 1) / chunkBits;
+    std::vector<uint64_t> follow((numChunks << chunkBits) * words, 0);
+    for(size_t chunk = 0; chunk < numChunks; chunk++) {
+        uint64_t *table = &follow[(chunk << chunkBits) * words];
+        for(uint32_t value = 1; value < (1u << chunkBits); value++) {
+            size_t position = chunk * chunkBits + __builtin_ctz(value);
+            uint32_t rest = value & (value - 1);
+            for(uint32_t word = 0; word < words; word++) {
+                uint64_t row = position < numPositions ? successors[position * words + word] : 0;
+                table[value * size_t(words) + word] = table[rest * size_t(words) + word] | row;
+            }
+        }
+    }
+
+    fsm_bitnfa_header header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = FSM_BITNFA_MAGIC;
+    header.version = FSM_BITNFA_VERSION;
+    header.num_positions = numPositions;
+    header.num_words = words;
+    header.num_symbols = static_cast<uint32_t>(sym.symbols.size());
+    header.chunk_bits = chunkBits;
+    header.libc_map_size = static_cast<uint32_t>(sym.libcMap.size());
+    header.string_bytes = static_cast<uint32_t>(sym.strings.size());
+
+    imageWriter writer(sizeof(header));
+    header.symbol_libc_ids_offset = writer.append(sym.symbolLibcIds);
+    header.symbol_names_offset = writer.append(sym.nameOffsets);
+    header.strings_offset = writer.append(sym.strings);
+    header.initial_offset = writer.append(initial);
+    header.final_offset = writer.append(finals);
+    header.symbol_masks_offset = writer.append(symbolMasks);
+    header.follow_tables_offset = writer.append(follow);
+    header.libc_map_offset = writer.append(sym.libcMap);
+    return writer.finish(header);
+}
+
+bool fsm::writeTable(const fsm::Automaton &dfa, const fsm::Alphabet &alphabet,
+                     const std::function<uint32_t(const std::string&)> &libcIdOf,
+                     const std::string &path) {
+    std::vector<char> image = tableImage(dfa, alphabet, libcIdOf);
+    std::ofstream outfile(path, std::ios::binary);
+    outfile.write(image.data(), static_cast<std::streamsize>(image.size()));
+    return static_cast<bool>(outfile);
+}
+
+bool fsm::readTable(const std::string &path, fsm::Alphabet &alphabet, fsm::Automaton &dfa) {
+    std::ifstream infile(path, std::ios::binary | std::ios::ate);
+    if(!infile) return false;
+    std::streamoff size = infile.tellg();
+    if(size < static_cast<std::streamoff>(sizeof(fsm_table_header))) return false;
+    // Sections are 8-byte aligned relative to the start of the image.
+    std::vector<uint64_t> storage((static_cast<size_t>(size) + 7) / 8);
+    infile.seekg(0);
+    if(!infile.read(reinterpret_cast<char*>(storage.data()), size)) return false;
+
+    const fsm_table_header *table = fsm_table_open_nfa(storage.data(), static_cast<size_t>(size));
+    // Checks every section and index, so nothing below can read past it.
+    if(!table) return false;
+
+    const uint32_t *nameOffsets = FSM_TABLE_SECTION(table, symbol_names_offset, uint32_t);
+    const char *strings = FSM_TABLE_SECTION(table, strings_offset, char);
+    std::vector<fsm::symbolId> labelOf(table->num_symbols);
+    for(uint32_t symbol = 0; symbol < table->num_symbols; symbol++) {
+        uint32_t begin = nameOffsets[symbol];
+        uint32_t end = nameOffsets[symbol + 1];
+        labelOf[symbol] = alphabet.intern(std::string(strings + begin, end - begin));
+    }
+
+    const uint32_t *offsets = FSM_TABLE_SECTION(table, edge_offsets_offset, uint32_t);
+    const uint32_t *labels = FSM_TABLE_SECTION(table, edge_labels_offset, uint32_t);
+    const uint32_t *targets = FSM_TABLE_SECTION(table, edge_targets_offset, uint32_t);
+    dfa.clear();
+    for(uint32_t state = 0; state < table->num_states; state++) {
+        dfa.addState(fsm_table_is_final(table, state));
+    }
+    for(uint32_t state = 0; state < table->num_states; state++) {
+        for(uint32_t edge = offsets[state]; edge < offsets[state + 1]; edge++) {
+            dfa.addEdge(state, targets[edge], labelOf[labels[edge]]);
+        }
+    }
+    dfa.start = table->num_states > 0 ? table->start_state : fsm::Automaton::noState;
+    dfa.finalize();
+    return true;
+}
@@ -0,0 +1,957 @@
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <array>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "../include/FSM.h"
+#include "../include/FSMStats.h"
+#include "../include/AutomatonFormat.h"
+
+#define DEBUG_TYPE "cfg-engine"
+
+FSM_STATISTIC(NumFunctionsScanned, "Functions scanned for calls");
+FSM_STATISTIC(NumCallsScanned, "Calls seen while scanning");
+FSM_STATISTIC(NumModuleGraphStates, "States of the module graphs before determinization");
+FSM_STATISTIC(NumModuleGraphEdges, "Edges of the module graphs before determinization");
+FSM_STATISTIC(NumTrapSitesFound, "Trap sites found in instrumented IR");
+FSM_STATISTIC(NumSummariesBuilt, "Function summaries built");
+FSM_STATISTIC(NumSummariesReused, "Function summaries taken from the cache");
+
+// Graph construction shared by every CFG pass. What an automaton records is
+// decided by a labeling policy, a type with
+//
+//     static constexpr const char *name;      // tag for output files
+//     static constexpr const char *passName;  // diagnostics, cache keys
+//     static void onCall(llvm::CallInst &call, llvm::Function *callee, fragmentCursor &cursor);
+//     static std::string callLabel(llvm::Function &callee);  // "" for ε
+//     static std::string returnLabel(llvm::Function &func);  // "" for ε
+//     static std::string threadLabel(llvm::Function &entry, uint32_t event);
+//     static uint32_t libcIdOf(const std::string &label);
+//
+// onCall sees every call except recursion and calls to defined functions,
+// which the engine wires itself. threadLabel names the event a thread
+// started in `entry` reports first (FSM_THREAD_EVENT_BASE + k), and
+// libcIdOf must map the label back to it. cfgEngine<Policies...> walks the
+// IR once and feeds each call to all of its policies, one automaton per
+// policy.
+namespace cfgengine {
+    struct engineOptions {
+        bool minimize = false;
+        unsigned threads = 1;
+        bool emitDot = true;
+        bool emitTable = false;
+        bool summaries = false;
+        // Write the ε-free NFA instead of the DFA and skip determinization,
+        // for consumers that determinize lazily (fsm::LazyDFA). minimize
+        // does not apply to it, and its table is flagged nondeterministic
+        // so the enforcing consumers refuse it.
+        bool lazy = false;
+        // DFA states a determinization may create before it settles for an
+        // over-approximation (fsm::determinizeWithin); 0 for no limit.
+        size_t maxStates = size_t(1) << 20;
+        std::string cacheDir;
+        // JSON Lines file each automaton's sizes and stage times are appended to.
+        std::string reportPath;
+
+        // Whether the automata differ from those AutomatonAnalysis caches,
+        // which are built with the defaults.
+        bool bypassesAnalysis() const {return summaries || lazy || maxStates != engineOptions().maxStates;}
+    };
+
+    // Handles the parameters every CFG pass takes. Returns false if `param`
+    // is not one of them and clears `valid` if it is but is malformed.
+    [[maybe_unused]] static bool parseEngineParameter(const std::pair<std::string, std::string> &param, engineOptions &options,
+                                                      llvm::StringRef passName, bool &valid) {
+        if(param.first == "minimize") {
+            options.minimize = true;
+        } else if(param.first == "table") {
+            options.emitTable = true;
+        } else if(param.first == "summaries") {
+            options.summaries = true;
+        } else if(param.first == "lazy") {
+            options.lazy = true;
+        } else if(param.first == "cache") {
+            // Cached fragments are function summaries.
+            options.summaries = true;
+            options.cacheDir = param.second;
+        } else if(param.first == "report") {
+            if(param.second.empty()) {
+                llvm::errs() << passName << ": report needs a file name\n";
+                valid = false;
+            }
+            options.reportPath = param.second;
+            // Counters only register while statistics are on, and the report
+            // carries them without -stats, which release LLVMs do not print.
+            llvm::EnableStatistics(false);
+        } else if(param.first == "no-dot") {
+            options.emitDot = false;
+        } else if(param.first == "max-states") {
+            if(llvm::StringRef(param.second).getAsInteger(10, options.maxStates)) {
+                llvm::errs() << passName << ": invalid state budget '" << param.second << "'\n";
+                valid = false;
+            }
+        } else if(param.first == "threads") {
+            if(llvm::StringRef(param.second).getAsInteger(10, options.threads)) {
+                llvm::errs() << passName << ": invalid thread count '" << param.second << "'\n";
+                valid = false;
+            }
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static std::string outputStem(llvm::Module &Mod) {
+        return llvm::sys::path::stem(Mod.getSourceFileName()).str();
+    }
+
+    // Sizes and stage times of one automaton, for report=<file>. Times are
+    // in milliseconds; the graph build is shared by all automata of a walk.
+    struct automatonReport {
+        size_t graphStates = 0;
+        size_t graphEdges = 0;
+        size_t epsilonFreeEdges = 0;
+        size_t dfaStates = 0;
+        size_t dfaEdges = 0;
+        size_t minimizedStates = 0;
+        size_t minimizedEdges = 0;
+        // Set when the DFA is that of a quotient of the NFA.
+        fsm::approximation approximated;
+        double buildMs = 0;
+        double removeEpsilonMs = 0;
+        double determinizeMs = 0;
+        double minimizeMs = 0;
+        double writeMs = 0;
+    };
+
+    // Appends one line per automaton, so the reports of a whole build can go
+    // to one file and be searched for the modules that blow up.
+    [[maybe_unused]] static void appendReport(const std::string &path, llvm::Module &Mod, const std::string &diagName,
+                                              const char *automatonName, const automatonReport &report) {
+        std::string line;
+        llvm::raw_string_ostream lineStream(line);
+        llvm::json::OStream json(lineStream);
+        json.object([&] {
+            json.attribute("module", Mod.getSourceFileName());
+            json.attribute("pass", diagName);
+            json.attribute("automaton", automatonName);
+            json.attribute("graph_states", int64_t(report.graphStates));
+            json.attribute("graph_edges", int64_t(report.graphEdges));
+            json.attribute("epsilon_free_edges", int64_t(report.epsilonFreeEdges));
+            json.attribute("dfa_states", int64_t(report.dfaStates));
+            json.attribute("dfa_edges", int64_t(report.dfaEdges));
+            if(report.approximated.applied) {
+                json.attributeObject("approximated", [&] {
+                    if(report.approximated.rounds == fsm::approximation::exact) {
+                        json.attribute("rounds", "exact");
+                    } else {
+                        json.attribute("rounds", int64_t(report.approximated.rounds));
+                    }
+                    json.attribute("quotient_states", int64_t(report.approximated.quotientStates));
+                });
+            }
+            if(report.minimizedStates) {
+                json.attribute("minimized_states", int64_t(report.minimizedStates));
+                json.attribute("minimized_edges", int64_t(report.minimizedEdges));
+            }
+            json.attributeObject("ms", [&] {
+                json.attribute("build", report.buildMs);
+                json.attribute("remove_epsilon", report.removeEpsilonMs);
+                json.attribute("determinize", report.determinizeMs);
+                json.attribute("minimize", report.minimizeMs);
+                json.attribute("write", report.writeMs);
+            });
+            // Totals for the whole process so far; every plugin has its own
+            // copy of the engine's counters, which are added up here.
+            std::map<std::string, uint64_t> totals;
+            for(auto const& stat : llvm::GetStatistics()) {
+                totals[stat.first.str()] += stat.second;
+            }
+            json.attributeObject("statistics", [&] {
+                for(auto const& total : totals) {
+                    json.attribute(total.first, int64_t(total.second));
+                }
+            });
+        });
+        lineStream << "\n";
+        lineStream.flush();
+
+        std::error_code error;
+        llvm::raw_fd_ostream out(path, error, llvm::sys::fs::OF_Append);
+        if(error) {
+            llvm::errs() << diagName << ": could not write " << path << ": " << error.message() << "\n";
+            return;
+        }
+        out << line;
+    }
+
+    static fsm::Automaton minimizeReported(fsm::Automaton dfa, llvm::Module &Mod, const std::string &diagName,
+                                           automatonReport &report) {
+        fsm::stageTimer timer("CFGMinimize", diagName, &report.minimizeMs);
+        size_t statesBefore = dfa.numStates();
+        size_t edgesBefore = dfa.numEdges();
+        dfa = fsm::minimizeDFA(dfa);
+        report.minimizedStates = dfa.numStates();
+        report.minimizedEdges = dfa.numEdges();
+        llvm::errs() << diagName << ": " << Mod.getSourceFileName() << ": DFA "
+                     << statesBefore << " states, " << edgesBefore << " edges -> minimized "
+                     << dfa.numStates() << " states, " << dfa.numEdges() << " edges\n";
+        return dfa;
+    }
+
+    // Tells which automaton had to be over-approximated to fit the state
+    // budget; `where` names the function of a summary, or is empty.
+    static void reportApproximation(const fsm::approximation &approximated, llvm::Module &Mod, const std::string &diagName,
+                                    const std::string &where, size_t nfaStates, size_t maxStates) {
+        if(!approximated.applied) return;
+        llvm::errs() << diagName << ": " << Mod.getSourceFileName() << ": ";
+        if(!where.empty()) llvm::errs() << where << ": ";
+        llvm::errs() << "DFA over " << maxStates << " states; determinized the quotient of its " << nfaStates
+                     << " NFA states into " << approximated.quotientStates << " states";
+        if(approximated.rounds == fsm::approximation::exact) {
+            llvm::errs() << ", which accepts the same runs\n";
+        } else {
+            llvm::errs() << " after " << approximated.rounds << " rounds of refinement, which accepts more runs\n";
+        }
+    }
+
+    // Writes <baseName>_cfg.dot and/or <baseName>_cfg.fsmt as `options` ask.
+    // Adds the automaton to the report file when report=<file> is given.
+    template<typename Policy>
+    static void writeOutputs(const engineOptions &options, llvm::Module &Mod, const std::string &diagName,
+                             const std::string &baseName, const fsm::Automaton &dfa, const fsm::Alphabet &alphabet,
+                             automatonReport report) {
+        if(options.emitDot) {
+            fsm::stageTimer timer("CFGWriteDot", diagName, &report.writeMs);
+            std::ofstream outfile(baseName + "_cfg.dot");
+            fsm::writeDot(dfa, alphabet, outfile);
+        }
+        if(options.emitTable) {
+            fsm::stageTimer timer("CFGWriteTable", diagName, &report.writeMs);
+            std::string filename = baseName + "_cfg.fsmt";
+            if(!fsm::writeTable(dfa, alphabet, Policy::libcIdOf, filename)) {
+                llvm::errs() << diagName << ": could not write " << filename << "\n";
+            }
+        }
+        if(!options.reportPath.empty()) {
+            appendReport(options.reportPath, Mod, diagName, Policy::name, report);
+        }
+    }
+
+    // Trap calls inserted by instrument-pass and the edge each one adds.
+    struct trapSite {
+        llvm::CallInst *call;
+        fsm::stateId from;
+        fsm::symbolId label;
+    };
+
+    // The graph of one function, built without looking at any other: states
+    // and labels are local to the fragment, and calls to other defined
+    // functions are left as links for mergeFragments to wire up.
+    struct functionFragment {
+        struct callLink {
+            fsm::stateId from;
+            fsm::stateId to;
+            llvm::Function *callee;
+            fsm::symbolId label;
+        };
+
+        fsm::Automaton graph;
+        fsm::Alphabet alphabet;
+        std::map<llvm::BasicBlock*, fsm::stateId> bbId;
+        fsm::stateId exitNode = fsm::Automaton::noState;
+        std::vector<callLink> calls;
+        std::vector<trapSite> trapSites;
+    };
+
+    // What a labeling policy sees of the fragment it extends: the state the
+    // scan has reached in the current block.
+    class fragmentCursor {
+        public:
+            fragmentCursor(functionFragment &frag, unsigned instrumentedKind)
+                : frag(frag), instrumentedKind(instrumentedKind) {}
+
+            fsm::symbolId intern(const std::string &label) {
+                return label.empty() ? fsm::Alphabet::epsilon : frag.alphabet.intern(label);
+            }
+            // Moves to a fresh state over an edge labelled `label`.
+            void advance(fsm::symbolId label) {
+                fsm::stateId nextNode = frag.graph.addState();
+                frag.graph.addEdge(currentNode, nextNode, label);
+                currentNode = nextNode;
+            }
+            void markFinal() {frag.graph.setFinal(currentNode);}
+            // Records that `call` emits `label` from the current state.
+            void recordTrap(llvm::CallInst *call, fsm::symbolId label) {
+                frag.trapSites.push_back({call, currentNode, label});
+            }
+            bool isInstrumented(const llvm::CallInst &call) const {
+                return call.getMetadata(instrumentedKind) != nullptr;
+            }
+        protected:
+            functionFragment &frag;
+            unsigned instrumentedKind;
+            fsm::stateId currentNode = fsm::Automaton::noState;
+    };
+
+    template<typename Policy>
+    class fragmentScanner : public fragmentCursor {
+        public:
+            fragmentScanner(llvm::Function &func, functionFragment &frag, bool summaries, unsigned instrumentedKind)
+                : fragmentCursor(frag, instrumentedKind), func(func), summaries(summaries) {
+                frag.bbId[&func.getEntryBlock()] = frag.graph.addState();
+                frag.exitNode = frag.graph.addState();
+            }
+
+            void beginBlock(llvm::BasicBlock &bb) {
+                currentNode = stateOf(&bb);
+            }
+
+            void visitCall(llvm::CallInst &call) {
+                llvm::Function *calledFunc = call.getCalledFunction();
+                if(calledFunc == &func && !summaries) {
+                    frag.graph.addEdge(currentNode, frag.bbId.at(&func.getEntryBlock()), fsm::Alphabet::epsilon);
+                } else if(calledFunc && !calledFunc->isDeclaration()) {
+                    fsm::stateId nextNode = frag.graph.addState();
+                    frag.calls.push_back({currentNode, nextNode, calledFunc, intern(Policy::callLabel(*calledFunc))});
+                    currentNode = nextNode;
+                } else {
+                    Policy::onCall(call, calledFunc, *this);
+                }
+            }
+
+            void endBlock(llvm::BasicBlock &bb) {
+                llvm::Instruction *terminator = bb.getTerminator();
+                if(!terminator) return;
+                if(llvm::isa<llvm::ReturnInst>(terminator)) {
+                    frag.graph.addEdge(currentNode, frag.exitNode, intern(Policy::returnLabel(func)));
+                }
+                for(unsigned i = 0; i < terminator->getNumSuccessors(); i++) {
+                    frag.graph.addEdge(currentNode, stateOf(terminator->getSuccessor(i)), fsm::Alphabet::epsilon);
+                }
+            }
+
+            void finish() {
+                frag.graph.finalize();
+            }
+        private:
+            llvm::Function &func;
+            bool summaries;
+
+            fsm::stateId stateOf(llvm::BasicBlock *bb) {
+                auto found = frag.bbId.find(bb);
+                if(found == frag.bbId.end()) {
+                    found = frag.bbId.insert({bb, frag.graph.addState()}).first;
+                }
+                return found->second;
+            }
+    };
+
+    // Libc calls, labelled "call:<name>", plus "call:"/"ret:" edges for
+    // defined functions. Reaching exit() and friends ends the run.
+    struct libcCallLabels {
+        static constexpr const char *name = "libc";
+        static constexpr const char *passName = "libc-cfg-pass";
+
+        static void onCall(llvm::CallInst &call, llvm::Function *calledFunc, fragmentCursor &cursor) {
+            // The traps instrument-pass puts in front of libc calls are not
+            // calls the program makes, so instrumented IR gives the same graph.
+            if(!calledFunc || cursor.isInstrumented(call)) return;
+            std::string funcName = calledFunc->getName().str();
+            if(!isLibcFunction(funcName)) {
+                cursor.advance(fsm::Alphabet::epsilon);
+                return;
+            }
+            cursor.advance(cursor.intern("call:" + funcName));
+            if(funcName == "exit" || funcName == "_exit" || funcName == "quick_exit" || funcName == "abort") {
+                cursor.markFinal();
+            }
+        }
+        static std::string callLabel(llvm::Function &calledFunc) {return "call:" + calledFunc.getName().str();}
+        static std::string returnLabel(llvm::Function &func) {return "ret:" + func.getName().str();}
+        static std::string threadLabel(llvm::Function &entry, uint32_t event) {
+            return "thread:" + entry.getName().str() + " : " + std::to_string(event);
+        }
+
+        // Labels of libc calls are "call:<name>" and thread starts carry
+        // their event after the last space; everything else has no libc ID.
+        static uint32_t libcIdOf(const std::string &label) {
+            llvm::StringRef name(label);
+            uint32_t event;
+            if(name.startswith("thread:")) {
+                return name.rsplit(' ').second.getAsInteger(10, event) ? FSM_NO_LIBC_ID : event;
+            }
+            if(!name.consume_front("call:")) return FSM_NO_LIBC_ID;
+            int id = libcMap(name);
+            return id >= 0 ? static_cast<uint32_t>(id) : FSM_NO_LIBC_ID;
+        }
+    };
+
+    // The event syscallLabels records for a syscall the program makes
+    // itself: the constant second argument of syscall(), or the constant
+    // operand of an inline-asm syscall. Returns false for other calls and
+    // for syscalls whose event is not a constant.
+    static bool programSyscallEvent(const llvm::CallInst &call, uint32_t &event) {
+        const llvm::ConstantInt *operand = nullptr;
+        if(auto *inlineAsm = llvm::dyn_cast<llvm::InlineAsm>(call.getCalledOperand())) {
+            if(inlineAsm->getAsmString().find("syscall") == std::string::npos || call.arg_size() == 0) return false;
+            operand = llvm::dyn_cast<llvm::ConstantInt>(call.getArgOperand(0));
+        } else if(llvm::Function *calledFunc = call.getCalledFunction()) {
+            if(calledFunc->getName() != "syscall" || call.arg_size() < 2) return false;
+            operand = llvm::dyn_cast<llvm::ConstantInt>(call.getArgOperand(1));
+        }
+        if(!operand || operand->getValue().getActiveBits() > 32) return false;
+        event = static_cast<uint32_t>(operand->getZExtValue());
+        return true;
+    }
+
+    // The events a kernel-side monitor sees: inline-asm syscalls, labelled
+    // "syscall(470) : <id>", and syscall(470, id) calls, labelled with the
+    // libc ID alone. Calls to defined functions are ε; libc calls only show
+    // up through the traps instrument-pass puts in front of them.
+    struct syscallLabels {
+        static constexpr const char *name = "syscall";
+        static constexpr const char *passName = "syscall-cfg-pass";
+
+        static void onCall(llvm::CallInst &call, llvm::Function *calledFunc, fragmentCursor &cursor) {
+            if(auto *inlineAsm = llvm::dyn_cast<llvm::InlineAsm>(call.getCalledOperand())) {
+                if(inlineAsm->getAsmString().find("syscall") == std::string::npos) return;
+                std::string label = "syscall(470)";
+                if(call.arg_size() > 0) {
+                    if(auto *constInt = llvm::dyn_cast<llvm::ConstantInt>(call.getArgOperand(0))) {
+                        label += " : " + std::to_string(constInt->getZExtValue());
+                    }
+                }
+                cursor.advance(cursor.intern(label));
+                return;
+            }
+            if(!calledFunc) return;
+            if(calledFunc->getName() == "syscall") {
+                std::string syscallNum;
+                std::string syscallArg;
+                if(auto *constInt = llvm::dyn_cast<llvm::ConstantInt>(call.getArgOperand(0))) {
+                    syscallNum = std::to_string(constInt->getZExtValue());
+                }
+                if(call.arg_size() > 1) {
+                    if(auto *constArg = llvm::dyn_cast<llvm::ConstantInt>(call.getArgOperand(1))) {
+                        syscallArg = std::to_string(constArg->getZExtValue());
+                    }
+                }
+                fsm::symbolId symbol = cursor.intern(syscallArg);
+                if(cursor.isInstrumented(call) && syscallNum == "470" && !syscallArg.empty()) {
+                    cursor.recordTrap(&call, symbol);
+                }
+                cursor.advance(symbol);
+                return;
+            }
+            if(isLibcFunction(calledFunc->getName())) return;
+            cursor.advance(fsm::Alphabet::epsilon);
+        }
+        static std::string callLabel(llvm::Function&) {return "";}
+        static std::string returnLabel(llvm::Function&) {return "";}
+        static std::string threadLabel(llvm::Function&, uint32_t event) {return std::to_string(event);}
+
+        // Labels are the libc ID passed to syscall(470, id), either bare or as
+        // "syscall(470) : <id>" for inline asm.
+        static uint32_t libcIdOf(const std::string &label) {
+            llvm::StringRef id = llvm::StringRef(label).rsplit(' ').second;
+            if(id.empty()) id = label;
+            uint32_t value;
+            if(id.getAsInteger(10, value)) return FSM_NO_LIBC_ID;
+            return value;
+        }
+    };
+
+    // The syscall automaton of the module as trap mode would instrument it,
+    // read off the module before any trap is inserted: each libc call is the
+    // event of the trap instrument-pass puts in front of it. The modes that
+    // do not trap report the event of a syscall the program makes itself
+    // before it (programSyscallEvent); one without a constant event cannot
+    // be reported and is ε.
+    struct libcIdLabels {
+        static constexpr const char *name = "libcid";
+        static constexpr const char *passName = "instrument-pass";
+
+        static void onCall(llvm::CallInst &call, llvm::Function *calledFunc, fragmentCursor &cursor) {
+            if(calledFunc && !cursor.isInstrumented(call)) {
+                int id = libcMap(calledFunc->getName());
+                if(id >= 0) cursor.advance(cursor.intern(std::to_string(id)));
+            }
+            uint32_t event;
+            if(llvm::isa<llvm::InlineAsm>(call.getCalledOperand()) && !programSyscallEvent(call, event)) return;
+            syscallLabels::onCall(call, calledFunc, cursor);
+        }
+        static std::string callLabel(llvm::Function&) {return "";}
+        static std::string returnLabel(llvm::Function&) {return "";}
+        static std::string threadLabel(llvm::Function&, uint32_t event) {return std::to_string(event);}
+        static uint32_t libcIdOf(const std::string &label) {return syscallLabels::libcIdOf(label);}
+    };
+
+    // One automaton under construction: the module graph, or the SCC graphs
+    // and summaries it is composed from, for a single labeling policy.
+    template<typename Policy>
+    class automatonBuilder {
+        public:
+            automatonBuilder(const engineOptions &options, std::string diagName)
+                : options(options), diagName(std::move(diagName)), cache(options.cacheDir, Policy::passName, options.maxStates) {}
+
+            fsm::Automaton graph;
+            fsm::Alphabet alphabet;
+            std::map<llvm::Function*, fsm::stateId> funcExitNode;
+            std::map<std::pair<llvm::Function*, llvm::BasicBlock*>, fsm::stateId> bbId;
+            std::vector<trapSite> trapSites;
+            std::map<llvm::Function*, functionFragment> fragments;
+
+            void buildGraph(llvm::Module &Mod, const std::vector<llvm::Function*> &funcs);
+            void lookupSummaries(const std::vector<std::vector<llvm::Function*>> &sccs, std::set<llvm::Function*> &unsummarized);
+            void composeGraph(llvm::Module &Mod);
+            // Removes the ε edges of the graph and hands it over.
+            fsm::Automaton removeEpsilons();
+            fsm::Automaton determinize(llvm::Module &Mod);
+            void dumpGraph(llvm::Module &Mod, const std::string &baseName, const fsm::Automaton &dfa);
+            const std::string& name() const {return diagName;}
+
+            // Sizes and times of the automaton built last.
+            automatonReport report;
+        private:
+            engineOptions options;
+            std::string diagName;
+            summaryCache cache;
+            // Minimized automata of the functions summarized so far; each
+            // leaves through a `returnMarker` edge when its function returns.
+            std::map<llvm::Function*, fsm::Automaton> summaries;
+            // Summaries over-approximated to fit the budget, their own or
+            // through a callee's; they are never cached.
+            std::set<llvm::Function*> approximatedSummaries;
+            fsm::symbolId returnMarker = fsm::Alphabet::epsilon;
+            // SCCs, bottom-up, whose summaries have to be built, and their cache keys.
+            std::vector<std::vector<llvm::Function*>> pending;
+            std::vector<std::vector<std::string>> pendingKeys;
+            std::map<llvm::Function*, std::string> keys;
+            size_t reused = 0;
+
+            void mergeFragments(const std::vector<llvm::Function*> &funcs);
+            template<typename Body>
+            void forEachThreadEntry(llvm::Module &Mod, Body body);
+            void summarizeSCC(const std::vector<llvm::Function*> &members);
+    };
+
+    // Copies the fragments of `funcs` into `graph` in the given order, so
+    // state and label numbering never depend on which worker built what,
+    // then resolves their call links.
+    template<typename Policy>
+    void automatonBuilder<Policy>::mergeFragments(const std::vector<llvm::Function*> &funcs) {
+        std::vector<fsm::stateId> bases;
+        std::vector<std::vector<fsm::symbolId>> labelMaps;
+        for(llvm::Function *func : funcs) {
+            const functionFragment &frag = fragments.at(func);
+            fsm::stateId base = graph.numStates();
+            std::vector<fsm::symbolId> labelOf(frag.alphabet.size(), fsm::Alphabet::epsilon);
+            for(fsm::symbolId label = 1; label < frag.alphabet.size(); label++) {
+                labelOf[label] = alphabet.intern(frag.alphabet.label(label));
+            }
+            for(fsm::stateId state = 0; state < frag.graph.numStates(); state++) {
+                graph.addState(frag.graph.isFinal(state));
+            }
+            for(fsm::stateId state = 0; state < frag.graph.numStates(); state++) {
+                for(uint32_t edge = frag.graph.edgeBegin(state); edge < frag.graph.edgeEnd(state); edge++) {
+                    graph.addEdge(base + state, base + frag.graph.target(edge), labelOf[frag.graph.label(edge)]);
+                }
+            }
+            for(auto const& block : frag.bbId) {
+                bbId[{func, block.first}] = base + block.second;
+            }
+            for(auto const& site : frag.trapSites) {
+                trapSites.push_back({site.call, base + site.from, labelOf[site.label]});
+            }
+            funcExitNode[func] = base + frag.exitNode;
+            bases.push_back(base);
+            labelMaps.push_back(std::move(labelOf));
+        }
+
+        for(size_t i = 0; i < funcs.size(); i++) {
+            // Entry and return state of the one copy of each summarized
+            // callee this function gets.
+            std::map<llvm::Function*, std::pair<fsm::stateId, fsm::stateId>> spliced;
+            for(auto const& call : fragments.at(funcs[i]).calls) {
+                fsm::stateId from = bases[i] + call.from;
+                fsm::stateId to = bases[i] + call.to;
+                fsm::symbolId label = labelMaps[i][call.label];
+                auto summary = summaries.find(call.callee);
+                if(summary != summaries.end()) {
+                    // Callee from an SCC further down the call graph: splice in
+                    // its summary once and let every call site enter it and
+                    // return from it, as the module graph does with a defined
+                    // function. A copy per call site would make summaries grow
+                    // with the number of paths through the call graph, not
+                    // with the size of the functions.
+                    auto copy = spliced.find(call.callee);
+                    if(copy == spliced.end()) {
+                        fsm::stateId returned = graph.addState();
+                        copy = spliced.insert({call.callee, {fsm::embed(graph, summary->second, returnMarker, returned),
+                                                             returned}}).first;
+                    }
+                    if(copy->second.first != fsm::Automaton::noState) {
+                        graph.addEdge(from, copy->second.first, label);
+                        graph.addEdge(copy->second.second, to, fsm::Alphabet::epsilon);
+                    }
+                } else {
+                    graph.addEdge(from, bbId.at({call.callee, &call.callee->getEntryBlock()}), label);
+                    graph.addEdge(funcExitNode.at(call.callee), to, fsm::Alphabet::epsilon);
+                }
+            }
+        }
+    }
+
+    // Calls body(entry, label) for every thread entry of the module, with
+    // the interned label of the event its threads start with.
+    template<typename Policy>
+    template<typename Body>
+    void automatonBuilder<Policy>::forEachThreadEntry(llvm::Module &Mod, Body body) {
+        std::vector<llvm::Function*> entries = threadEntryFunctions(Mod);
+        for(uint32_t k = 0; k < entries.size(); k++) {
+            body(*entries[k], alphabet.intern(Policy::threadLabel(*entries[k], FSM_THREAD_EVENT_BASE + k)));
+        }
+    }
+
+    template<typename Policy>
+    void automatonBuilder<Policy>::buildGraph(llvm::Module &Mod, const std::vector<llvm::Function*> &funcs) {
+        graph.clear();
+        bbId.clear();
+        funcExitNode.clear();
+        trapSites.clear();
+        fsm::stateId startNode = graph.addState();
+        graph.start = startNode;
+
+        mergeFragments(funcs);
+        fragments.clear();
+        NumTrapSitesFound += trapSites.size();
+
+        for(llvm::Function *entryFunc : entryFunctions(Mod)) {
+            graph.setFinal(funcExitNode.at(entryFunc));
+            fsm::stateId entryNode = bbId.at({entryFunc, &entryFunc->getEntryBlock()});
+            graph.addEdge(startNode, entryNode, fsm::Alphabet::epsilon);
+        }
+        // Each thread entry is reachable from the start only through the
+        // event its threads report first, so one table serves every thread.
+        forEachThreadEntry(Mod, [&](llvm::Function &entryFunc, fsm::symbolId label) {
+            graph.setFinal(funcExitNode.at(&entryFunc));
+            graph.addEdge(startNode, bbId.at({&entryFunc, &entryFunc.getEntryBlock()}), label);
+        });
+    }
+
+    // Builds the functions of one call graph SCC into a single NFA, wired the
+    // same way as the whole-module graph, and derives each member's summary
+    // from it. Calls leaving the SCC splice in summaries built earlier.
+    template<typename Policy>
+    void automatonBuilder<Policy>::summarizeSCC(const std::vector<llvm::Function*> &members) {
+        graph.clear();
+        bbId.clear();
+        funcExitNode.clear();
+        mergeFragments(members);
+        graph.finalize();
+        NumSummariesBuilt += members.size();
+
+        bool inherited = false;
+        for(llvm::Function *func : members) {
+            for(llvm::Instruction &inst : llvm::instructions(*func)) {
+                auto *call = llvm::dyn_cast<llvm::CallInst>(&inst);
+                if(call && approximatedSummaries.count(call->getCalledFunction())) inherited = true;
+            }
+        }
+        for(llvm::Function *func : members) {
+            fsm::Automaton nfa = members.size() == 1 ? std::move(graph) : graph;
+            fsm::stateId returned = nfa.addState();
+            nfa.addEdge(funcExitNode.at(func), returned, returnMarker);
+            nfa.start = bbId.at({func, &func->getEntryBlock()});
+            fsm::removeEpsilonTransitions(nfa);
+            fsm::approximation approximated;
+            summaries[func] = fsm::minimizeDFA(fsm::determinizeWithin(nfa, options.threads, options.maxStates, &approximated));
+            reportApproximation(approximated, *func->getParent(), diagName, "summary of " + func->getName().str(),
+                                nfa.numStates(), options.maxStates);
+            if(inherited || approximated.applied) approximatedSummaries.insert(func);
+        }
+        graph.clear();
+    }
+
+    // Keys only depend on the IR, so every SCC is looked up in the cache
+    // before any fragment is built; the functions of the SCCs that missed
+    // are added to `unsummarized`.
+    template<typename Policy>
+    void automatonBuilder<Policy>::lookupSummaries(const std::vector<std::vector<llvm::Function*>> &sccs,
+                                                   std::set<llvm::Function*> &unsummarized) {
+        summaries.clear();
+        approximatedSummaries.clear();
+        pending.clear();
+        pendingKeys.clear();
+        keys.clear();
+        reused = 0;
+        returnMarker = alphabet.intern("<return>");
+
+        for(auto const& members : sccs) {
+            if(!cache.enabled()) {
+                pending.push_back(members);
+                unsummarized.insert(members.begin(), members.end());
+                continue;
+            }
+
+            std::vector<std::string> memberKeys = cache.keysFor(members, keys);
+            std::vector<fsm::Automaton> loaded(members.size());
+            bool cached = true;
+            for(size_t i = 0; i < members.size() && cached; i++) {
+                cached = cache.load(memberKeys[i], alphabet, loaded[i]);
+            }
+            if(cached) {
+                reused += members.size();
+                for(size_t i = 0; i < members.size(); i++) {
+                    summaries[members[i]] = std::move(loaded[i]);
+                }
+            } else {
+                pending.push_back(members);
+                pendingKeys.push_back(memberKeys);
+                unsummarized.insert(members.begin(), members.end());
+            }
+            for(size_t i = 0; i < members.size(); i++) {
+                keys[members[i]] = memberKeys[i];
+            }
+        }
+        NumSummariesReused += reused;
+    }
+
+    template<typename Policy>
+    void automatonBuilder<Policy>::composeGraph(llvm::Module &Mod) {
+        for(size_t scc = 0; scc < pending.size(); scc++) {
+            summarizeSCC(pending[scc]);
+            if(!cache.enabled()) continue;
+            for(size_t i = 0; i < pending[scc].size(); i++) {
+                if(approximatedSummaries.count(pending[scc][i])) continue;
+                cache.store(pendingKeys[scc][i], alphabet, summaries.at(pending[scc][i]));
+            }
+        }
+        fragments.clear();
+        if(cache.enabled()) {
+            llvm::errs() << diagName << ": " << Mod.getSourceFileName() << ": reused " << reused
+                         << " of " << keys.size() << " function summaries from " << options.cacheDir << "\n";
+        }
+
+        graph.clear();
+        bbId.clear();
+        funcExitNode.clear();
+        trapSites.clear();
+        fsm::stateId startNode = graph.addState();
+        graph.start = startNode;
+        fsm::stateId exitNode = graph.addState(true);
+        for(llvm::Function *entryFunc : entryFunctions(Mod)) {
+            fsm::stateId entryNode = fsm::embed(graph, summaries.at(entryFunc), returnMarker, exitNode);
+            if(entryNode != fsm::Automaton::noState) {
+                graph.addEdge(startNode, entryNode, fsm::Alphabet::epsilon);
+            }
+        }
+        forEachThreadEntry(Mod, [&](llvm::Function &entryFunc, fsm::symbolId label) {
+            fsm::stateId entryNode = fsm::embed(graph, summaries.at(&entryFunc), returnMarker, exitNode);
+            if(entryNode != fsm::Automaton::noState) {
+                graph.addEdge(startNode, entryNode, label);
+            }
+        });
+        summaries.clear();
+    }
+
+    template<typename Policy>
+    fsm::Automaton automatonBuilder<Policy>::removeEpsilons() {
+        NumModuleGraphStates += graph.numStates();
+        NumModuleGraphEdges += graph.numEdges();
+        report.graphStates = graph.numStates();
+        report.graphEdges = graph.numEdges();
+        {
+            fsm::stageTimer timer("CFGRemoveEpsilon", diagName, &report.removeEpsilonMs);
+            fsm::removeEpsilonTransitions(graph);
+        }
+        report.epsilonFreeEdges = graph.numEdges();
+        fsm::Automaton nfa = std::move(graph);
+        graph.clear();
+        return nfa;
+    }
+
+    template<typename Policy>
+    fsm::Automaton automatonBuilder<Policy>::determinize(llvm::Module &Mod) {
+        fsm::Automaton nfa = removeEpsilons();
+        fsm::Automaton dfa;
+        {
+            fsm::stageTimer timer("CFGDeterminize", diagName, &report.determinizeMs);
+            dfa = fsm::determinizeWithin(nfa, options.threads, options.maxStates, &report.approximated);
+        }
+        reportApproximation(report.approximated, Mod, diagName, "", nfa.numStates(), options.maxStates);
+        report.dfaStates = dfa.numStates();
+        report.dfaEdges = dfa.numEdges();
+
+        if(options.minimize) {
+            dfa = minimizeReported(std::move(dfa), Mod, diagName, report);
+        }
+        return dfa;
+    }
+
+    template<typename Policy>
+    void automatonBuilder<Policy>::dumpGraph(llvm::Module &Mod, const std::string &baseName, const fsm::Automaton &dfa) {
+        writeOutputs<Policy>(options, Mod, diagName, baseName, dfa, alphabet, report);
+    }
+
+    template<typename... Policies>
+    class cfgEngine {
+        public:
+            cfgEngine(const engineOptions &options, const std::string &passName)
+                : options(options), builders(automatonBuilder<Policies>(options, diagNameOf<Policies>(passName))...) {}
+
+            template<typename Policy>
+            automatonBuilder<Policy>& automaton() {return std::get<automatonBuilder<Policy>>(builders);}
+
+            // The whole-module graph of every policy.
+            void buildGraphs(llvm::Module &Mod);
+            // Every policy's graph composed from per-function summaries.
+            void composeGraphs(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr);
+            // Determinizes every graph, unless options.lazy asks for the NFA,
+            // and writes it to <stem>_cfg.*, or to <stem>_<policy>_cfg.*
+            // when `tagged`.
+            void writeAutomata(llvm::Module &Mod, bool tagged);
+        private:
+            static constexpr size_t numPolicies = sizeof...(Policies);
+            using fragmentSlots = std::array<functionFragment*, numPolicies>;
+
+            engineOptions options;
+            std::tuple<automatonBuilder<Policies>...> builders;
+            // Looked up once per run: getMetadata(StringRef) interns the name
+            // in the context, which the fragment workers must not do.
+            unsigned instrumentedKind = 0;
+
+            template<typename Policy>
+            static std::string diagNameOf(const std::string &passName) {
+                return numPolicies == 1 ? passName : passName + "<" + Policy::name + ">";
+            }
+
+            void buildFragments(llvm::Module &Mod, const std::vector<llvm::Function*> &funcs);
+            // Starts every policy's report with the time the shared walk took.
+            void startReports(double buildMs) {
+                auto start = [&](automatonReport &report) {
+                    report = automatonReport();
+                    report.buildMs = buildMs;
+                };
+                (start(automaton<Policies>().report), ...);
+            }
+            template<size_t... Index>
+            void scanFunction(llvm::Function &func, const fragmentSlots &slots, std::index_sequence<Index...>) const;
+    };
+
+    // One pass over the function's instructions extends every policy's
+    // fragment at once.
+    template<typename... Policies>
+    template<size_t... Index>
+    void cfgEngine<Policies...>::scanFunction(llvm::Function &func, const fragmentSlots &slots,
+                                              std::index_sequence<Index...>) const {
+        std::tuple<fragmentScanner<Policies>...> scanners(
+            fragmentScanner<Policies>(func, *slots[Index], options.summaries, instrumentedKind)...);
+        size_t calls = 0;
+        for(llvm::BasicBlock &bb : func) {
+            std::apply([&](auto&... scanner) {(scanner.beginBlock(bb), ...);}, scanners);
+            for(llvm::Instruction &inst : bb) {
+                auto *callInst = llvm::dyn_cast<llvm::CallInst>(&inst);
+                if(!callInst) continue;
+                calls++;
+                std::apply([&](auto&... scanner) {(scanner.visitCall(*callInst), ...);}, scanners);
+            }
+            std::apply([&](auto&... scanner) {(scanner.endBlock(bb), ...);}, scanners);
+        }
+        std::apply([](auto&... scanner) {(scanner.finish(), ...);}, scanners);
+        ++NumFunctionsScanned;
+        NumCallsScanned += calls;
+    }
+
+    // Each function only reads its own IR and writes its own fragments, so
+    // they are built concurrently; the slots are created up front so the
+    // workers never touch the maps themselves.
+    template<typename... Policies>
+    void cfgEngine<Policies...>::buildFragments(llvm::Module &Mod, const std::vector<llvm::Function*> &funcs) {
+        instrumentedKind = Mod.getContext().getMDKindID("instrumented");
+        std::vector<fragmentSlots> slots;
+        for(llvm::Function *func : funcs) {
+            slots.push_back({{&automaton<Policies>().fragments[func]...}});
+        }
+        fsm::ThreadPool pool(options.threads);
+        pool.parallelFor(funcs.size(), [&](size_t index, unsigned) {
+            scanFunction(*funcs[index], slots[index], std::index_sequence_for<Policies...>());
+        });
+    }
+
+    template<typename... Policies>
+    void cfgEngine<Policies...>::buildGraphs(llvm::Module &Mod) {
+        double buildMs = 0;
+        {
+            fsm::stageTimer timer("CFGBuildGraph", Mod.getSourceFileName(), &buildMs);
+            std::vector<llvm::Function*> funcs;
+            for(llvm::Function &func : Mod) {
+                if(!func.isDeclaration() && !isThreadTrampoline(func)) funcs.push_back(&func);
+            }
+            buildFragments(Mod, funcs);
+            (automaton<Policies>().buildGraph(Mod, funcs), ...);
+        }
+        startReports(buildMs);
+    }
+
+    template<typename... Policies>
+    void cfgEngine<Policies...>::composeGraphs(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr) {
+        double buildMs = 0;
+        {
+            fsm::stageTimer timer("CFGBuildGraph", Mod.getSourceFileName(), &buildMs);
+            // scc_begin visits callees before their callers.
+            std::vector<std::vector<llvm::Function*>> sccs;
+            llvm::CallGraph &callGraph = mngr.getResult<llvm::CallGraphAnalysis>(Mod);
+            for(auto scc = llvm::scc_begin(&callGraph); !scc.isAtEnd(); ++scc) {
+                std::vector<llvm::Function*> members;
+                for(llvm::CallGraphNode *node : *scc) {
+                    llvm::Function *func = node->getFunction();
+                    if(func && !func->isDeclaration() && !isThreadTrampoline(*func)) members.push_back(func);
+                }
+                if(!members.empty()) sccs.push_back(std::move(members));
+            }
+
+            // Fragments are built, in one walk, for the functions any policy
+            // could not take from its cache.
+            std::set<llvm::Function*> unsummarized;
+            (automaton<Policies>().lookupSummaries(sccs, unsummarized), ...);
+            std::vector<llvm::Function*> funcs;
+            for(llvm::Function &func : Mod) {
+                if(unsummarized.count(&func)) funcs.push_back(&func);
+            }
+            buildFragments(Mod, funcs);
+            (automaton<Policies>().composeGraph(Mod), ...);
+        }
+        startReports(buildMs);
+    }
+
+    template<typename... Policies>
+    void cfgEngine<Policies...>::writeAutomata(llvm::Module &Mod, bool tagged) {
+        std::string stem = outputStem(Mod);
+        auto write = [&](auto &builder, const char *name) {
+            builder.dumpGraph(Mod, tagged ? stem + "_" + name : stem,
+                              options.lazy ? builder.removeEpsilons() : builder.determinize(Mod));
+        };
+        (write(automaton<Policies>(), Policies::name), ...);
+    }
+}
+
+#undef DEBUG_TYPE
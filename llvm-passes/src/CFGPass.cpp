@@ -0,0 +1,145 @@
+#include "llvm/Pass.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include <string>
+
+#include "CallNames.cpp"
+#include "DummySyscalls.cpp"
+#include "FSM.cpp"
+#include "AutomatonIO.cpp"
+#include "PassOptions.cpp"
+#include "SummaryCache.cpp"
+#include "EntryPoints.cpp"
+#include "CFGEngine.cpp"
+#include "AutomatonAnalysis.cpp"
+
+// Builds the libc and the syscall automaton from one walk over the IR, for
+// builds that want both. Run it after instrument-pass: the libc graph skips
+// the traps and comes out as it would from the uninstrumented module.
+// Writes <stem>_libc_cfg.* and <stem>_syscall_cfg.*.
+namespace mcfg {
+    struct combinedCFGOptions {
+        cfgengine::engineOptions engine;
+        bool libc = false;
+        bool syscall = false;
+    };
+
+    static bool parseOptions(const passParameters &params, combinedCFGOptions &options) {
+        for(auto const& param : params) {
+            bool valid = true;
+            if(cfgengine::parseEngineParameter(param, options.engine, "cfg-pass", valid)) {
+                if(!valid) return false;
+            } else if(param.first == "libc") {
+                options.libc = true;
+            } else if(param.first == "syscall") {
+                options.syscall = true;
+            } else {
+                llvm::errs() << "cfg-pass: unknown parameter '" << param.first << "'\n";
+                return false;
+            }
+        }
+        // Without a selection, build both.
+        if(!options.libc && !options.syscall) {
+            options.libc = true;
+            options.syscall = true;
+        }
+        return true;
+    }
+
+    class combinedCFGPass : public llvm::PassInfoMixin<combinedCFGPass> {
+        public:
+            explicit combinedCFGPass(combinedCFGOptions options = combinedCFGOptions()) : options(options) {}
+            static bool isRequired() {return true;}
+            llvm::PreservedAnalyses run(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr);
+        private:
+            combinedCFGOptions options;
+
+            template<typename... Policies>
+            void buildAutomata(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr);
+    };
+
+    template<typename... Policies>
+    void combinedCFGPass::buildAutomata(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr) {
+        if(options.engine.bypassesAnalysis()) {
+            // The cached analysis is built with the default options.
+            cfgengine::cfgEngine<Policies...> engine(options.engine, "cfg-pass");
+            if(options.engine.summaries) {
+                engine.composeGraphs(Mod, mngr);
+            } else {
+                engine.buildGraphs(Mod);
+            }
+            engine.writeAutomata(Mod, true);
+            return;
+        }
+        auto &automata = mngr.getResult<cfgengine::AutomatonAnalysis<Policies...>>(Mod);
+        std::string stem = cfgengine::outputStem(Mod);
+        auto diagName = [](const char *name) {
+            return sizeof...(Policies) == 1 ? std::string("cfg-pass") : std::string("cfg-pass<") + name + ">";
+        };
+        (cfgengine::writeCachedAutomaton<Policies>(Mod, options.engine, diagName(Policies::name),
+            automata.template get<Policies>(), stem + "_" + Policies::name), ...);
+    }
+
+    llvm::PreservedAnalyses combinedCFGPass::run(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr) {
+        if(entryFunctions(Mod).empty()) {
+            llvm::errs() << "cfg-pass: " << Mod.getSourceFileName() << ": no function definitions, nothing to do\n";
+            return llvm::PreservedAnalyses::all();
+        }
+        if(options.libc && options.syscall) {
+            buildAutomata<cfgengine::libcCallLabels, cfgengine::syscallLabels>(Mod, mngr);
+        } else if(options.libc) {
+            buildAutomata<cfgengine::libcCallLabels>(Mod, mngr);
+        } else {
+            buildAutomata<cfgengine::syscallLabels>(Mod, mngr);
+        }
+        return llvm::PreservedAnalyses::all();
+    }
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+    return {
+        LLVM_PLUGIN_API_VERSION, "combinedCFGPass", "v0.1",
+        [](llvm::PassBuilder &PB) {
+            PB.registerAnalysisRegistrationCallback([](llvm::ModuleAnalysisManager &MAM) {
+                MAM.registerPass([] {return cfgengine::AutomatonAnalysis<cfgengine::libcCallLabels, cfgengine::syscallLabels>();});
+                MAM.registerPass([] {return cfgengine::AutomatonAnalysis<cfgengine::libcCallLabels>();});
+                MAM.registerPass([] {return cfgengine::AutomatonAnalysis<cfgengine::syscallLabels>();});
+            });
+            // From clang -fpass-plugin= or a default<On> pipeline: after the
+            // optimizer, so the automata match the code that ends up in the
+            // binary. Like the other plugins it only runs when asked to, by
+            // setting $FSM_CFG (empty for the defaults), and takes its
+            // parameters from it.
+            PB.registerOptimizerLastEPCallback(
+                [](llvm::ModulePassManager &MPM, llvm::OptimizationLevel) {
+                    if(!std::getenv("FSM_CFG")) return;
+                    passParameters params;
+                    mcfg::combinedCFGOptions options;
+                    if(!parseEnvironmentParameters("FSM_CFG", "cfg-pass", params) ||
+                       !mcfg::parseOptions(params, options)) {
+                        llvm::report_fatal_error("cfg-pass: invalid $FSM_CFG");
+                    }
+                    MPM.addPass(mcfg::combinedCFGPass(options));
+                }
+            );
+            PB.registerPipelineParsingCallback(
+                [](llvm::StringRef Name, llvm::ModulePassManager &MPM,
+                   llvm::ArrayRef<llvm::PassBuilder::PipelineElement>) {
+                    passParameters params;
+                    if(parsePassName(Name, "cfg-pass", params)) {
+                        mcfg::combinedCFGOptions options;
+                        if(!mcfg::parseOptions(params, options)) return false;
+                        MPM.addPass(mcfg::combinedCFGPass(options));
+                        return true;
+                    }
+                    return false;
+                }
+            );
+        }
+    };
+}
@@ -1,5 +1,5 @@
 #include "../include/CallNames.h"
 
-bool isLibcFunction(const std::string &funcName) {
-    return libc_callnames.find(funcName) != libc_callnames.end();
-}
\ No newline at end of file
+bool isLibcFunction(std::string_view funcName) {
+    return libcSlot(funcName) >= 0;
+}
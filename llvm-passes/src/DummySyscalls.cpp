@@ -1,9 +1,9 @@
 #include "../include/DummySyscalls.h"
 
-static int libcMap(const std::string& funcName) {
-    auto it = dummy_syscall_map.find(funcName);
-    if (it != dummy_syscall_map.end()) {
-        return it->second;  
+static int libcMap(std::string_view funcName) {
+    int slot = libcSlot(funcName);
+    if (slot >= 0) {
+        return libc_ids[slot];
     }
     return -1;  
-}
\ No newline at end of file
+}
@@ -0,0 +1,120 @@
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "../include/AutomatonFormat.h"
+
+// Whether the module is a whole program rather than a library or one of
+// several translation units: whether it defines main.
+static bool isWholeProgram(llvm::Module &Mod) {
+    llvm::Function *mainFunc = Mod.getFunction("main");
+    return mainFunc && !mainFunc->isDeclaration();
+}
+
+// Functions the monitored run may start in. A program starts in main; a
+// module without one (a library, or a translation unit analysed on its own)
+// can be entered through any externally visible function it defines.
+static std::vector<llvm::Function*> entryFunctions(llvm::Module &Mod) {
+    std::vector<llvm::Function*> entries;
+    if(isWholeProgram(Mod)) {
+        entries.push_back(Mod.getFunction("main"));
+        return entries;
+    }
+    for(llvm::Function &func : Mod) {
+        if(!func.isDeclaration() && !func.hasLocalLinkage()) entries.push_back(&func);
+    }
+    return entries;
+}
+
+// instrument-pass starts each thread in a trampoline with this attribute,
+// which reports the thread's event and calls the real start routine.
+static const char *const threadTrampolineAttr = "fsm-thread-start";
+
+// Trampolines are not part of any automaton; the edge into their routine
+// stands for them.
+static bool isThreadTrampoline(const llvm::Function &func) {
+    return func.hasFnAttribute(threadTrampolineAttr);
+}
+
+// The start routine a trampoline calls, or `func` itself.
+static llvm::Function* unwrapThreadTrampoline(llvm::Function *func) {
+    if(!isThreadTrampoline(*func)) return func;
+    for(llvm::Instruction &inst : func->getEntryBlock()) {
+        auto *call = llvm::dyn_cast<llvm::CallBase>(&inst);
+        llvm::Function *callee = call ? call->getCalledFunction() : nullptr;
+        if(callee && !callee->isDeclaration() && callee->getFunctionType() == func->getFunctionType()) return callee;
+    }
+    return func;
+}
+
+// Adds the uses of functions, possibly cast, that `use` takes its value
+// from. The optimizer merges the pthread_create() calls of an if/else into
+// one that picks the routine with a select or phi; those are looked
+// through as long as nothing else uses them.
+static void collectRoutineUses(llvm::Use &use, std::vector<llvm::Use*> &uses, std::set<llvm::Value*> &visited) {
+    llvm::Value *value = use.get();
+    if(!visited.insert(value).second) return;
+    if(llvm::isa<llvm::Function>(value->stripPointerCasts())) {
+        uses.push_back(&use);
+    } else if(auto *select = llvm::dyn_cast<llvm::SelectInst>(value)) {
+        if(!select->hasOneUse()) return;
+        collectRoutineUses(select->getOperandUse(1), uses, visited);
+        collectRoutineUses(select->getOperandUse(2), uses, visited);
+    } else if(auto *phi = llvm::dyn_cast<llvm::PHINode>(value)) {
+        if(!phi->hasOneUse()) return;
+        for(llvm::Use &incoming : phi->incoming_values()) {
+            collectRoutineUses(incoming, uses, visited);
+        }
+    }
+}
+
+// Calls body(use, routine) for every use of a defined function the program
+// starts a thread in through pthread_create() or thrd_create().
+template<typename Body>
+static void forEachThreadRoutine(llvm::Module &Mod, Body body) {
+    const std::pair<const char*, unsigned> creators[] = {{"pthread_create", 2}, {"thrd_create", 1}};
+    for(auto const& creator : creators) {
+        llvm::Function *create = Mod.getFunction(creator.first);
+        if(!create) continue;
+        std::vector<llvm::Use*> uses;
+        for(llvm::User *user : create->users()) {
+            auto *call = llvm::dyn_cast<llvm::CallBase>(user);
+            if(!call || call->getCalledFunction() != create || call->arg_size() <= creator.second) continue;
+            std::set<llvm::Value*> visited;
+            collectRoutineUses(call->getArgOperandUse(creator.second), uses, visited);
+        }
+        for(llvm::Use *use : uses) {
+            auto *routine = llvm::cast<llvm::Function>(use->get()->stripPointerCasts());
+            if(!routine->isDeclaration()) body(*use, *routine);
+        }
+    }
+}
+
+// The defined functions the program starts threads in, in module order.
+// Thread entry k reports FSM_THREAD_EVENT_BASE + k (AutomatonFormat.h);
+// routines past FSM_MAX_THREAD_ENTRIES are left out, so their threads are
+// rejected.
+static std::vector<llvm::Function*> threadEntryFunctions(llvm::Module &Mod) {
+    std::set<llvm::Function*> started;
+    forEachThreadRoutine(Mod, [&](llvm::Use&, llvm::Function &routine) {
+        started.insert(unwrapThreadTrampoline(&routine));
+    });
+
+    std::vector<llvm::Function*> entries;
+    for(llvm::Function &func : Mod) {
+        if(!started.count(&func)) continue;
+        if(entries.size() == FSM_MAX_THREAD_ENTRIES) {
+            llvm::errs() << Mod.getSourceFileName() << ": more than " << FSM_MAX_THREAD_ENTRIES
+                         << " thread start routines, the rest get no automaton\n";
+            break;
+        }
+        entries.push_back(&func);
+    }
+    return entries;
+}
@@ -1,161 +1,1054 @@
 #include "../include/FSM.h"
+#include "../include/FSMStats.h"
 #include <cstdint>
 #include <queue>
+#include <deque>
+#include <tuple>
 
-std::set<fsm::nfaNode*> fsm::epsilonClosure(fsm::nfaNode* node) {
-    std::set<fsm::nfaNode*> closure;
-    std::queue<fsm::nfaNode*> q;
+#define DEBUG_TYPE "fsm"
 
-    q.push(node);
-    closure.insert(node);
+FSM_STATISTIC(NumEpsilonInputStates, "States of the NFAs given to epsilon removal");
+FSM_STATISTIC(NumEpsilonInputEdges, "Edges of the NFAs given to epsilon removal");
+FSM_STATISTIC(NumEpsilonEdgesRemoved, "Epsilon edges removed");
+FSM_STATISTIC(NumEpsilonFreeEdges, "Edges left after epsilon removal");
+FSM_STATISTIC(NumDeterminized, "Automata determinized");
+FSM_STATISTIC(NumDFAStates, "States of the determinized automata");
+FSM_STATISTIC(NumDFAEdges, "Edges of the determinized automata");
+FSM_STATISTIC(MaxDFAStates, "States of the largest determinized automaton");
+FSM_STATISTIC(NumDeterminizeLimited, "Determinizations stopped at their state limit");
+FSM_STATISTIC(NumApproximated, "Automata over-approximated to fit their state budget");
+FSM_STATISTIC(NumLazyStates, "States built by lazy determinization");
+FSM_STATISTIC(NumLazyFlushes, "Lazy DFA cache flushes");
+FSM_STATISTIC(NumMinimizedStatesIn, "States of the DFAs given to minimization");
+FSM_STATISTIC(NumMinimizedStatesOut, "States left after minimization");
+FSM_STATISTIC(NumTrackedPairs, "NFA/DFA state pairs visited by trackStates");
+FSM_STATISTIC(NumEmbeddedStates, "States copied by embed");
 
-    while(!q.empty()) {
-        fsm::nfaNode* currentNode = q.front();
-        q.pop();
-        for(auto const& edge : currentNode->edges) {
-            if(edge.second == "ε") {
-                if(closure.find(edge.first) == closure.end()) {
-                    closure.insert(edge.first);
-                    q.push(edge.first);
+namespace {
+    // Refinable partition of {0, ..., size-1} from Valmari & Lehtinen,
+    // "Efficient minimization of DFAs with partial transition functions".
+    // Elements of a set are contiguous in `elements`; marked elements are
+    // moved to the front of their set and split() separates them out.
+    struct refinablePartition {
+        uint32_t numSets;
+        std::vector<uint32_t> elements, location, setOf, first, past, marked;
+        std::vector<uint32_t> touched;
+
+        explicit refinablePartition(uint32_t size)
+            : numSets(size > 0 ? 1 : 0), elements(size), location(size), setOf(size, 0),
+              first(std::max<uint32_t>(size, 1), 0), past(std::max<uint32_t>(size, 1), size),
+              marked(std::max<uint32_t>(size, 1), 0) {
+            for(uint32_t i = 0; i < size; i++) {
+                elements[i] = location[i] = i;
+            }
+        }
+
+        void mark(uint32_t element) {
+            uint32_t set = setOf[element];
+            uint32_t i = location[element];
+            uint32_t j = first[set] + marked[set];
+            elements[i] = elements[j];
+            location[elements[i]] = i;
+            elements[j] = element;
+            location[element] = j;
+            if(marked[set]++ == 0) {
+                touched.push_back(set);
+            }
+        }
+
+        void split() {
+            while(!touched.empty()) {
+                uint32_t set = touched.back();
+                touched.pop_back();
+                uint32_t j = first[set] + marked[set];
+                if(j == past[set]) {
+                    marked[set] = 0;
+                    continue;
+                }
+                // The smaller half becomes the new set.
+                if(marked[set] <= past[set] - j) {
+                    first[numSets] = first[set];
+                    past[numSets] = first[set] = j;
+                } else {
+                    past[numSets] = past[set];
+                    first[numSets] = past[set] = j;
                 }
+                for(uint32_t i = first[numSets]; i < past[numSets]; i++) {
+                    setOf[elements[i]] = numSets;
+                }
+                marked[set] = marked[numSets] = 0;
+                numSets++;
             }
         }
+    };
+
+}
+
+// Shared by the subset constructions. Outside the anonymous namespace
+// because LazyDFA's cache, which has linkage, holds them.
+namespace fsm::detail {
+    // A set of NFA states, kept sorted, with its hash computed once.
+    struct stateSet {
+        uint64_t hash;
+        fsm::stateId id;
+        bool isFinal;
+        std::vector<fsm::stateId> states;
+    };
+
+    inline uint64_t hashStates(const std::vector<fsm::stateId> &states) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for(fsm::stateId state : states) {
+            hash = (hash ^ state) * 0x100000001b3ULL;
+        }
+        // Final avalanche so the low bits are usable for shard selection.
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        return hash;
     }
-    return closure;
-}   
 
-void fsm::removeEpsilonTransitions(fsm::nfaNode* startNode) {
-    std::set<fsm::nfaNode*> allNodes;
-    std::queue<fsm::nfaNode*> q;
+    // Hash table from state sets to DFA state IDs, split into independently
+    // locked shards so that workers only contend when they hit the same shard.
+    // Entries are never moved once inserted.
+    class stateSetTable {
+        public:
+            explicit stateSetTable(unsigned numShards) {
+                for(unsigned i = 0; i < numShards; i++) {
+                    shards.emplace_back(new shard());
+                }
+            }
 
-    q.push(startNode);
-    allNodes.insert(startNode);
+            // Returns the entry for `states` and whether this call inserted it.
+            std::pair<const stateSet*, bool> insert(std::vector<fsm::stateId> &&states, uint64_t hash,
+                                                    bool isFinal, std::atomic<fsm::stateId> &nextId) {
+                shard &target = *shards[hash % shards.size()];
+                std::lock_guard<std::mutex> guard(target.lock);
+                auto range = target.index.equal_range(hash);
+                for(auto it = range.first; it != range.second; ++it) {
+                    if(it->second->states == states) {
+                        return {it->second, false};
+                    }
+                }
+                target.storage.push_back({hash, nextId++, isFinal, std::move(states)});
+                const stateSet *entry = &target.storage.back();
+                target.index.emplace(hash, entry);
+                return {entry, true};
+            }
 
-    while(!q.empty()) {
-        fsm::nfaNode* currentNode = q.front();
-        q.pop();
-        for(auto const& edge : currentNode->edges) {
-            if(allNodes.find(edge.first) == allNodes.end()) {
-                allNodes.insert(edge.first);
-                q.push(edge.first);
+            const stateSet* find(const std::vector<fsm::stateId> &states, uint64_t hash) {
+                shard &target = *shards[hash % shards.size()];
+                std::lock_guard<std::mutex> guard(target.lock);
+                auto range = target.index.equal_range(hash);
+                for(auto it = range.first; it != range.second; ++it) {
+                    if(it->second->states == states) return it->second;
+                }
+                return nullptr;
+            }
+
+            // Drops every entry; pointers handed out before are invalid.
+            void clear() {
+                for(std::unique_ptr<shard> &current : shards) {
+                    current->storage.clear();
+                    current->index.clear();
+                }
+            }
+
+            template<typename F>
+            void forEach(F visit) const {
+                for(const std::unique_ptr<shard> &current : shards) {
+                    for(const stateSet &entry : current->storage) {
+                        visit(entry);
+                    }
+                }
+            }
+        private:
+            struct shard {
+                std::mutex lock;
+                std::deque<stateSet> storage;
+                std::unordered_multimap<uint64_t, const stateSet*> index;
+            };
+            std::vector<std::unique_ptr<shard>> shards;
+    };
+}
+
+namespace {
+    using fsm::detail::stateSet;
+    using fsm::detail::stateSetTable;
+    using fsm::detail::hashStates;
+
+    // Renumbers the states reachable from the start breadth-first, following
+    // each state's edges in label order. This is the numbering a sequential
+    // subset construction produces.
+    fsm::Automaton renumberBreadthFirst(const fsm::Automaton &dfa) {
+        fsm::Automaton result;
+        std::vector<fsm::stateId> renamed(dfa.numStates(), fsm::Automaton::noState);
+        std::vector<fsm::stateId> order;
+        std::vector<std::pair<fsm::symbolId, fsm::stateId>> sortedEdges;
+        renamed[dfa.start] = result.addState(dfa.isFinal(dfa.start));
+        result.start = renamed[dfa.start];
+        order.push_back(dfa.start);
+        for(size_t i = 0; i < order.size(); i++) {
+            fsm::stateId state = order[i];
+            sortedEdges.clear();
+            for(uint32_t edge = dfa.edgeBegin(state); edge < dfa.edgeEnd(state); edge++) {
+                sortedEdges.push_back({dfa.label(edge), dfa.target(edge)});
+            }
+            std::sort(sortedEdges.begin(), sortedEdges.end());
+            for(auto const& edge : sortedEdges) {
+                if(renamed[edge.second] == fsm::Automaton::noState) {
+                    renamed[edge.second] = result.addState(dfa.isFinal(edge.second));
+                    order.push_back(edge.second);
+                }
+                result.addEdge(renamed[state], renamed[edge.second], edge.first);
             }
         }
+        result.finalize();
+        return result;
     }
 
-    for(fsm::nfaNode* node : allNodes) {
-        std::set<fsm::nfaNode*> closure = fsm::epsilonClosure(node);
-        std::vector<std::pair<fsm::nfaNode*, std::string>> newEdges;
-        for(fsm::nfaNode* closureNode : closure) {
-            for(auto const& edge : closureNode->edges){
-                if(edge.second != "ε") {
-                    newEdges.push_back(edge);
+    // The partitions tailQuotient refines: partitions[r] is the class of
+    // every state after r rounds. Stops after `rounds` rounds or once a
+    // round changes nothing, which `stable` reports.
+    struct tailPartitions {
+        std::vector<std::vector<fsm::stateId>> classOf;
+        std::vector<fsm::stateId> numClasses;
+        bool stable = false;
+    };
+
+    tailPartitions refineTails(const fsm::Automaton &nfa, unsigned rounds) {
+        // Classes are numbered in order of their first state, so the
+        // partitions only depend on the automaton. Final states and dead
+        // ends start apart from the rest, so a quotient can stop wherever
+        // the automaton could.
+        tailPartitions result;
+        std::vector<fsm::stateId> classOf(nfa.numStates());
+        fsm::stateId numClasses = 0;
+        fsm::stateId initialClass[3] = {fsm::Automaton::noState, fsm::Automaton::noState, fsm::Automaton::noState};
+        for(fsm::stateId state = 0; state < nfa.numStates(); state++) {
+            int kind = nfa.isFinal(state) ? 2 : nfa.edgeBegin(state) == nfa.edgeEnd(state);
+            fsm::stateId &known = initialClass[kind];
+            if(known == fsm::Automaton::noState) known = numClasses++;
+            classOf[state] = known;
+        }
+        result.classOf.push_back(std::move(classOf));
+        result.numClasses.push_back(numClasses);
+
+        std::map<std::vector<uint64_t>, fsm::stateId> classOfSignature;
+        std::vector<uint64_t> signature;
+        for(unsigned round = 0; round < rounds; round++) {
+            const std::vector<fsm::stateId> &previous = result.classOf.back();
+            std::vector<fsm::stateId> refined(nfa.numStates());
+            classOfSignature.clear();
+            for(fsm::stateId state = 0; state < nfa.numStates(); state++) {
+                signature.assign(1, previous[state]);
+                for(uint32_t edge = nfa.edgeBegin(state); edge < nfa.edgeEnd(state); edge++) {
+                    signature.push_back(uint64_t(nfa.label(edge)) << 32 | previous[nfa.target(edge)]);
                 }
+                std::sort(signature.begin() + 1, signature.end());
+                signature.erase(std::unique(signature.begin() + 1, signature.end()), signature.end());
+                refined[state] = classOfSignature.emplace(signature, static_cast<fsm::stateId>(classOfSignature.size())).first->second;
             }
+            if(classOfSignature.size() == result.numClasses.back()) {
+                result.stable = true;
+                break;
+            }
+            result.classOf.push_back(std::move(refined));
+            result.numClasses.push_back(static_cast<fsm::stateId>(classOfSignature.size()));
+        }
+        return result;
+    }
+
+    fsm::Automaton quotientBy(const fsm::Automaton &nfa, const std::vector<fsm::stateId> &classOf, fsm::stateId numClasses) {
+        fsm::Automaton quotient;
+        for(fsm::stateId cls = 0; cls < numClasses; cls++) {
+            quotient.addState();
+        }
+        std::vector<std::tuple<fsm::stateId, fsm::symbolId, fsm::stateId>> edges;
+        for(fsm::stateId state = 0; state < nfa.numStates(); state++) {
+            if(nfa.isFinal(state)) quotient.setFinal(classOf[state]);
+            for(uint32_t edge = nfa.edgeBegin(state); edge < nfa.edgeEnd(state); edge++) {
+                edges.push_back({classOf[state], nfa.label(edge), classOf[nfa.target(edge)]});
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+        for(auto const& edge : edges) {
+            quotient.addEdge(std::get<0>(edge), std::get<2>(edge), std::get<1>(edge));
         }
-        node->edges.assign(newEdges.begin(), newEdges.end());
+        if(nfa.start != fsm::Automaton::noState) quotient.start = classOf[nfa.start];
+        quotient.finalize();
+        return quotient;
     }
 }
 
-void fsm::clearGraph(fsm::nfaNode* startNode) {
+constexpr fsm::symbolId fsm::Alphabet::epsilon;
+constexpr fsm::stateId fsm::Automaton::noState;
 
-    std::set<fsm::nfaNode*> allNodes;
-    std::queue<fsm::nfaNode*> q;
+fsm::Alphabet::Alphabet() {
+    intern("ε");
+}
 
-    q.push(startNode);
-    allNodes.insert(startNode);
+fsm::symbolId fsm::Alphabet::intern(const std::string &label) {
+    auto inserted = ids.emplace(label, static_cast<symbolId>(labels.size()));
+    if(inserted.second) {
+        labels.push_back(&inserted.first->first);
+    }
+    return inserted.first->second;
+}
 
-    while (!q.empty()) {
-        fsm::nfaNode* currentNode = q.front();
-        q.pop();
+const std::string& fsm::Alphabet::label(symbolId id) const {
+    return *labels.at(id);
+}
 
-        for (const auto& edge : currentNode->edges) {
-            fsm::nfaNode* neighbor = edge.first;
-            if (neighbor != nullptr)
-                if (allNodes.insert(neighbor).second) {
-                    q.push(neighbor);
-                }
+fsm::stateId fsm::Automaton::addState(bool isFinal) {
+    finals.push_back(isFinal);
+    return static_cast<stateId>(finals.size() - 1);
+}
+
+void fsm::Automaton::addEdge(stateId from, stateId to, symbolId label) {
+    if(finalized) {
+        // Reopen for construction: unpack the CSR arrays back into the build list.
+        for(stateId state = 0; state + 1 < offsets.size(); state++) {
+            for(uint32_t edge = offsets[state]; edge < offsets[state + 1]; edge++) {
+                pending.push_back({state, targets[edge], labels[edge]});
             }
         }
+        offsets.clear();
+        targets.clear();
+        labels.clear();
+        finalized = false;
+    }
+    pending.push_back({from, to, label});
+}
+
+void fsm::Automaton::finalize() {
+    if(finalized) return;
+
+    // Counting sort on the source state; stable, so edges keep their insertion order.
+    offsets.assign(numStates() + 1, 0);
+    for(const pendingEdge &edge : pending) {
+        offsets[edge.from + 1]++;
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    targets.resize(pending.size());
+    labels.resize(pending.size());
+    std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+    for(const pendingEdge &edge : pending) {
+        uint32_t slot = cursor[edge.from]++;
+        targets[slot] = edge.to;
+        labels[slot] = edge.label;
+    }
+
+    std::vector<pendingEdge>().swap(pending);
+    finalized = true;
+}
+
+fsm::stateId fsm::Automaton::next(stateId state, symbolId label) const {
+    for(uint32_t edge = edgeBegin(state); edge < edgeEnd(state); edge++) {
+        if(labels[edge] == label) return targets[edge];
+    }
+    return noState;
+}
+
+void fsm::Automaton::clear() {
+    start = noState;
+    finalized = false;
+    std::vector<uint8_t>().swap(finals);
+    std::vector<pendingEdge>().swap(pending);
+    std::vector<uint32_t>().swap(offsets);
+    std::vector<stateId>().swap(targets);
+    std::vector<symbolId>().swap(labels);
+}
+
+fsm::ThreadPool::ThreadPool(unsigned numThreads) {
+    if(numThreads == 0) {
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for(unsigned worker = 1; worker < numThreads; worker++) {
+        workers.emplace_back([this, worker] {workerLoop(worker);});
+    }
+}
+
+fsm::ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for(std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+void fsm::ThreadPool::parallelFor(size_t count, const std::function<void(size_t, unsigned)> &body) {
+    if(workers.empty() || count < 2) {
+        for(size_t i = 0; i < count; i++) {
+            body(i, 0);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        job = &body;
+        jobCount = count;
+        nextIndex = 0;
+        activeWorkers = static_cast<unsigned>(workers.size());
+        generation++;
+    }
+    wakeUp.notify_all();
+    runJob(0);
+
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [this] {return activeWorkers == 0;});
+    job = nullptr;
+}
 
-    for(fsm::nfaNode* node : allNodes) {
-        delete node;
+void fsm::ThreadPool::workerLoop(unsigned worker) {
+    uint64_t seenGeneration = 0;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wakeUp.wait(guard, [&] {return stopping || generation != seenGeneration;});
+            if(stopping) return;
+            seenGeneration = generation;
+        }
+        runJob(worker);
+        std::lock_guard<std::mutex> guard(lock);
+        if(--activeWorkers == 0) {
+            finished.notify_one();
+        }
     }
 }
 
-fsm::nfaNode* fsm::mergeEquivalentStates(fsm::nfaNode* startNode) {
-    std::set<fsm::nfaNode*> allNodes;
-    std::queue<fsm::nfaNode*> q;
+void fsm::ThreadPool::runJob(unsigned worker) {
+    for(size_t i = nextIndex++; i < jobCount; i = nextIndex++) {
+        (*job)(i, worker);
+    }
+}
+
+std::vector<fsm::stateId> fsm::epsilonClosure(const fsm::Automaton &nfa, fsm::stateId state) {
+    std::vector<bool> inClosure(nfa.numStates(), false);
+    std::vector<fsm::stateId> closure;
+    std::queue<fsm::stateId> q;
 
-    q.push(startNode);
-    allNodes.insert(startNode);
+    q.push(state);
+    inClosure[state] = true;
+    closure.push_back(state);
 
     while(!q.empty()) {
-        fsm::nfaNode* currentNode = q.front();
+        fsm::stateId currentState = q.front();
         q.pop();
-        for(auto const& edge : currentNode->edges) {
-            if(allNodes.find(edge.first) == allNodes.end()) {
-                allNodes.insert(edge.first);
-                q.push(edge.first);
+        for(uint32_t edge = nfa.edgeBegin(currentState); edge < nfa.edgeEnd(currentState); edge++) {
+            if(nfa.label(edge) == fsm::Alphabet::epsilon) {
+                fsm::stateId next = nfa.target(edge);
+                if(!inClosure[next]) {
+                    inClosure[next] = true;
+                    closure.push_back(next);
+                    q.push(next);
+                }
+            }
+        }
+    }
+    std::sort(closure.begin(), closure.end());
+    return closure;
+}
+
+void fsm::removeEpsilonTransitions(fsm::Automaton &nfa) {
+    fsm::stageTimer timer("FSMRemoveEpsilon");
+    nfa.finalize();
+    const fsm::stateId numStates = nfa.numStates();
+    NumEpsilonInputStates += numStates;
+    NumEpsilonInputEdges += nfa.numEdges();
+    uint64_t epsilonEdges = 0;
+    for(uint32_t edge = 0; edge < nfa.numEdges(); edge++) {
+        if(nfa.label(edge) == fsm::Alphabet::epsilon) epsilonEdges++;
+    }
+    NumEpsilonEdgesRemoved += epsilonEdges;
+    const fsm::stateId undefined = fsm::Automaton::noState;
+
+    fsm::Automaton result;
+    for(fsm::stateId state = 0; state < numStates; state++) {
+        result.addState(false);
+    }
+    result.start = nfa.start;
+    if(nfa.start == undefined) {
+        result.finalize();
+        nfa = std::move(result);
+        return;
+    }
+
+    // Only states reachable from the start state get an epsilon-free edge set.
+    std::vector<bool> reachable(numStates, false);
+    std::vector<fsm::stateId> order;
+    order.push_back(nfa.start);
+    reachable[nfa.start] = true;
+    for(size_t i = 0; i < order.size(); i++) {
+        fsm::stateId currentState = order[i];
+        for(uint32_t edge = nfa.edgeBegin(currentState); edge < nfa.edgeEnd(currentState); edge++) {
+            fsm::stateId next = nfa.target(edge);
+            if(!reachable[next]) {
+                reachable[next] = true;
+                order.push_back(next);
+            }
+        }
+    }
+
+    // Iterative Tarjan over the epsilon edges. Components are numbered in
+    // completion order, so every epsilon successor of a component has a
+    // smaller number and the components come out in reverse topological order.
+    std::vector<fsm::stateId> index(numStates, undefined);
+    std::vector<fsm::stateId> lowLink(numStates, undefined);
+    std::vector<uint32_t> component(numStates, undefined);
+    std::vector<bool> onStack(numStates, false);
+    std::vector<fsm::stateId> sccStack;
+    std::vector<std::pair<fsm::stateId, uint32_t>> callStack;
+    fsm::stateId nextIndex = 0;
+    uint32_t numComponents = 0;
+
+    for(fsm::stateId root : order) {
+        if(index[root] != undefined) continue;
+        index[root] = lowLink[root] = nextIndex++;
+        sccStack.push_back(root);
+        onStack[root] = true;
+        callStack.push_back({root, nfa.edgeBegin(root)});
+
+        while(!callStack.empty()) {
+            fsm::stateId currentState = callStack.back().first;
+            uint32_t &edge = callStack.back().second;
+            if(edge < nfa.edgeEnd(currentState)) {
+                uint32_t currentEdge = edge++;
+                if(nfa.label(currentEdge) != fsm::Alphabet::epsilon) continue;
+                fsm::stateId next = nfa.target(currentEdge);
+                if(index[next] == undefined) {
+                    index[next] = lowLink[next] = nextIndex++;
+                    sccStack.push_back(next);
+                    onStack[next] = true;
+                    callStack.push_back({next, nfa.edgeBegin(next)});
+                } else if(onStack[next]) {
+                    lowLink[currentState] = std::min(lowLink[currentState], index[next]);
+                }
+                continue;
+            }
+
+            callStack.pop_back();
+            if(!callStack.empty()) {
+                fsm::stateId parent = callStack.back().first;
+                lowLink[parent] = std::min(lowLink[parent], lowLink[currentState]);
+            }
+            if(lowLink[currentState] == index[currentState]) {
+                fsm::stateId member;
+                do {
+                    member = sccStack.back();
+                    sccStack.pop_back();
+                    onStack[member] = false;
+                    component[member] = numComponents;
+                } while(member != currentState);
+                numComponents++;
+            }
+        }
+    }
+
+    // Group the members of each component contiguously.
+    std::vector<uint32_t> memberOffsets(numComponents + 1, 0);
+    for(fsm::stateId state : order) {
+        memberOffsets[component[state] + 1]++;
+    }
+    std::partial_sum(memberOffsets.begin(), memberOffsets.end(), memberOffsets.begin());
+    std::vector<fsm::stateId> members(order.size());
+    std::vector<uint32_t> cursor(memberOffsets.begin(), memberOffsets.end() - 1);
+    for(fsm::stateId state : order) {
+        members[cursor[component[state]]++] = state;
+    }
+
+    // Propagate closures once, sinks first. A component whose only
+    // contribution is a single epsilon successor shares that successor's
+    // closure instead of copying it, which keeps long epsilon chains linear.
+    using labeledEdge = std::pair<fsm::symbolId, fsm::stateId>;
+    std::vector<std::vector<labeledEdge>> closures;
+    std::vector<uint32_t> closureOf(numComponents);
+    std::vector<bool> componentFinal(numComponents, false);
+    std::vector<labeledEdge> buffer;
+    std::vector<uint32_t> successors;
+
+    for(uint32_t current = 0; current < numComponents; current++) {
+        buffer.clear();
+        successors.clear();
+        bool isFinal = false;
+        for(uint32_t i = memberOffsets[current]; i < memberOffsets[current + 1]; i++) {
+            fsm::stateId member = members[i];
+            isFinal = isFinal || nfa.isFinal(member);
+            for(uint32_t edge = nfa.edgeBegin(member); edge < nfa.edgeEnd(member); edge++) {
+                if(nfa.label(edge) != fsm::Alphabet::epsilon) {
+                    buffer.push_back({nfa.label(edge), nfa.target(edge)});
+                } else if(component[nfa.target(edge)] != current) {
+                    successors.push_back(component[nfa.target(edge)]);
+                }
             }
         }
+        std::sort(successors.begin(), successors.end());
+        successors.erase(std::unique(successors.begin(), successors.end()), successors.end());
+
+        for(uint32_t successor : successors) {
+            isFinal = isFinal || componentFinal[successor];
+        }
+        componentFinal[current] = isFinal;
+
+        if(buffer.empty() && successors.size() == 1) {
+            closureOf[current] = closureOf[successors.front()];
+            continue;
+        }
+        for(uint32_t successor : successors) {
+            const std::vector<labeledEdge> &inherited = closures[closureOf[successor]];
+            buffer.insert(buffer.end(), inherited.begin(), inherited.end());
+        }
+        std::sort(buffer.begin(), buffer.end());
+        buffer.erase(std::unique(buffer.begin(), buffer.end()), buffer.end());
+        closureOf[current] = static_cast<uint32_t>(closures.size());
+        closures.push_back(buffer);
     }
 
-    std::map<std::set<fsm::nfaNode*>, fsm::nfaNode*> stateMap;
-    std::queue<std::set<fsm::nfaNode*>> stateQueue;
-    uint64_t newId = 0;
-    fsm::nfaNode* newStartNode = nullptr;
+    for(fsm::stateId state : order) {
+        uint32_t current = component[state];
+        result.setFinal(state, componentFinal[current]);
+        for(const labeledEdge &edge : closures[closureOf[current]]) {
+            result.addEdge(state, edge.second, edge.first);
+        }
+    }
+
+    result.finalize();
+    NumEpsilonFreeEdges += result.numEdges();
+    nfa = std::move(result);
+}
 
-    std::set<fsm::nfaNode*> startSet = {startNode};
-    newStartNode = new fsm::nfaNode(newId++, startNode->isFinalState);
+fsm::Automaton fsm::mergeEquivalentStates(const fsm::Automaton &nfa, unsigned numThreads, size_t maxStates) {
+    fsm::stageTimer timer("FSMDeterminize");
+    if(nfa.start == fsm::Automaton::noState) {
+        fsm::Automaton empty;
+        empty.finalize();
+        return empty;
+    }
+    fsm::ThreadPool pool(numThreads);
+    stateSetTable table(pool.size() * 16);
+    std::atomic<fsm::stateId> nextId{0};
 
-    stateMap[startSet] = newStartNode;
-    stateQueue.push(startSet);
+    struct dfaEdge {
+        fsm::stateId from;
+        fsm::stateId to;
+        fsm::symbolId label;
+    };
+    struct workerState {
+        std::vector<std::pair<fsm::symbolId, fsm::stateId>> moves;
+        std::vector<const stateSet*> discovered;
+        std::vector<dfaEdge> edges;
+    };
+    std::vector<workerState> perWorker(pool.size());
 
-    while (!stateQueue.empty()) {
-        std::set<fsm::nfaNode*> currentSet = stateQueue.front();
-        stateQueue.pop();
-        fsm::nfaNode* currentNewNode = stateMap[currentSet];
+    std::vector<fsm::stateId> startStates = {nfa.start};
+    uint64_t startHash = hashStates(startStates);
+    std::vector<const stateSet*> frontier = {
+        table.insert(std::move(startStates), startHash, nfa.isFinal(nfa.start), nextId).first
+    };
+    std::vector<dfaEdge> edges;
+    std::atomic<bool> overLimit{false};
 
-        std::map<std::string, std::set<fsm::nfaNode*>> transitionMap;
-        bool isCurrentSetFinal = false;
+    while(!frontier.empty()) {
+        pool.parallelFor(frontier.size(), [&](size_t index, unsigned worker) {
+            if(overLimit.load(std::memory_order_relaxed)) return;
+            const stateSet &current = *frontier[index];
+            workerState &local = perWorker[worker];
 
-        for (fsm::nfaNode* node: currentSet) {
-            if(node->isFinalState) {
-                isCurrentSetFinal = true;
+            local.moves.clear();
+            for(fsm::stateId state : current.states) {
+                for(uint32_t edge = nfa.edgeBegin(state); edge < nfa.edgeEnd(state); edge++) {
+                    local.moves.push_back({nfa.label(edge), nfa.target(edge)});
+                }
             }
-            for (const auto& edge : node->edges) {
-                if(edge.first != nullptr) {
-                    transitionMap[edge.second].insert(edge.first);
+            std::sort(local.moves.begin(), local.moves.end());
+            local.moves.erase(std::unique(local.moves.begin(), local.moves.end()), local.moves.end());
+
+            // Moves are grouped by label and sorted by target, so each group
+            // is already a canonical target set.
+            for(size_t begin = 0, end; begin < local.moves.size(); begin = end) {
+                fsm::symbolId label = local.moves[begin].first;
+                std::vector<fsm::stateId> targets;
+                bool isFinal = false;
+                for(end = begin; end < local.moves.size() && local.moves[end].first == label; end++) {
+                    targets.push_back(local.moves[end].second);
+                    isFinal = isFinal || nfa.isFinal(local.moves[end].second);
+                }
+                uint64_t hash = hashStates(targets);
+                auto inserted = table.insert(std::move(targets), hash, isFinal, nextId);
+                if(inserted.second) {
+                    local.discovered.push_back(inserted.first);
+                    if(maxStates != 0 && inserted.first->id >= maxStates) {
+                        overLimit.store(true, std::memory_order_relaxed);
+                    }
                 }
+                local.edges.push_back({current.id, inserted.first->id, label});
             }
+        });
+
+        frontier.clear();
+        for(workerState &local : perWorker) {
+            frontier.insert(frontier.end(), local.discovered.begin(), local.discovered.end());
+            edges.insert(edges.end(), local.edges.begin(), local.edges.end());
+            local.discovered.clear();
+            local.edges.clear();
+        }
+        if(overLimit) {
+            ++NumDeterminizeLimited;
+            fsm::Automaton empty;
+            empty.finalize();
+            return empty;
         }
+    }
 
-        currentNewNode->isFinalState = isCurrentSetFinal;
+    // IDs were handed out in whatever order the workers got to them; build
+    // the raw DFA and renumber it canonically.
+    fsm::Automaton raw;
+    for(fsm::stateId state = 0; state < nextId; state++) {
+        raw.addState(false);
+    }
+    table.forEach([&raw](const stateSet &entry) {raw.setFinal(entry.id, entry.isFinal);});
+    for(const dfaEdge &edge : edges) {
+        raw.addEdge(edge.from, edge.to, edge.label);
+    }
+    raw.start = 0;
+    raw.finalize();
+    fsm::Automaton dfa = renumberBreadthFirst(raw);
+    ++NumDeterminized;
+    NumDFAStates += dfa.numStates();
+    NumDFAEdges += dfa.numEdges();
+    MaxDFAStates.updateMax(dfa.numStates());
+    return dfa;
+}
 
-        for(auto const& transition : transitionMap) {
-            std::string label = transition.first;
-            std::set<fsm::nfaNode*> targetSet = transition.second;
+fsm::Automaton fsm::tailQuotient(const fsm::Automaton &nfa, unsigned rounds, bool *stable) {
+    tailPartitions partitions = refineTails(nfa, rounds);
+    if(stable) *stable = partitions.stable;
+    return quotientBy(nfa, partitions.classOf.back(), partitions.numClasses.back());
+}
 
-            if(targetSet.empty()) {
-                continue;
+fsm::Automaton fsm::determinizeWithin(const fsm::Automaton &nfa, unsigned numThreads, size_t maxStates,
+                                      approximation *approximated) {
+    if(approximated) *approximated = approximation();
+    if(nfa.start == fsm::Automaton::noState) return fsm::mergeEquivalentStates(nfa);
+    fsm::Automaton dfa = fsm::mergeEquivalentStates(nfa, numThreads, maxStates);
+    if(maxStates == 0 || dfa.start != fsm::Automaton::noState) return dfa;
+
+    // Quotients after ever fewer rounds; a partition that stops changing
+    // early is the bisimulation one and loses nothing. After no rounds only
+    // final states, dead ends and the rest are told apart, and the DFA of
+    // that has at most eight states. Refinement can take as many rounds as there are
+    // states, so the bisimulation quotient is not asked for outright.
+    static const unsigned schedule[] = {32, 16, 8, 4, 2, 1, 0};
+    tailPartitions partitions = refineTails(nfa, schedule[0]);
+    unsigned last = static_cast<unsigned>(partitions.classOf.size()) - 1;
+    for(unsigned rounds : schedule) {
+        // Past the last partition, all are the same.
+        if(rounds > last && rounds != schedule[0]) continue;
+        unsigned used = std::min(rounds, last);
+        fsm::Automaton quotient = quotientBy(nfa, partitions.classOf[used], partitions.numClasses[used]);
+        dfa = fsm::mergeEquivalentStates(quotient, numThreads, used == 0 ? 0 : maxStates);
+        if(dfa.start == fsm::Automaton::noState) continue;
+        ++NumApproximated;
+        if(approximated) {
+            approximated->applied = true;
+            approximated->rounds = used == last && partitions.stable ? approximation::exact : used;
+            approximated->quotientStates = quotient.numStates();
+        }
+        break;
+    }
+    return dfa;
+}
+
+struct fsm::LazyDFA::cache {
+    cache(const fsm::Automaton &nfa, size_t capacity) : nfa(nfa), capacity(capacity), table(1) {}
+
+    const fsm::Automaton &nfa;
+    size_t capacity;
+    size_t used = 0;
+    // Column of each NFA label in the transition rows.
+    std::vector<uint32_t> columnOf;
+    uint32_t numColumns = 0;
+    stateSetTable table;
+    std::atomic<fsm::stateId> nextId{0};
+    std::vector<const stateSet*> byId;
+    std::vector<uint8_t> moves;
+    // numColumns entries per state: the memoized successor, `unknown`
+    // until it is first asked for.
+    std::vector<handle> transitions;
+    handle startState = unknown;
+    size_t flushes = 0;
+    std::vector<fsm::stateId> targets;
+
+    static constexpr handle unknown = dead - 1;
+    static constexpr uint32_t noColumn = UINT32_MAX;
+
+    void flush() {
+        table.clear();
+        byId.clear();
+        moves.clear();
+        transitions.clear();
+        nextId = 0;
+        used = 0;
+        startState = unknown;
+        flushes++;
+        ++NumLazyFlushes;
+    }
+
+    // The cached state for `states`, flushing first if it is new and does
+    // not fit. `flushed` tells the caller its own handles are gone.
+    handle insert(std::vector<fsm::stateId> &&states, bool &flushed) {
+        uint64_t hash = hashStates(states);
+        flushed = false;
+        if(const stateSet *known = table.find(states, hash)) return known->id;
+
+        bool isFinal = false;
+        bool hasMoves = false;
+        for(fsm::stateId state : states) {
+            isFinal = isFinal || nfa.isFinal(state);
+            hasMoves = hasMoves || nfa.edgeBegin(state) != nfa.edgeEnd(state);
+        }
+        // The set, its row and roughly what the table keeps per entry.
+        size_t cost = sizeof(stateSet) + states.size() * sizeof(fsm::stateId) + numColumns * sizeof(handle) + 64;
+        if(used + cost > capacity && !byId.empty()) {
+            flush();
+            flushed = true;
+        }
+        used += cost;
+        const stateSet *entry = table.insert(std::move(states), hash, isFinal, nextId).first;
+        byId.push_back(entry);
+        moves.push_back(hasMoves);
+        transitions.resize(transitions.size() + numColumns, unknown);
+        ++NumLazyStates;
+        return entry->id;
+    }
+};
+
+fsm::LazyDFA::LazyDFA(const fsm::Automaton &nfa, size_t cacheBytes) : self(new cache(nfa, cacheBytes)) {
+    for(uint32_t edge = 0; edge < nfa.numEdges(); edge++) {
+        fsm::symbolId label = nfa.label(edge);
+        if(label >= self->columnOf.size()) self->columnOf.resize(label + 1, cache::noColumn);
+        if(self->columnOf[label] == cache::noColumn) self->columnOf[label] = self->numColumns++;
+    }
+}
+
+fsm::LazyDFA::~LazyDFA() = default;
+fsm::LazyDFA::LazyDFA(LazyDFA&&) noexcept = default;
+fsm::LazyDFA& fsm::LazyDFA::operator=(LazyDFA&&) noexcept = default;
+
+fsm::LazyDFA::handle fsm::LazyDFA::start() {
+    if(self->startState == cache::unknown) {
+        if(self->nfa.start == fsm::Automaton::noState) return dead;
+        bool flushed;
+        self->startState = self->insert({self->nfa.start}, flushed);
+    }
+    return self->startState;
+}
+
+fsm::LazyDFA::handle fsm::LazyDFA::step(handle from, fsm::symbolId label) {
+    if(from == dead || label >= self->columnOf.size() || self->columnOf[label] == cache::noColumn) return dead;
+    size_t slot = size_t(from) * self->numColumns + self->columnOf[label];
+    handle known = self->transitions[slot];
+    if(known != cache::unknown) return known;
+
+    std::vector<fsm::stateId> &targets = self->targets;
+    targets.clear();
+    for(fsm::stateId state : self->byId[from]->states) {
+        for(uint32_t edge = self->nfa.edgeBegin(state); edge < self->nfa.edgeEnd(state); edge++) {
+            if(self->nfa.label(edge) == label) targets.push_back(self->nfa.target(edge));
+        }
+    }
+    if(targets.empty()) {
+        self->transitions[slot] = dead;
+        return dead;
+    }
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+    bool flushed;
+    handle next = self->insert(std::vector<fsm::stateId>(targets), flushed);
+    if(!flushed) self->transitions[slot] = next;
+    return next;
+}
+
+bool fsm::LazyDFA::isFinal(handle state) const {return self->byId[state]->isFinal;}
+bool fsm::LazyDFA::hasMoves(handle state) const {return self->moves[state] != 0;}
+const std::vector<fsm::stateId>& fsm::LazyDFA::states(handle state) const {return self->byId[state]->states;}
+size_t fsm::LazyDFA::cachedStates() const {return self->byId.size();}
+size_t fsm::LazyDFA::flushes() const {return self->flushes;}
+
+fsm::Automaton fsm::minimizeDFA(const fsm::Automaton &dfa) {
+    fsm::stageTimer timer("FSMMinimize");
+    fsm::Automaton minimized;
+    if(dfa.start == fsm::Automaton::noState) {
+        minimized.finalize();
+        return minimized;
+    }
+
+    // Renumber the states reachable from the start state densely.
+    std::vector<fsm::stateId> dense(dfa.numStates(), fsm::Automaton::noState);
+    std::vector<fsm::stateId> states;
+    dense[dfa.start] = 0;
+    states.push_back(dfa.start);
+    for(size_t i = 0; i < states.size(); i++) {
+        for(uint32_t edge = dfa.edgeBegin(states[i]); edge < dfa.edgeEnd(states[i]); edge++) {
+            if(dense[dfa.target(edge)] == fsm::Automaton::noState) {
+                dense[dfa.target(edge)] = static_cast<fsm::stateId>(states.size());
+                states.push_back(dfa.target(edge));
             }
+        }
+    }
+    const uint32_t numStates = static_cast<uint32_t>(states.size());
 
-            fsm::nfaNode* targetNewNode;
-            if(stateMap.find(targetSet) == stateMap.end()) {
-                targetNewNode = new fsm::nfaNode(newId++, false);
-                stateMap[targetSet] = targetNewNode;
-                stateQueue.push(targetSet);
-            } else {
-                targetNewNode = stateMap[targetSet];
+    std::vector<uint32_t> tail, head;
+    std::vector<fsm::symbolId> label;
+    for(fsm::stateId state : states) {
+        for(uint32_t edge = dfa.edgeBegin(state); edge < dfa.edgeEnd(state); edge++) {
+            tail.push_back(dense[state]);
+            head.push_back(dense[dfa.target(edge)]);
+            label.push_back(dfa.label(edge));
+        }
+    }
+    const uint32_t numTransitions = static_cast<uint32_t>(tail.size());
+
+    // Incoming transitions of every state, CSR style.
+    std::vector<uint32_t> incomingOffsets(numStates + 1, 0);
+    for(uint32_t t = 0; t < numTransitions; t++) {
+        incomingOffsets[head[t] + 1]++;
+    }
+    std::partial_sum(incomingOffsets.begin(), incomingOffsets.end(), incomingOffsets.begin());
+    std::vector<uint32_t> incoming(numTransitions);
+    std::vector<uint32_t> cursor(incomingOffsets.begin(), incomingOffsets.end() - 1);
+    for(uint32_t t = 0; t < numTransitions; t++) {
+        incoming[cursor[head[t]]++] = t;
+    }
+
+    // Blocks start out split by finality.
+    refinablePartition blocks(numStates);
+    for(uint32_t state = 0; state < numStates; state++) {
+        if(dfa.isFinal(states[state])) blocks.mark(state);
+    }
+    blocks.split();
+
+    // Cords are sets of transitions with the same label whose heads lie in
+    // the same block; they start out split by label only.
+    refinablePartition cords(numTransitions);
+    if(numTransitions > 0) {
+        std::stable_sort(cords.elements.begin(), cords.elements.end(),
+            [&label](uint32_t a, uint32_t b) {return label[a] < label[b];});
+        cords.numSets = 0;
+        fsm::symbolId currentLabel = label[cords.elements[0]];
+        for(uint32_t i = 0; i < numTransitions; i++) {
+            uint32_t t = cords.elements[i];
+            if(label[t] != currentLabel) {
+                currentLabel = label[t];
+                cords.past[cords.numSets++] = i;
+                cords.first[cords.numSets] = i;
             }
+            cords.setOf[t] = cords.numSets;
+            cords.location[t] = i;
+        }
+        cords.past[cords.numSets++] = numTransitions;
+    }
+
+    uint32_t nextBlock = 1;
+    uint32_t nextCord = 0;
+    while(nextCord < cords.numSets) {
+        for(uint32_t i = cords.first[nextCord]; i < cords.past[nextCord]; i++) {
+            blocks.mark(tail[cords.elements[i]]);
+        }
+        blocks.split();
+        nextCord++;
+        while(nextBlock < blocks.numSets) {
+            for(uint32_t i = blocks.first[nextBlock]; i < blocks.past[nextBlock]; i++) {
+                uint32_t state = blocks.elements[i];
+                for(uint32_t j = incomingOffsets[state]; j < incomingOffsets[state + 1]; j++) {
+                    cords.mark(incoming[j]);
+                }
+            }
+            cords.split();
+            nextBlock++;
+        }
+    }
+
+    // Emit one state per block, numbered in breadth-first order from the start.
+    std::vector<fsm::stateId> blockState(blocks.numSets, fsm::Automaton::noState);
+    std::vector<uint32_t> pendingBlocks;
+    blockState[blocks.setOf[0]] = minimized.addState(dfa.isFinal(dfa.start));
+    minimized.start = blockState[blocks.setOf[0]];
+    pendingBlocks.push_back(blocks.setOf[0]);
+    for(size_t i = 0; i < pendingBlocks.size(); i++) {
+        uint32_t block = pendingBlocks[i];
+        fsm::stateId representative = states[blocks.elements[blocks.first[block]]];
+        for(uint32_t edge = dfa.edgeBegin(representative); edge < dfa.edgeEnd(representative); edge++) {
+            uint32_t targetBlock = blocks.setOf[dense[dfa.target(edge)]];
+            if(blockState[targetBlock] == fsm::Automaton::noState) {
+                fsm::stateId targetRepresentative = states[blocks.elements[blocks.first[targetBlock]]];
+                blockState[targetBlock] = minimized.addState(dfa.isFinal(targetRepresentative));
+                pendingBlocks.push_back(targetBlock);
+            }
+            minimized.addEdge(blockState[block], blockState[targetBlock], dfa.label(edge));
+        }
+    }
+
+    minimized.finalize();
+    NumMinimizedStatesIn += dfa.numStates();
+    NumMinimizedStatesOut += minimized.numStates();
+    return minimized;
+}
+
+std::vector<std::vector<fsm::stateId>> fsm::trackStates(const fsm::Automaton &nfa, const fsm::Automaton &dfa) {
+    fsm::stageTimer timer("FSMTrackStates");
+    std::vector<std::vector<fsm::stateId>> statesAt(nfa.numStates());
+    if(nfa.start == fsm::Automaton::noState || dfa.start == fsm::Automaton::noState) return statesAt;
 
-            currentNewNode->edges.emplace_back(targetNewNode, label);
+    // Explore the product of both automata; epsilon moves of the NFA leave
+    // the DFA where it is.
+    std::set<std::pair<fsm::stateId, fsm::stateId>> seen;
+    std::queue<std::pair<fsm::stateId, fsm::stateId>> q;
+    seen.insert({nfa.start, dfa.start});
+    q.push({nfa.start, dfa.start});
+    while(!q.empty()) {
+        auto current = q.front();
+        q.pop();
+        statesAt[current.first].push_back(current.second);
+        for(uint32_t edge = nfa.edgeBegin(current.first); edge < nfa.edgeEnd(current.first); edge++) {
+            fsm::stateId next = current.second;
+            if(nfa.label(edge) != fsm::Alphabet::epsilon) {
+                next = dfa.next(current.second, nfa.label(edge));
+                if(next == fsm::Automaton::noState) continue;
+            }
+            if(seen.insert({nfa.target(edge), next}).second) {
+                q.push({nfa.target(edge), next});
+            }
         }
     }
+    for(auto &states : statesAt) {
+        std::sort(states.begin(), states.end());
+    }
+    NumTrackedPairs += seen.size();
+    return statesAt;
+}
 
-    for(fsm::nfaNode* node : allNodes) {
-        delete node;
+fsm::stateId fsm::embed(fsm::Automaton &into, const fsm::Automaton &fragment, fsm::symbolId marker, fsm::stateId continuation) {
+    if(fragment.start == fsm::Automaton::noState) return fsm::Automaton::noState;
+    fsm::stateId base = into.numStates();
+    NumEmbeddedStates += fragment.numStates();
+    for(fsm::stateId state = 0; state < fragment.numStates(); state++) {
+        into.addState(fragment.isFinal(state));
+    }
+    for(fsm::stateId state = 0; state < fragment.numStates(); state++) {
+        for(uint32_t edge = fragment.edgeBegin(state); edge < fragment.edgeEnd(state); edge++) {
+            if(fragment.label(edge) == marker) {
+                into.addEdge(base + state, continuation, fsm::Alphabet::epsilon);
+            } else {
+                into.addEdge(base + state, base + fragment.target(edge), fragment.label(edge));
+            }
+        }
     }
+    return base + fragment.start;
+}
 
-    return newStartNode;
-}
\ No newline at end of file
+#undef DEBUG_TYPE
@@ -2,33 +2,227 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include <string>
+#include <memory>
+#include <map>
+#include <set>
 
+#include "CallNames.cpp"
 #include "DummySyscalls.cpp"
+#include "FSM.cpp"
+#include "AutomatonIO.cpp"
+#include "PassOptions.cpp"
+#include "SummaryCache.cpp"
+#include "EntryPoints.cpp"
+#include "CFGEngine.cpp"
+#include "AutomatonAnalysis.cpp"
+#include "../include/AutomatonFormat.h"
+#include "../include/EventRing.h"
+
+#define DEBUG_TYPE "instrument-pass"
+
+FSM_STATISTIC(NumTrapsInserted, "Trap calls inserted before libc calls");
+FSM_STATISTIC(NumInlineChecks, "Inline table lookups inserted");
+FSM_STATISTIC(NumOutOfLineChecks, "Checks left to the runtime because the table is not dense");
+FSM_STATISTIC(NumForbiddenCalls, "libc calls the automaton never allows");
+FSM_STATISTIC(NumRingEvents, "Ring appends inserted");
+FSM_STATISTIC(NumRingFlushPoints, "Ring flushes inserted before calls that enter the kernel");
+FSM_STATISTIC(NumTablesEmbedded, "Transition tables embedded");
+FSM_STATISTIC(NumBitParallelChecks, "Calls checked against a bit-parallel NFA");
+FSM_STATISTIC(NumBitParallelImages, "Bit-parallel NFA images embedded");
+FSM_STATISTIC(NumThreadTrampolines, "Thread start routines wrapped to report their thread event");
 
 namespace instrument {
+    // trap:   syscall(470, id) before every libc call, checked by the kernel.
+    // inline: a lookup in the embedded transition table that advances a
+    //         thread-local monitor state and aborts on an illegal call. The
+    //         table comes from table=, or from AutomatonAnalysis when the
+    //         pass runs without one. Either may be a bit-parallel NFA
+    //         instead (see inlineEngine), which the runtime steps. The
+    //         table and the monitor state are program-wide globals, so
+    //         without table= the module must be the whole program (define
+    //         main, e.g. after llvm-link); modules linked together must all
+    //         be given the same table=.
+    // ring:   append the libc ID to a per-thread event ring that is handed to
+    //         the monitor in batches (see EventRing.h), at the latest right
+    //         before a call that enters the kernel.
+    enum class instrumentMode {trap, inlineTable, ring};
+
+    // What mode=inline builds from the module automaton without table=:
+    // dfa:    the minimized DFA's table.
+    // bitnfa: the bit-parallel form of the ε-free NFA, which needs no
+    //         determinization (see AutomatonFormat.h).
+    // auto:   whichever of the two is cheaper for the module.
+    enum class inlineEngine {automatic, dfa, bitParallel};
+
+    struct instrumentOptions {
+        instrumentMode mode = instrumentMode::trap;
+        inlineEngine engine = inlineEngine::automatic;
+        std::string tablePath;
+    };
+
+    static bool parseOptions(const passParameters &params, instrumentOptions &options) {
+        for(auto const& param : params) {
+            if(param.first == "mode" && param.second == "trap") {
+                options.mode = instrumentMode::trap;
+            } else if(param.first == "mode" && param.second == "inline") {
+                options.mode = instrumentMode::inlineTable;
+            } else if(param.first == "mode" && param.second == "ring") {
+                options.mode = instrumentMode::ring;
+            } else if(param.first == "engine" && param.second == "auto") {
+                options.engine = inlineEngine::automatic;
+            } else if(param.first == "engine" && param.second == "dfa") {
+                options.engine = inlineEngine::dfa;
+            } else if(param.first == "engine" && param.second == "bitnfa") {
+                options.engine = inlineEngine::bitParallel;
+            } else if(param.first == "table") {
+                options.tablePath = param.second;
+            } else {
+                llvm::errs() << "instrument-pass: unknown parameter '" << param.first << "'\n";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Dense tables above this many entries are not embedded; lookups then go
+    // through the runtime's CSR search instead of being inlined.
+    static const uint64_t maxDenseEntries = 1u << 24;
+
+    // Bit-parallel NFAs whose follow tables exceed this many bytes even
+    // with 1-bit chunks are not built: the tables grow with the square of
+    // the positions. engine=auto enforces the DFA instead, engine=bitnfa
+    // fails.
+    static const size_t maxFollowBytes = 1u << 20;
+
+    // engine=auto keeps the DFA while its dense table is at most this many
+    // times the size of the bit-parallel image. A DFA step is one inline
+    // load; a bit-parallel step is a runtime call that ORs a follow-table
+    // row per active chunk, so it only wins once the DFA has blown up.
+    static const uint64_t dfaMemoryAllowance = 4;
+
+    // Stands for the event a thread reports first until the mode's rewrite
+    // has turned it into a trap, a table step or a ring append.
+    static const char *const threadStartMarker = "__fsm_thread_start";
+
     class InstrumentPass : public llvm::PassInfoMixin<InstrumentPass> {
     public:
+        explicit InstrumentPass(instrumentOptions options = instrumentOptions()) : options(options) {}
         static bool isRequired() { return true; }
         bool instrumentSyscall(llvm::Module &Mod, llvm::FunctionCallee syscallFn);
+        bool instrumentInline(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr);
+        bool instrumentBitParallel(llvm::Module &Mod, llvm::StringRef image);
+        bool instrumentRing(llvm::Module &Mod);
         llvm::PreservedAnalyses run(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr);
+    private:
+        instrumentOptions options;
+
+        bool wrapThreadEntries(llvm::Module &Mod);
+        void removeThreadMarkers(llvm::Module &Mod);
+        std::vector<std::pair<llvm::CallInst*, int>> collectTargets(llvm::Module &Mod, bool programSyscalls);
+        std::vector<llvm::CallInst*> collectFlushPoints(llvm::Module &Mod);
+        std::unique_ptr<llvm::MemoryBuffer> readTable();
+        std::vector<char> buildImage(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr);
+        llvm::GlobalVariable* embedImage(llvm::Module &Mod, llvm::StringRef image, llvm::StringRef name);
+        const fsm_table_header* embedTable(llvm::Module &Mod, llvm::StringRef image, llvm::StringRef source);
     };
 
     llvm::PreservedAnalyses InstrumentPass::run(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr) {
-        llvm::Type *i64 = llvm::Type::getInt64Ty(Mod.getContext());
-        llvm::FunctionType *sysTy = llvm::FunctionType::get(i64, {i64}, true);
-        llvm::FunctionCallee syscallFn = Mod.getOrInsertFunction("syscall", sysTy);
-        bool modified = instrumentSyscall(Mod, syscallFn);
+        bool modified = wrapThreadEntries(Mod);
+        if(options.mode == instrumentMode::inlineTable) {
+            modified |= instrumentInline(Mod, mngr);
+        } else if(options.mode == instrumentMode::ring) {
+            modified |= instrumentRing(Mod);
+        } else {
+            llvm::Type *i64 = llvm::Type::getInt64Ty(Mod.getContext());
+            llvm::FunctionType *sysTy = llvm::FunctionType::get(i64, {i64}, true);
+            llvm::FunctionCallee syscallFn = Mod.getOrInsertFunction("syscall", sysTy);
+            modified |= instrumentSyscall(Mod, syscallFn);
+        }
+        removeThreadMarkers(Mod);
         return modified ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all();
     }
 
-    bool InstrumentPass::instrumentSyscall(llvm::Module &Mod, llvm::FunctionCallee syscallFn) {
+    // Starts the threads of the module in trampolines that report the
+    // thread event of their start routine (threadEntryFunctions) through a
+    // call to the marker before they run it. Every mode keeps its monitor
+    // state per thread, so a new thread begins in the start state, and the
+    // event moves it into the automaton of its routine.
+    bool InstrumentPass::wrapThreadEntries(llvm::Module &Mod) {
+        // Routines a thread is already started in through a trampoline keep it.
+        std::set<llvm::Function*> direct;
+        forEachThreadRoutine(Mod, [&](llvm::Use&, llvm::Function &routine) {
+            if(!isThreadTrampoline(routine)) direct.insert(&routine);
+        });
+        std::vector<llvm::Function*> entries = threadEntryFunctions(Mod);
+        if(std::none_of(entries.begin(), entries.end(), [&](llvm::Function *entry) {return direct.count(entry);})) {
+            return false;
+        }
+
+        llvm::LLVMContext &ctx = Mod.getContext();
+        llvm::Type *i32 = llvm::Type::getInt32Ty(ctx);
+        llvm::FunctionCallee markerFn = Mod.getOrInsertFunction(threadStartMarker,
+            llvm::FunctionType::get(llvm::Type::getVoidTy(ctx), {i32}, false));
+        std::map<llvm::Function*, llvm::Function*> trampolineOf;
+        for(uint32_t k = 0; k < entries.size(); k++) {
+            llvm::Function *entry = entries[k];
+            if(!direct.count(entry)) continue;
+            auto *trampoline = llvm::Function::Create(entry->getFunctionType(), llvm::GlobalValue::InternalLinkage,
+                                                      "__fsm_thread." + entry->getName(), Mod);
+            trampoline->addFnAttr(threadTrampolineAttr);
+            llvm::IRBuilder<> B(llvm::BasicBlock::Create(ctx, "entry", trampoline));
+            B.CreateCall(markerFn, {llvm::ConstantInt::get(i32, FSM_THREAD_EVENT_BASE + k)});
+            std::vector<llvm::Value*> args;
+            for(llvm::Argument &arg : trampoline->args()) args.push_back(&arg);
+            // Kept a call so the CFG passes can still find the routine.
+            llvm::CallInst *call = B.CreateCall(entry, args);
+            call->setIsNoInline();
+            if(call->getType()->isVoidTy()) {
+                B.CreateRetVoid();
+            } else {
+                B.CreateRet(call);
+            }
+            trampolineOf[entry] = trampoline;
+        }
+        NumThreadTrampolines += trampolineOf.size();
+
+        forEachThreadRoutine(Mod, [&](llvm::Use &use, llvm::Function &routine) {
+            auto found = trampolineOf.find(&routine);
+            if(found != trampolineOf.end()) {
+                use.set(llvm::ConstantExpr::getPointerCast(found->second, use->getType()));
+            }
+        });
+        return true;
+    }
+
+    // The rewrite has put each mode's event in front of the markers.
+    void InstrumentPass::removeThreadMarkers(llvm::Module &Mod) {
+        llvm::Function *marker = Mod.getFunction(threadStartMarker);
+        if(!marker) return;
+        while(!marker->use_empty()) {
+            llvm::cast<llvm::Instruction>(marker->user_back())->eraseFromParent();
+        }
+        marker->eraseFromParent();
+    }
+
+    // The calls that report an event and the event each one reports: libc
+    // calls and thread starts, and with `programSyscalls` the syscalls the
+    // program makes itself, which a kernel-side monitor would see anyway
+    // but a user-space one only through the instrumentation.
+    std::vector<std::pair<llvm::CallInst*, int>> InstrumentPass::collectTargets(llvm::Module &Mod, bool programSyscalls) {
+        fsm::stageTimer timer("InstrumentCollectTargets", Mod.getSourceFileName());
         std::vector<std::pair<llvm::CallInst*, int>> targets;
-        bool modified = false;
 
         for (llvm::Function &F : Mod) {
             if (F.isDeclaration() || F.isIntrinsic()) continue;
@@ -37,13 +231,212 @@ namespace instrument {
                     if (auto *CI = llvm::dyn_cast<llvm::CallInst>(&I)) {
                         if (CI->getMetadata("instrumented")) continue;
                         if (llvm::Function *CF = CI->getCalledFunction()) {
-                            int id = libcMap(CF->getName().str());
+                            if (CF->getName() == threadStartMarker) {
+                                auto *event = llvm::cast<llvm::ConstantInt>(CI->getArgOperand(0));
+                                targets.push_back({CI, static_cast<int>(event->getZExtValue())});
+                                continue;
+                            }
+                            int id = libcMap(CF->getName());
                             if (id >= 0) targets.push_back({CI, id});
                         }
+                        // After the libc ID of syscall() itself, as libcIdLabels has them.
+                        uint32_t event;
+                        if (programSyscalls && cfgengine::programSyscallEvent(*CI, event)) {
+                            targets.push_back({CI, static_cast<int>(event)});
+                        }
                     }
                 }
             }
         }
+        return targets;
+    }
+
+    // Libc functions that enter the kernel on the caller's behalf: the
+    // syscall wrappers for processes, files, sockets and memory mappings,
+    // and the stdio calls that open, read, write or flush a stream. Calls
+    // that reach the kernel only now and then on their own account, such
+    // as malloc() growing the heap, are left out.
+    static const char *const kernelEntryCalls[] = {
+        // Processes and signals.
+        "execl", "execle", "execlp", "execv", "execve", "execvp", "execvpe", "execveat", "fexecve",
+        "fork", "vfork", "clone", "system", "popen", "pclose", "posix_spawn", "posix_spawnp",
+        "daemon", "kill", "killpg", "raise", "wait", "waitpid", "waitid", "wait3", "wait4",
+        "ptrace", "prctl", "setuid", "setgid", "seteuid", "setegid", "setreuid", "setregid",
+        "setresuid", "setresgid", "setsid", "setpgid", "chroot", "chdir", "fchdir", "unshare",
+        "setns", "sigaction", "signal", "sigprocmask", "pause", "sleep", "usleep", "nanosleep",
+        "alarm", "setrlimit", "prlimit", "getpid", "getppid", "gettid", "reboot",
+        // Files and descriptors.
+        "open", "open64", "__open_2", "__open64_2", "openat", "openat64", "creat", "creat64",
+        "close", "read", "__read_chk", "write", "pread", "pread64", "pwrite", "pwrite64",
+        "readv", "writev", "preadv", "pwritev", "lseek", "lseek64", "dup", "dup2", "dup3",
+        "pipe", "pipe2", "fcntl", "fcntl64", "ioctl", "fsync", "fdatasync", "sync", "truncate",
+        "ftruncate", "ftruncate64", "stat", "stat64", "fstat", "fstat64", "lstat", "lstat64",
+        "fstatat", "fstatat64", "__xstat", "__fxstat", "__lxstat", "statx", "access", "faccessat",
+        "unlink", "unlinkat", "rename", "renameat", "link", "linkat", "symlink", "symlinkat",
+        "readlink", "readlinkat", "mkdir", "mkdirat", "rmdir", "mknod", "mkfifo", "chmod",
+        "fchmod", "fchmodat", "chown", "fchown", "lchown", "fchownat", "utime", "utimes",
+        "utimensat", "futimens", "opendir", "fdopendir", "readdir", "readdir64", "closedir",
+        "mount", "umount", "umount2", "sendfile", "sendfile64", "splice", "tee",
+        "copy_file_range", "memfd_create", "inotify_init", "inotify_add_watch", "eventfd",
+        "signalfd", "timerfd_create", "epoll_create", "epoll_create1", "epoll_ctl", "epoll_wait",
+        "poll", "ppoll", "select", "pselect",
+        // Sockets.
+        "socket", "socketpair", "bind", "listen", "accept", "accept4", "connect", "shutdown",
+        "send", "sendto", "sendmsg", "sendmmsg", "recv", "recvfrom", "recvmsg", "recvmmsg",
+        "getsockopt", "setsockopt", "getsockname", "getpeername",
+        // Memory mappings.
+        "mmap", "mmap64", "munmap", "mprotect", "mremap", "madvise", "mlock", "munlock",
+        "shm_open", "shmget", "shmat", "shmdt", "msgget", "msgsnd", "msgrcv", "semget", "semop",
+        // Streams.
+        "fopen", "fopen64", "freopen", "freopen64", "fdopen", "fclose", "fflush", "fread",
+        "fwrite", "fgets", "fgetc", "getc", "getchar", "getline", "getdelim", "fputs", "puts",
+        "fputc", "putc", "putchar", "printf", "fprintf", "dprintf", "vprintf", "vfprintf",
+        "vdprintf", "__printf_chk", "__fprintf_chk", "__vprintf_chk", "__vfprintf_chk",
+        "scanf", "fscanf", "vscanf", "vfscanf", "__isoc99_scanf", "__isoc99_fscanf",
+        "perror", "tmpfile", "tmpfile64", "mkstemp", "mkstemp64", "mkostemp",
+    };
+
+    static bool entersKernel(llvm::StringRef name) {
+        static const std::set<llvm::StringRef> names(std::begin(kernelEntryCalls), std::end(kernelEntryCalls));
+        return names.count(name) != 0;
+    }
+
+    // Calls before which pending ring events must reach the monitor, which
+    // a kernel consumer would read on the next syscall: explicit syscall()
+    // calls, inline-asm syscalls, libc calls that enter the kernel, and
+    // calls that never return.
+    std::vector<llvm::CallInst*> InstrumentPass::collectFlushPoints(llvm::Module &Mod) {
+        std::vector<llvm::CallInst*> points;
+
+        for (llvm::Function &F : Mod) {
+            if (F.isDeclaration() || F.isIntrinsic()) continue;
+            for (llvm::BasicBlock &BB : F) {
+                for (llvm::Instruction &I : BB) {
+                    auto *CI = llvm::dyn_cast<llvm::CallInst>(&I);
+                    if (!CI || CI->getMetadata("instrumented")) continue;
+                    if (auto *asmCall = llvm::dyn_cast<llvm::InlineAsm>(CI->getCalledOperand())) {
+                        if (asmCall->getAsmString().find("syscall") != std::string::npos) points.push_back(CI);
+                    } else if (llvm::Function *CF = CI->getCalledFunction()) {
+                        if (CF->getName() == "syscall" || entersKernel(CF->getName()) || CI->doesNotReturn()) {
+                            points.push_back(CI);
+                        }
+                    } else if (CI->doesNotReturn()) {
+                        points.push_back(CI);
+                    }
+                }
+            }
+        }
+        return points;
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> InstrumentPass::readTable() {
+        auto file = llvm::MemoryBuffer::getFile(options.tablePath);
+        if(!file) {
+            llvm::report_fatal_error(llvm::Twine("instrument-pass: cannot read ") + options.tablePath);
+        }
+        llvm::StringRef image = (*file)->getBuffer();
+        const fsm_table_header *table = fsm_table_open_nfa(image.data(), image.size());
+        if(table && (table->flags & FSM_TABLE_NONDETERMINISTIC)) {
+            llvm::report_fatal_error(llvm::Twine("instrument-pass: ") + options.tablePath +
+                                     " holds a nondeterministic automaton (written with lazy); "
+                                     "enforcing needs the DFA table", false);
+        }
+        return std::move(*file);
+    }
+
+    // The image mode=inline embeds when there is no table=: the minimized
+    // DFA's table or the bit-parallel NFA, as options.engine asks. For
+    // engine=auto the DFA is only determinized up to the size at which the
+    // bit-parallel form would win, so a module whose DFA blows up costs no
+    // more than that.
+    std::vector<char> InstrumentPass::buildImage(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr) {
+        // The same automaton syscall-cfg-pass<minimize;table> writes for the
+        // trap-instrumented module, without the round trip through a file.
+        using cfgengine::libcIdLabels;
+        fsm::stageTimer timer("InstrumentBuildTable", Mod.getSourceFileName());
+        auto &automata = mngr.getResult<cfgengine::AutomatonAnalysis<libcIdLabels>>(Mod);
+        const cfgengine::builtAutomaton &automaton = automata.get<libcIdLabels>();
+        const fsm::Automaton &nfa = automaton.nfa;
+        // Within the budget the CFG passes use by default.
+        auto dfaImage = [&] {
+            size_t maxStates = cfgengine::engineOptions().maxStates;
+            fsm::approximation approximated;
+            fsm::Automaton dfa = fsm::determinizeWithin(nfa, 0, maxStates, &approximated);
+            cfgengine::reportApproximation(approximated, Mod, "instrument-pass", "", nfa.numStates(), maxStates);
+            return fsm::tableImage(fsm::minimizeDFA(dfa), automaton.alphabet, libcIdLabels::libcIdOf);
+        };
+        if(options.engine == inlineEngine::dfa) {
+            return dfaImage();
+        }
+        uint32_t positions = fsm::countPositions(nfa);
+        std::vector<char> bitImage = fsm::bitParallelImage(nfa, automaton.alphabet, libcIdLabels::libcIdOf,
+                                                           maxFollowBytes);
+        if(bitImage.empty()) {
+            if(options.engine == inlineEngine::bitParallel) {
+                llvm::report_fatal_error(llvm::Twine("instrument-pass: ") + Mod.getSourceFileName() + ": " +
+                                         llvm::Twine(positions) + " NFA positions, follow tables over the " +
+                                         llvm::Twine(maxFollowBytes) +
+                                         " bytes engine=bitnfa allows; use engine=dfa or engine=auto", false);
+            }
+            llvm::errs() << "instrument-pass: " << Mod.getSourceFileName() << ": " << positions
+                         << " NFA positions, enforcing the DFA\n";
+            return dfaImage();
+        }
+        if(options.engine == inlineEngine::bitParallel) {
+            return bitImage;
+        }
+
+        uint64_t symbols = std::max(fsm_bitnfa_open(bitImage.data(), bitImage.size())->num_symbols, 1u);
+        uint64_t maxEntries = std::min(maxDenseEntries, dfaMemoryAllowance * bitImage.size() / sizeof(uint32_t));
+        uint64_t maxStates = std::max<uint64_t>(maxEntries / symbols, 1);
+        fsm::Automaton dfa = fsm::mergeEquivalentStates(nfa, 0, maxStates);
+        if(dfa.start != fsm::Automaton::noState) {
+            dfa = fsm::minimizeDFA(dfa);
+        }
+        llvm::errs() << "instrument-pass: " << Mod.getSourceFileName() << ": ";
+        if(dfa.start == fsm::Automaton::noState) {
+            llvm::errs() << "DFA over " << maxStates << " states";
+        } else {
+            llvm::errs() << "DFA " << dfa.numStates() << " states x " << symbols << " symbols";
+        }
+        llvm::errs() << ", bit-parallel NFA " << positions << " positions, " << bitImage.size() << " bytes: enforcing the ";
+        if(dfa.start == fsm::Automaton::noState) {
+            llvm::errs() << "bit-parallel NFA\n";
+            return bitImage;
+        }
+        llvm::errs() << "DFA\n";
+        return fsm::tableImage(dfa, automaton.alphabet, libcIdLabels::libcIdOf);
+    }
+
+    // Embeds `image` as @`name`. Only the runtime refers to it, and in a
+    // default<On> pipeline GlobalDCE runs after the optimizer-last extension
+    // point, so it is kept alive explicitly.
+    llvm::GlobalVariable* InstrumentPass::embedImage(llvm::Module &Mod, llvm::StringRef image, llvm::StringRef name) {
+        auto *imageInit = llvm::ConstantDataArray::get(Mod.getContext(),
+            llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(image.data()), image.size()));
+        auto *imageVar = new llvm::GlobalVariable(Mod, imageInit->getType(), true,
+            llvm::GlobalValue::LinkOnceODRLinkage, imageInit, name);
+        imageVar->setAlignment(llvm::Align(8));
+        llvm::appendToCompilerUsed(Mod, {imageVar});
+        return imageVar;
+    }
+
+    // Embeds the table image as @__fsm_table_image and returns its header,
+    // which points into `image`.
+    const fsm_table_header* InstrumentPass::embedTable(llvm::Module &Mod, llvm::StringRef image, llvm::StringRef source) {
+        const fsm_table_header *table = fsm_table_open(image.data(), image.size());
+        if(!table) {
+            llvm::report_fatal_error(llvm::Twine("instrument-pass: ") + source + " is not a transition table");
+        }
+        embedImage(Mod, image, "__fsm_table_image");
+        ++NumTablesEmbedded;
+        return table;
+    }
+
+    bool InstrumentPass::instrumentSyscall(llvm::Module &Mod, llvm::FunctionCallee syscallFn) {
+        std::vector<std::pair<llvm::CallInst*, int>> targets = collectTargets(Mod, false);
+        fsm::stageTimer timer("InstrumentRewrite", "trap");
+        bool modified = false;
 
         for (auto &[CI, id] : targets) {
             llvm::IRBuilder<> B(CI);
@@ -54,9 +447,234 @@ namespace instrument {
             call->setMetadata("instrumented", N);
             modified = true;
         }
+        NumTrapsInserted += targets.size();
 
         return modified;
     }
+
+    bool InstrumentPass::instrumentInline(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr) {
+        // The raw table is always embedded so the runtime can decode names
+        // and step through large tables itself.
+        std::unique_ptr<llvm::MemoryBuffer> buffer;
+        std::vector<char> built;
+        llvm::StringRef image;
+        llvm::StringRef source;
+        if(!options.tablePath.empty()) {
+            buffer = readTable();
+            image = buffer->getBuffer();
+            source = options.tablePath;
+        } else {
+            // Another translation unit would embed a table of its own under
+            // the same names, and the linker would keep only one of them.
+            if(!isWholeProgram(Mod)) {
+                llvm::report_fatal_error(llvm::Twine("instrument-pass: ") + Mod.getSourceFileName() +
+                                         ": mode=inline without table= needs the whole program, and the module "
+                                         "defines no main; link the modules first or pass table=", false);
+            }
+            built = buildImage(Mod, mngr);
+            image = llvm::StringRef(built.data(), built.size());
+            source = "the module automaton";
+        }
+        if(fsm_bitnfa_open(image.data(), image.size())) {
+            return instrumentBitParallel(Mod, image);
+        }
+        const fsm_table_header *table = embedTable(Mod, image, source);
+
+        llvm::LLVMContext &ctx = Mod.getContext();
+        llvm::Type *i32 = llvm::Type::getInt32Ty(ctx);
+        llvm::Type *i64 = llvm::Type::getInt64Ty(ctx);
+        llvm::Type *voidTy = llvm::Type::getVoidTy(ctx);
+
+        auto *stateVar = new llvm::GlobalVariable(Mod, i32, false, llvm::GlobalValue::LinkOnceODRLinkage,
+            llvm::ConstantInt::get(i32, table->start_state), "__fsm_state", nullptr,
+            llvm::GlobalValue::InitialExecTLSModel);
+        llvm::appendToCompilerUsed(Mod, {stateVar});
+
+        llvm::FunctionCallee violationFn = Mod.getOrInsertFunction("__fsm_violation",
+            llvm::FunctionType::get(voidTy, {i32, i32}, false));
+        if(auto *violation = llvm::dyn_cast<llvm::Function>(violationFn.getCallee())) {
+            violation->setDoesNotReturn();
+            violation->addFnAttr(llvm::Attribute::Cold);
+        }
+        llvm::FunctionCallee stepFn = Mod.getOrInsertFunction("__fsm_enforce",
+            llvm::FunctionType::get(voidTy, {i32}, false));
+
+        uint64_t numSymbols = table->num_symbols;
+        bool dense = uint64_t(table->num_states) * numSymbols <= maxDenseEntries;
+        llvm::GlobalVariable *denseVar = nullptr;
+        if(dense) {
+            std::vector<uint32_t> entries(uint64_t(table->num_states) * numSymbols, FSM_NO_STATE);
+            const uint32_t *offsets = FSM_TABLE_SECTION(table, edge_offsets_offset, uint32_t);
+            const uint32_t *labels = FSM_TABLE_SECTION(table, edge_labels_offset, uint32_t);
+            const uint32_t *targets = FSM_TABLE_SECTION(table, edge_targets_offset, uint32_t);
+            for(uint32_t state = 0; state < table->num_states; state++) {
+                for(uint32_t edge = offsets[state]; edge < offsets[state + 1]; edge++) {
+                    entries[state * numSymbols + labels[edge]] = targets[edge];
+                }
+            }
+            auto *denseInit = llvm::ConstantDataArray::get(ctx, entries);
+            denseVar = new llvm::GlobalVariable(Mod, denseInit->getType(), true,
+                llvm::GlobalValue::LinkOnceODRLinkage, denseInit, "__fsm_dense_table");
+        }
+
+        std::vector<std::pair<llvm::CallInst*, int>> targets = collectTargets(Mod, true);
+        fsm::stageTimer timer("InstrumentRewrite", "inline");
+        llvm::MDNode *unlikely = llvm::MDBuilder(ctx).createBranchWeights(1, 1u << 20);
+        llvm::MDNode *mark = llvm::MDNode::get(ctx, llvm::MDString::get(ctx, "instrumented"));
+
+        for(auto &[CI, id] : targets) {
+            uint32_t symbol = fsm_table_symbol_for_libc(table, static_cast<uint32_t>(id));
+            llvm::IRBuilder<> B(CI);
+            llvm::Value *libcId = llvm::ConstantInt::get(i32, id);
+
+            if(!dense) {
+                auto *call = B.CreateCall(stepFn, {libcId});
+                call->setMetadata("instrumented", mark);
+                ++NumOutOfLineChecks;
+                continue;
+            }
+            llvm::Value *state = B.CreateLoad(i32, stateVar, "fsm.state");
+            if(symbol == FSM_NO_SYMBOL) {
+                // The automaton never allows this call.
+                auto *call = B.CreateCall(violationFn, {state, libcId});
+                call->setMetadata("instrumented", mark);
+                ++NumForbiddenCalls;
+                continue;
+            }
+            llvm::Value *index = B.CreateAdd(B.CreateMul(B.CreateZExt(state, i64), llvm::ConstantInt::get(i64, numSymbols)),
+                                             llvm::ConstantInt::get(i64, symbol));
+            llvm::Value *slot = B.CreateInBoundsGEP(denseVar->getValueType(), denseVar,
+                                                    {llvm::ConstantInt::get(i64, 0), index});
+            llvm::Value *next = B.CreateLoad(i32, slot, "fsm.next");
+            llvm::Value *illegal = B.CreateICmpEQ(next, llvm::ConstantInt::get(i32, FSM_NO_STATE));
+            llvm::Instruction *fail = llvm::SplitBlockAndInsertIfThen(illegal, CI, true, unlikely);
+            llvm::IRBuilder<> failB(fail);
+            auto *call = failB.CreateCall(violationFn, {state, libcId});
+            call->setMetadata("instrumented", mark);
+            B.SetInsertPoint(CI);
+            B.CreateStore(next, stateVar);
+            ++NumInlineChecks;
+        }
+
+        return true;
+    }
+
+    // Every libc call steps the bit-parallel NFA in the runtime
+    // (__fsm_enforce_bitnfa), which keeps each thread's active positions in
+    // @__fsm_bitnfa_active together with the scratch words a step writes.
+    bool InstrumentPass::instrumentBitParallel(llvm::Module &Mod, llvm::StringRef image) {
+        const fsm_bitnfa_header *nfa = fsm_bitnfa_open(image.data(), image.size());
+        embedImage(Mod, image, "__fsm_bitnfa_image");
+        ++NumBitParallelImages;
+
+        llvm::LLVMContext &ctx = Mod.getContext();
+        llvm::Type *i32 = llvm::Type::getInt32Ty(ctx);
+        llvm::Type *voidTy = llvm::Type::getVoidTy(ctx);
+
+        const uint64_t *initial = FSM_TABLE_SECTION(nfa, initial_offset, uint64_t);
+        std::vector<uint64_t> words(initial, initial + nfa->num_words);
+        words.resize(2 * size_t(nfa->num_words), 0);
+        auto *activeInit = llvm::ConstantDataArray::get(ctx, words);
+        auto *activeVar = new llvm::GlobalVariable(Mod, activeInit->getType(), false, llvm::GlobalValue::LinkOnceODRLinkage,
+            activeInit, "__fsm_bitnfa_active", nullptr, llvm::GlobalValue::InitialExecTLSModel);
+        activeVar->setAlignment(llvm::Align(64));
+        llvm::appendToCompilerUsed(Mod, {activeVar});
+
+        llvm::FunctionCallee stepFn = Mod.getOrInsertFunction("__fsm_enforce_bitnfa",
+            llvm::FunctionType::get(voidTy, {i32}, false));
+
+        std::vector<std::pair<llvm::CallInst*, int>> targets = collectTargets(Mod, true);
+        fsm::stageTimer timer("InstrumentRewrite", "bitnfa");
+        llvm::MDNode *mark = llvm::MDNode::get(ctx, llvm::MDString::get(ctx, "instrumented"));
+        for(auto &[CI, id] : targets) {
+            llvm::IRBuilder<> B(CI);
+            auto *call = B.CreateCall(stepFn, {llvm::ConstantInt::get(i32, id)});
+            call->setMetadata("instrumented", mark);
+            if(fsm_bitnfa_symbol_for_libc(nfa, static_cast<uint32_t>(id)) == FSM_NO_SYMBOL) {
+                ++NumForbiddenCalls;
+            }
+        }
+        NumBitParallelChecks += targets.size();
+        return true;
+    }
+
+    bool InstrumentPass::instrumentRing(llvm::Module &Mod) {
+        // With table=, the stand-in consumer checks against the embedded
+        // table; otherwise it looks for one at run time.
+        std::unique_ptr<llvm::MemoryBuffer> buffer;
+        if(!options.tablePath.empty()) {
+            buffer = readTable();
+            embedTable(Mod, buffer->getBuffer(), options.tablePath);
+        }
+
+        llvm::LLVMContext &ctx = Mod.getContext();
+        llvm::Type *i32 = llvm::Type::getInt32Ty(ctx);
+        llvm::Type *i64 = llvm::Type::getInt64Ty(ctx);
+        llvm::Type *voidTy = llvm::Type::getVoidTy(ctx);
+
+        // struct fsm_event_ring, defined by the runtime.
+        auto *eventsTy = llvm::ArrayType::get(i32, FSM_RING_CAPACITY);
+        auto *ringTy = llvm::StructType::get(ctx, {i32, eventsTy});
+        auto *ringVar = llvm::dyn_cast<llvm::GlobalVariable>(Mod.getOrInsertGlobal("__fsm_ring", ringTy, [&]() {
+            return new llvm::GlobalVariable(Mod, ringTy, false, llvm::GlobalValue::ExternalLinkage, nullptr,
+                                            "__fsm_ring", nullptr, llvm::GlobalValue::InitialExecTLSModel);
+        }));
+        if(!ringVar) {
+            llvm::report_fatal_error("instrument-pass: __fsm_ring has an unexpected type");
+        }
+
+        llvm::FunctionCallee flushFn = Mod.getOrInsertFunction("__fsm_ring_flush",
+            llvm::FunctionType::get(voidTy, false));
+
+        std::vector<std::pair<llvm::CallInst*, int>> targets = collectTargets(Mod, true);
+        std::vector<llvm::CallInst*> flushPoints = collectFlushPoints(Mod);
+        fsm::stageTimer timer("InstrumentRewrite", "ring");
+        llvm::MDNode *unlikely = llvm::MDBuilder(ctx).createBranchWeights(1, FSM_RING_CAPACITY - 1);
+        llvm::MDNode *mark = llvm::MDNode::get(ctx, llvm::MDString::get(ctx, "instrumented"));
+        llvm::Value *zero = llvm::ConstantInt::get(i32, 0);
+
+        for(auto &[CI, id] : targets) {
+            llvm::IRBuilder<> B(CI);
+            llvm::Value *countPtr = B.CreateInBoundsGEP(ringTy, ringVar, {zero, zero});
+            llvm::Value *count = B.CreateLoad(i32, countPtr, "fsm.count");
+            llvm::Value *slot = B.CreateInBoundsGEP(ringTy, ringVar,
+                {zero, llvm::ConstantInt::get(i32, 1), B.CreateZExt(count, i64)});
+            B.CreateStore(llvm::ConstantInt::get(i32, id), slot);
+            llvm::Value *next = B.CreateAdd(count, llvm::ConstantInt::get(i32, 1));
+            B.CreateStore(next, countPtr);
+            llvm::Value *full = B.CreateICmpEQ(next, llvm::ConstantInt::get(i32, FSM_RING_CAPACITY));
+            llvm::Instruction *flush = llvm::SplitBlockAndInsertIfThen(full, CI, false, unlikely);
+            llvm::IRBuilder<> flushB(flush);
+            auto *call = flushB.CreateCall(flushFn);
+            call->setMetadata("instrumented", mark);
+        }
+
+        // Runs after the events above, so a libc call such as write() or
+        // exit() is recorded before the ring goes out.
+        for(llvm::CallInst *CI : flushPoints) {
+            llvm::IRBuilder<> B(CI);
+            auto *call = B.CreateCall(flushFn);
+            call->setMetadata("instrumented", mark);
+        }
+
+        // A thread that returns from its start routine hands over what is
+        // left in its ring on the way out of the trampoline. Short threads
+        // may never have filled the ring or reached a flush point.
+        for(llvm::Function &F : Mod) {
+            if(F.isDeclaration() || !isThreadTrampoline(F)) continue;
+            for(llvm::BasicBlock &BB : F) {
+                if(!llvm::isa<llvm::ReturnInst>(BB.getTerminator())) continue;
+                llvm::IRBuilder<> B(BB.getTerminator());
+                auto *call = B.CreateCall(flushFn);
+                call->setMetadata("instrumented", mark);
+                flushPoints.push_back(call);
+            }
+        }
+        NumRingEvents += targets.size();
+        NumRingFlushPoints += flushPoints.size();
+
+        return !targets.empty() || !flushPoints.empty();
+    }
 }
 
 extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
@@ -64,11 +682,39 @@ llvmGetPassPluginInfo() {
     return {
         LLVM_PLUGIN_API_VERSION, "InstrumentPass", "v0.4",
         [](llvm::PassBuilder &PB) {
+            PB.registerAnalysisRegistrationCallback([](llvm::ModuleAnalysisManager &MAM) {
+                // mode=inline picks and determinizes the form it enforces itself.
+                MAM.registerPass([] {return cfgengine::AutomatonAnalysis<cfgengine::libcIdLabels>(false);});
+            });
+            // From clang -fpass-plugin= or a default<On> pipeline: after the
+            // optimizer, so only the libc calls that survive it are checked.
+            // Loading the plugin is not enough: like the CFG plugins it only
+            // runs when $FSM_INSTRUMENT is set, and takes its parameters from
+            // it. FSM_INSTRUMENT=mode=trap inserts the traps,
+            // FSM_INSTRUMENT=mode=inline builds and enforces the automaton in
+            // the same compile. That compile has to see the whole program,
+            // i.e. a single source file with main; others link their bitcode
+            // first or pass table=.
+            PB.registerOptimizerLastEPCallback(
+                [](llvm::ModulePassManager &MPM, llvm::OptimizationLevel) {
+                    if(!std::getenv("FSM_INSTRUMENT")) return;
+                    passParameters params;
+                    instrument::instrumentOptions options;
+                    if(!parseEnvironmentParameters("FSM_INSTRUMENT", "instrument-pass", params) ||
+                       !instrument::parseOptions(params, options)) {
+                        llvm::report_fatal_error("instrument-pass: invalid $FSM_INSTRUMENT");
+                    }
+                    MPM.addPass(instrument::InstrumentPass(options));
+                }
+            );
             PB.registerPipelineParsingCallback(
                 [](llvm::StringRef Name, llvm::ModulePassManager &MPM,
                    llvm::ArrayRef<llvm::PassBuilder::PipelineElement>) {
-                    if(Name == "instrument-pass") {
-                        MPM.addPass(instrument::InstrumentPass());
+                    passParameters params;
+                    if(parsePassName(Name, "instrument-pass", params)) {
+                        instrument::instrumentOptions options;
+                        if(!instrument::parseOptions(params, options)) return false;
+                        MPM.addPass(instrument::InstrumentPass(options));
                         return true;
                     }
                     return false;
@@ -0,0 +1,39 @@
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <utility>
+
+using passParameters = std::vector<std::pair<std::string, std::string>>;
+
+// Matches a pipeline element against `passName` or `passName<key;key=value;...>`
+// and splits the parameter list into key/value pairs. A bare key maps to an
+// empty value.
+static bool parsePassName(llvm::StringRef name, llvm::StringRef passName, passParameters &params) {
+    if(!name.consume_front(passName)) return false;
+    params.clear();
+    if(name.empty()) return true;
+    if(!name.consume_front("<") || !name.consume_back(">")) return false;
+
+    llvm::SmallVector<llvm::StringRef, 4> parts;
+    name.split(parts, ';', -1, false);
+    for(llvm::StringRef part : parts) {
+        std::pair<llvm::StringRef, llvm::StringRef> keyValue = part.split('=');
+        params.push_back({keyValue.first.trim().str(), keyValue.second.trim().str()});
+    }
+    return true;
+}
+
+// Parameters of a pass a plugin adds to the default pipeline (clang
+// -fpass-plugin=, opt -passes='default<O2>'), where no pipeline text reaches
+// it: read from the environment variable `variable`, same key;key=value syntax.
+static bool parseEnvironmentParameters(const char *variable, llvm::StringRef passName, passParameters &params) {
+    const char *value = std::getenv(variable);
+    std::string element = passName.str();
+    if(value && *value) {
+        element += "<" + std::string(value) + ">";
+    }
+    return parsePassName(element, passName, params);
+}
@@ -0,0 +1,147 @@
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../include/FSM.h"
+#include "../include/AutomatonFormat.h"
+
+// Bump when the graph construction changes in a way the keys do not see.
+static const unsigned summaryCacheVersion = 3;
+
+// Content-addressed directory of per-function summary automata, stored as
+// <key>.fsmt tables. A key covers everything graph construction reads from
+// the function's SCC (blocks, calls, returns, callee names and whether they
+// are libc functions) plus the keys of the summaries the SCC embeds, so an
+// edit to a function invalidates it and every caller above it and nothing
+// else. The state budget is part of the key as well; summaries it forced
+// into an over-approximation are not stored at all.
+class summaryCache {
+    public:
+        summaryCache(std::string directory, std::string passName, size_t maxStates)
+            : directory(std::move(directory)), passName(std::move(passName)), maxStates(maxStates) {}
+
+        bool enabled() const {return !directory.empty();}
+
+        std::vector<std::string> keysFor(const std::vector<llvm::Function*> &members,
+                                         const std::map<llvm::Function*, std::string> &keys) const;
+        bool load(const std::string &key, fsm::Alphabet &alphabet, fsm::Automaton &summary);
+        void store(const std::string &key, const fsm::Alphabet &alphabet, const fsm::Automaton &summary);
+    private:
+        std::string directory;
+        std::string passName;
+        size_t maxStates;
+
+        void describe(llvm::Function &func, const std::set<llvm::Function*> &scc,
+                      const std::map<llvm::Function*, std::string> &keys, llvm::raw_ostream &out) const;
+        std::string pathOf(const std::string &key) const;
+};
+
+void summaryCache::describe(llvm::Function &func, const std::set<llvm::Function*> &scc,
+                            const std::map<llvm::Function*, std::string> &keys, llvm::raw_ostream &out) const {
+    std::map<llvm::BasicBlock*, unsigned> blockIndex;
+    for(llvm::BasicBlock &bb : func) {
+        blockIndex.insert({&bb, static_cast<unsigned>(blockIndex.size())});
+    }
+
+    out << "function " << func.getName() << "\n";
+    for(llvm::BasicBlock &bb : func) {
+        out << "block " << blockIndex.at(&bb) << "\n";
+        for(llvm::Instruction &inst : bb) {
+            auto *callInst = llvm::dyn_cast<llvm::CallInst>(&inst);
+            if(!callInst) continue;
+            if(auto *inlineAsm = llvm::dyn_cast<llvm::InlineAsm>(callInst->getCalledOperand())) {
+                out << "asm " << inlineAsm->getAsmString();
+            } else if(llvm::Function *calledFunc = callInst->getCalledFunction()) {
+                out << "call " << calledFunc->getName();
+                if(calledFunc->isDeclaration()) {
+                    out << (isLibcFunction(calledFunc->getName()) ? " libc" : " extern");
+                } else if(scc.count(calledFunc)) {
+                    out << " scc";
+                } else {
+                    auto key = keys.find(calledFunc);
+                    out << " summary " << (key != keys.end() ? key->second : "?");
+                }
+            } else {
+                out << "indirect";
+            }
+            for(llvm::Value *arg : callInst->args()) {
+                if(auto *constInt = llvm::dyn_cast<llvm::ConstantInt>(arg)) {
+                    out << " " << constInt->getZExtValue();
+                } else {
+                    out << " _";
+                }
+            }
+            if(callInst->getMetadata("instrumented")) out << " instrumented";
+            out << "\n";
+        }
+        llvm::Instruction *terminator = bb.getTerminator();
+        if(!terminator) continue;
+        if(llvm::isa<llvm::ReturnInst>(terminator)) out << "ret\n";
+        for(unsigned i = 0; i < terminator->getNumSuccessors(); i++) {
+            out << "succ " << blockIndex.at(terminator->getSuccessor(i)) << "\n";
+        }
+    }
+}
+
+// Keys of the members of one SCC, in order. `keys` must hold the keys of
+// every SCC the members call into.
+std::vector<std::string> summaryCache::keysFor(const std::vector<llvm::Function*> &members,
+                                               const std::map<llvm::Function*, std::string> &keys) const {
+    std::string description;
+    llvm::raw_string_ostream out(description);
+    out << passName << " " << summaryCacheVersion << "\n";
+    out << "max-states " << maxStates << "\n";
+    std::set<llvm::Function*> scc(members.begin(), members.end());
+    for(llvm::Function *func : members) {
+        describe(*func, scc, keys, out);
+    }
+    out.flush();
+
+    std::vector<std::string> result;
+    for(llvm::Function *func : members) {
+        llvm::SHA1 hasher;
+        hasher.update(description);
+        hasher.update("member ");
+        hasher.update(func->getName());
+        result.push_back(llvm::toHex(hasher.final(), true));
+    }
+    return result;
+}
+
+std::string summaryCache::pathOf(const std::string &key) const {
+    llvm::SmallString<128> path(directory);
+    llvm::sys::path::append(path, key + ".fsmt");
+    return path.str().str();
+}
+
+bool summaryCache::load(const std::string &key, fsm::Alphabet &alphabet, fsm::Automaton &summary) {
+    return fsm::readTable(pathOf(key), alphabet, summary);
+}
+
+// Writes to a private temporary and renames it into place, so concurrent
+// compilations sharing the directory never see a partial file.
+void summaryCache::store(const std::string &key, const fsm::Alphabet &alphabet, const fsm::Automaton &summary) {
+    if(llvm::sys::fs::create_directories(directory)) {
+        llvm::errs() << passName << ": cannot create cache directory " << directory << "\n";
+        return;
+    }
+    std::string path = pathOf(key);
+    std::string temporary = path + ".tmp" + std::to_string(llvm::sys::Process::getProcessId());
+    auto noLibcId = [](const std::string&) {return FSM_NO_LIBC_ID;};
+    if(!fsm::writeTable(summary, alphabet, noLibcId, temporary) || llvm::sys::fs::rename(temporary, path)) {
+        llvm::sys::fs::remove(temporary);
+        llvm::errs() << passName << ": cannot write " << path << "\n";
+    }
+}
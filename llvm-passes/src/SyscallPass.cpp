@@ -1,204 +1,269 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
-#include "llvm/Support/Path.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Passes/PassBuilder.h"
 
 #include <map>
 #include <string>
-#include <utility>
-#include <fstream>
+#include <vector>
 
 #include "CallNames.cpp"
+#include "DummySyscalls.cpp"
 #include "FSM.cpp"
+#include "AutomatonIO.cpp"
+#include "PassOptions.cpp"
+#include "SummaryCache.cpp"
+#include "EntryPoints.cpp"
+#include "CFGEngine.cpp"
+#include "AutomatonAnalysis.cpp"
+
+#define DEBUG_TYPE "syscall-cfg-pass"
+
+FSM_STATISTIC(NumTrapsElided, "Forced trap sites elided");
+FSM_STATISTIC(NumLoopsHoisted, "Loops whose traps were hoisted");
+FSM_STATISTIC(NumTrapsHoisted, "Trap sites replaced by loop enter/exit events");
 
 namespace icfg {
+    struct syscallCFGOptions {
+        cfgengine::engineOptions engine;
+        bool elide = false;
+        bool hoistLoops = false;
+    };
+
+    static bool parseOptions(const passParameters &params, syscallCFGOptions &options) {
+        for(auto const& param : params) {
+            bool valid = true;
+            if(cfgengine::parseEngineParameter(param, options.engine, "syscall-cfg-pass", valid)) {
+                if(!valid) return false;
+            } else if(param.first == "elide") {
+                options.elide = true;
+            } else if(param.first == "hoist-loops") {
+                options.hoistLoops = true;
+            } else {
+                llvm::errs() << "syscall-cfg-pass: unknown parameter '" << param.first << "'\n";
+                return false;
+            }
+        }
+        if(options.engine.lazy && (options.elide || options.hoistLoops)) {
+            llvm::errs() << "syscall-cfg-pass: lazy cannot be combined with elide or hoist-loops, which need the DFA\n";
+            return false;
+        }
+        return true;
+    }
+
+    using syscallAutomaton = cfgengine::automatonBuilder<cfgengine::syscallLabels>;
+
     class syscallCFGPass : public llvm::PassInfoMixin<syscallCFGPass> {
         public:
+            explicit syscallCFGPass(syscallCFGOptions options = syscallCFGOptions()) : options(options) {}
             static bool isRequired() {return true;}
             llvm::PreservedAnalyses run(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr);
         private:
-            fsm::nfaNode* startNode;
-            uint64_t nodeCounter;
-            std::map<llvm::Function*, fsm::nfaNode*> funcExitNode;
-            std::map<std::pair<llvm::Function*, llvm::BasicBlock*>, fsm::nfaNode*> bbId;
-
-            fsm::nfaNode* createNode();
-            void dumpGraph(llvm::Module &Mod, fsm::nfaNode* startNode);
-            fsm::nfaNode* scanCallInstructions(llvm::BasicBlock &bb, llvm::Function &func);
+            syscallCFGOptions options;
+
+            unsigned elideForcedTraps(syscallAutomaton &syscalls, const fsm::Automaton &nfa, const fsm::Automaton &dfa);
+            unsigned hoistLoopTraps(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr, syscallAutomaton &syscalls,
+                                    const fsm::Automaton &nfa, const fsm::Automaton &dfa);
     };
 
-    fsm::nfaNode* syscallCFGPass::createNode() {
-        fsm::nfaNode* newNode = new fsm::nfaNode(nodeCounter++, false);
-        return newNode;
-    }
+    // A trap is redundant when the monitor has no choice to make there: in
+    // every DFA state it can be in at that point the trap's event is the only
+    // legal one and the run cannot end instead. Removing such traps leaves
+    // the monitor's decisions at all other points unchanged.
+    unsigned syscallCFGPass::elideForcedTraps(syscallAutomaton &syscalls, const fsm::Automaton &nfa, const fsm::Automaton &dfa) {
+        fsm::stageTimer timer("SyscallElideTraps");
+        std::vector<std::vector<fsm::stateId>> statesAt = fsm::trackStates(nfa, dfa);
+        unsigned elided = 0;
 
-    fsm::nfaNode* syscallCFGPass::scanCallInstructions(llvm::BasicBlock &bb, llvm::Function &func) {
-        auto bbKey = std::make_pair(&func, &bb);
-        auto entryKey = std::make_pair(&func, &func.getEntryBlock());
-        if(bbId.find(bbKey) == bbId.end()) {
-            bbId[bbKey] = createNode();
+        for(auto const& site : syscalls.trapSites) {
+            const std::vector<fsm::stateId> &states = statesAt[site.from];
+            bool forced = !states.empty();
+            for(fsm::stateId state : states) {
+                if(dfa.isFinal(state) || dfa.edgeEnd(state) - dfa.edgeBegin(state) != 1 ||
+                   dfa.label(dfa.edgeBegin(state)) != site.label) {
+                    forced = false;
+                    break;
+                }
+            }
+            if(forced) {
+                site.call->eraseFromParent();
+                elided++;
+            }
         }
-        fsm::nfaNode* currentNode = bbId[bbKey];
-        if(bbId.find(entryKey) == bbId.end()) {
-            bbId[entryKey] = createNode();
+        NumTrapsElided += elided;
+        return elided;
+    }
+
+    // A loop's traps are replaced by one enter event in the preheader and one
+    // exit event per exit block when the monitor cannot tell iterations apart:
+    // the DFA states it can be in at the loop header are closed under every
+    // event the loop emits, and each of those events is legal in all of them.
+    // Loops that call defined functions or issue real syscalls are left
+    // alone, as are loops without a preheader or dedicated exits.
+    unsigned syscallCFGPass::hoistLoopTraps(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr, syscallAutomaton &syscalls,
+                                            const fsm::Automaton &nfa, const fsm::Automaton &dfa) {
+        fsm::stageTimer timer("SyscallHoistLoops", Mod.getSourceFileName());
+        std::vector<std::vector<fsm::stateId>> statesAt = fsm::trackStates(nfa, dfa);
+        std::map<llvm::CallInst*, const cfgengine::trapSite*> siteOf;
+        for(auto const& site : syscalls.trapSites) {
+            siteOf[site.call] = &site;
         }
-        fsm::nfaNode* funcEntryNode = bbId[entryKey];
-        for(llvm::Instruction &inst : bb) {
-            if(auto *callInst = llvm::dyn_cast<llvm::CallInst>(&inst)) {
-                if (auto *inlineAsm = llvm::dyn_cast<llvm::InlineAsm>(callInst->getCalledOperand())) {
-                    std::string asmStr = inlineAsm->getAsmString();
-                    if (asmStr.find("syscall") != std::string::npos) {
-                        std::string label = "syscall(470)";
-                        if (callInst->getNumOperands() > 0) {
-                            if (auto *constInt = llvm::dyn_cast<llvm::ConstantInt>(callInst->getArgOperand(0))) {
-                                label += " : " + std::to_string(constInt->getZExtValue());
-                            }
-                        }
-                        fsm::nfaNode *nextNode = createNode();
-                        currentNode->edges.push_back({nextNode, label});
-                        currentNode = nextNode;
+
+        auto &functionAnalyses = mngr.getResult<llvm::FunctionAnalysisManagerModuleProxy>(Mod).getManager();
+        llvm::LLVMContext &ctx = Mod.getContext();
+        llvm::Type *i64 = llvm::Type::getInt64Ty(ctx);
+        llvm::MDNode *mark = llvm::MDNode::get(ctx, llvm::MDString::get(ctx, "instrumented"));
+        uint32_t nextEvent = FSM_LOOP_EVENT_BASE;
+        unsigned hoisted = 0;
+
+        auto tryHoist = [&](llvm::Loop *loop) {
+            llvm::BasicBlock *preheader = loop->getLoopPreheader();
+            if(!preheader || !loop->hasDedicatedExits()) return false;
+
+            std::vector<const cfgengine::trapSite*> sites;
+            for(llvm::BasicBlock *bb : loop->blocks()) {
+                for(llvm::Instruction &inst : *bb) {
+                    auto *callInst = llvm::dyn_cast<llvm::CallInst>(&inst);
+                    if(!callInst) continue;
+                    auto site = siteOf.find(callInst);
+                    if(site != siteOf.end()) {
+                        sites.push_back(site->second);
                         continue;
                     }
-                }
-                if(llvm::Function *calledFunc = callInst->getCalledFunction()) {
-                    std::string funcName = calledFunc->getName().str();
-                    if(funcName == func.getName().str()) {
-                        currentNode->edges.push_back({funcEntryNode, "ε"});
-                    } else if (funcName == "syscall") {
-                        std::string label;
-                        std::string syscallNum = "";
-                        std::string syscallArg = "";
-
-                        if (auto* constInt = llvm::dyn_cast<llvm::ConstantInt>(callInst->getArgOperand(0))) {
-                            syscallNum = std::to_string(constInt->getZExtValue());
-                        }
-
-                        if (callInst->getNumOperands() > 1) {
-                            if (auto* constArg = llvm::dyn_cast<llvm::ConstantInt>(callInst->getArgOperand(1))) {
-                                syscallArg = std::to_string(constArg->getZExtValue());
-                            }
-                        }
-
-                        if (!syscallArg.empty()) {
-                            label += syscallArg;
-                        }
-                        
-                        fsm::nfaNode* nextNode = createNode();
-                        currentNode->edges.push_back({nextNode, label});
-                        currentNode = nextNode;
-                    } else if (calledFunc->isDeclaration()) {
-                        fsm::nfaNode* nextNode = createNode();
-                        if(isLibcFunction(funcName)){
-                            continue;
-                        }
-                        else
-                            currentNode->edges.push_back({nextNode, "ε"});
-                        currentNode = nextNode;
-                    } else {
-                        llvm::BasicBlock &calledFuncEntryBB = calledFunc->getEntryBlock();
-                        if(bbId.find({calledFunc, &calledFuncEntryBB}) == bbId.end()) {
-                            for(llvm::BasicBlock &calleeBB : *calledFunc) {
-                                bbId[{calledFunc, &calleeBB}] = createNode();
-                            }
-                        }
-                        fsm::nfaNode* calledFuncEntryNode = bbId.at({calledFunc, &calledFuncEntryBB});
-                        currentNode->edges.push_back({calledFuncEntryNode, "ε"});
-                        fsm::nfaNode* nextNode = createNode();
-                        funcExitNode.at(calledFunc)->edges.push_back({nextNode, "ε"});
-                        currentNode = nextNode;
-                    }
+                    if(llvm::isa<llvm::InlineAsm>(callInst->getCalledOperand())) return false;
+                    llvm::Function *calledFunc = callInst->getCalledFunction();
+                    if(!calledFunc || calledFunc->getName() == "syscall") return false;
+                    if(!calledFunc->isDeclaration()) return false;
                 }
             }
-        }
-        return currentNode;
-    }
+            if(sites.empty()) return false;
 
-    void syscallCFGPass::dumpGraph(llvm::Module &Mod,fsm::nfaNode* startNode) {
-        std::set<fsm::nfaNode*> visited;
-        std::queue<fsm::nfaNode*> q;
-        q.push(startNode);
-        visited.insert(startNode);
-
-        std::string sourceFile = Mod.getSourceFileName();
-        llvm::StringRef baseNameRef = llvm::sys::path::stem(sourceFile);
-        std::string baseName = baseNameRef.str();
-        std::string filename = baseName + "_cfg.dot";
-        std::ofstream outfile(filename);
-        outfile << "digraph CFG {\n";
-        outfile << "    rankdir=LR;\n";
-        outfile << "    node [shape=circle];\n";
-
-        while(!q.empty()) {
-            fsm::nfaNode* currentNode = q.front();
-            q.pop();
-            for(auto const& edge : currentNode->edges) {
-                outfile << "    " << currentNode->nodeId << " -> " << edge.first->nodeId << " [label=\"" << edge.second << "\"];" << std::endl;
-                fsm::nfaNode* neighbor = edge.first;
-                if(visited.find(neighbor) == visited.end()) {
-                    visited.insert(neighbor);
-                    q.push(neighbor);
+            auto header = syscalls.bbId.find({loop->getHeader()->getParent(), loop->getHeader()});
+            if(header == syscalls.bbId.end()) return false;
+            const std::vector<fsm::stateId> &headerStates = statesAt[header->second];
+            if(headerStates.empty()) return false;
+            for(fsm::stateId state : headerStates) {
+                for(const cfgengine::trapSite *site : sites) {
+                    fsm::stateId next = dfa.next(state, site->label);
+                    if(!std::binary_search(headerStates.begin(), headerStates.end(), next)) return false;
                 }
             }
-        }
-
-        outfile << "}\n";
-        outfile.close();
-    }
 
-    llvm::PreservedAnalyses syscallCFGPass::run(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr) {
-        startNode = createNode();
+            llvm::FunctionCallee syscallFn(sites.front()->call->getFunctionType(),
+                                           sites.front()->call->getCalledOperand());
+            auto emitEvent = [&](llvm::Instruction *before, uint32_t event) {
+                llvm::IRBuilder<> B(before);
+                auto *call = B.CreateCall(syscallFn, {llvm::ConstantInt::get(i64, 470), llvm::ConstantInt::get(i64, event)});
+                call->setMetadata("instrumented", mark);
+            };
+            emitEvent(preheader->getTerminator(), nextEvent);
+            llvm::SmallVector<llvm::BasicBlock*, 4> exits;
+            loop->getUniqueExitBlocks(exits);
+            for(llvm::BasicBlock *exit : exits) {
+                emitEvent(&*exit->getFirstInsertionPt(), nextEvent + 1);
+            }
+            nextEvent += 2;
+            for(const cfgengine::trapSite *site : sites) {
+                site->call->eraseFromParent();
+            }
+            ++NumLoopsHoisted;
+            NumTrapsHoisted += sites.size();
+            return true;
+        };
 
         for(llvm::Function &func : Mod) {
             if(func.isDeclaration()) continue;
-            auto entryKey = std::make_pair(&func, &func.getEntryBlock());
-            bbId[entryKey] = createNode();
-        }
-
-        for(llvm::Function &func : Mod){
-            if (func.isDeclaration()) continue;
-            fsm::nfaNode* exitNode = createNode();
-            funcExitNode[&func] = exitNode;
+            llvm::LoopInfo &loops = functionAnalyses.getResult<llvm::LoopAnalysis>(func);
+            // Outermost loops first; only look inside a loop that stays instrumented.
+            std::vector<llvm::Loop*> worklist(loops.begin(), loops.end());
+            while(!worklist.empty()) {
+                llvm::Loop *loop = worklist.back();
+                worklist.pop_back();
+                if(tryHoist(loop)) {
+                    hoisted++;
+                } else {
+                    worklist.insert(worklist.end(), loop->begin(), loop->end());
+                }
+            }
         }
+        return hoisted;
+    }
 
-        llvm::Function *mainFunc = Mod.getFunction("main");
-        if (funcExitNode.count(mainFunc)) {
-            funcExitNode.at(mainFunc)->isFinalState = true;
+    llvm::PreservedAnalyses syscallCFGPass::run(llvm::Module &Mod, llvm::AnalysisManager<llvm::Module> &mngr) {
+        if(entryFunctions(Mod).empty()) {
+            llvm::errs() << "syscall-cfg-pass: " << Mod.getSourceFileName() << ": no function definitions, nothing to do\n";
+            return llvm::PreservedAnalyses::all();
         }
-        fsm::nfaNode* entryNode = bbId.at({mainFunc, &mainFunc->getEntryBlock()});
-        startNode->edges.push_back({entryNode, "ε"});
-
-        for(llvm::Function &func : Mod){
-            if(func.isDeclaration()) continue;
-
-            for(llvm::BasicBlock &bb : func) {
-                fsm::nfaNode* lastNode = scanCallInstructions(bb, func);
-                llvm::Instruction *terminator = bb.getTerminator();
-                if(!terminator) continue;
-                if (llvm::isa<llvm::ReturnInst>(terminator)) {
-                    lastNode->edges.push_back({funcExitNode.at(&func), "ε"});
-                }
-                for(unsigned i = 0; i < terminator->getNumSuccessors(); i++) {
-                    llvm::BasicBlock *successor = terminator->getSuccessor(i);
-                    auto successorKey = std::make_pair(&func, successor);
-                    if(bbId.find(successorKey) == bbId.end())
-                        bbId[successorKey] = createNode();
-                    fsm::nfaNode* successorNode = bbId.at(successorKey);
-                    lastNode->edges.push_back({successorNode, "ε"});
+        cfgengine::cfgEngine<cfgengine::syscallLabels> engine(options.engine, "syscall-cfg-pass");
+        syscallAutomaton &syscalls = engine.automaton<cfgengine::syscallLabels>();
+        if(!options.elide && !options.hoistLoops) {
+            if(options.engine.bypassesAnalysis()) {
+                // The cached analysis is built with the default options.
+                if(options.engine.summaries) {
+                    engine.composeGraphs(Mod, mngr);
+                } else {
+                    engine.buildGraphs(Mod);
                 }
+                engine.writeAutomata(Mod, false);
+            } else {
+                auto &automata = mngr.getResult<cfgengine::AutomatonAnalysis<cfgengine::syscallLabels>>(Mod);
+                cfgengine::writeCachedAutomaton<cfgengine::syscallLabels>(Mod, options.engine, "syscall-cfg-pass",
+                    automata.get<cfgengine::syscallLabels>(), cfgengine::outputStem(Mod));
             }
+            return llvm::PreservedAnalyses::all();
         }
 
-        fsm::removeEpsilonTransitions(startNode);
+        engine.buildGraphs(Mod);
 
-        fsm::nfaNode* mergedStartNode = fsm::mergeEquivalentStates(startNode);
+        // The rewrites below change which events the monitor sees; after
+        // each one that touches the module, rebuild its automaton from the
+        // remaining traps.
+        fsm::Automaton nfa;
+        fsm::Automaton dfa;
+        auto rebuild = [&](bool rescan) {
+            if(rescan) engine.buildGraphs(Mod);
+            nfa = syscalls.graph;
+            nfa.finalize();
+            dfa = syscalls.determinize(Mod);
+        };
+        rebuild(false);
+        bool modified = false;
 
-        dumpGraph(Mod, mergedStartNode);
-        
-        fsm::clearGraph(mergedStartNode);
+        if(options.hoistLoops) {
+            size_t totalTraps = syscalls.trapSites.size();
+            unsigned hoisted = hoistLoopTraps(Mod, mngr, syscalls, nfa, dfa);
+            if(hoisted > 0) {
+                modified = true;
+                rebuild(true);
+            }
+            llvm::errs() << "syscall-cfg-pass: " << Mod.getSourceFileName() << ": hoisted "
+                         << hoisted << " loops, " << totalTraps << " -> " << syscalls.trapSites.size() << " trap sites\n";
+        }
+        if(options.elide) {
+            size_t totalTraps = syscalls.trapSites.size();
+            unsigned elided = elideForcedTraps(syscalls, nfa, dfa);
+            llvm::errs() << "syscall-cfg-pass: " << Mod.getSourceFileName() << ": elided "
+                         << elided << " of " << totalTraps << " trap sites\n";
+            if(elided > 0) {
+                modified = true;
+                rebuild(true);
+            }
+        }
+        if(options.engine.summaries) {
+            // The rewrites above work on the whole-module graph; the emitted
+            // automaton is composed from summaries of the rewritten module.
+            engine.composeGraphs(Mod, mngr);
+            dfa = syscalls.determinize(Mod);
+        }
+        syscalls.dumpGraph(Mod, cfgengine::outputStem(Mod), dfa);
 
-        return llvm::PreservedAnalyses::all();
+        return modified ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all();
     }
 }
 
@@ -207,11 +272,34 @@ llvmGetPassPluginInfo() {
     return {
         LLVM_PLUGIN_API_VERSION, "syscallCFGPass", "v0.5",
         [](llvm::PassBuilder &PB) {
+            PB.registerAnalysisRegistrationCallback([](llvm::ModuleAnalysisManager &MAM) {
+                MAM.registerPass([] {return cfgengine::AutomatonAnalysis<cfgengine::syscallLabels>();});
+            });
+            // From clang -fpass-plugin= or a default<On> pipeline: after the
+            // optimizer, so the automaton matches the traps that end up in the
+            // binary. Like the other plugins it only runs when asked to, by
+            // setting $FSM_SYSCALL_CFG (empty for the defaults), and takes its
+            // parameters from it.
+            PB.registerOptimizerLastEPCallback(
+                [](llvm::ModulePassManager &MPM, llvm::OptimizationLevel) {
+                    if(!std::getenv("FSM_SYSCALL_CFG")) return;
+                    passParameters params;
+                    icfg::syscallCFGOptions options;
+                    if(!parseEnvironmentParameters("FSM_SYSCALL_CFG", "syscall-cfg-pass", params) ||
+                       !icfg::parseOptions(params, options)) {
+                        llvm::report_fatal_error("syscall-cfg-pass: invalid $FSM_SYSCALL_CFG");
+                    }
+                    MPM.addPass(icfg::syscallCFGPass(options));
+                }
+            );
             PB.registerPipelineParsingCallback(
                 [](llvm::StringRef Name, llvm::ModulePassManager &MPM,
                    llvm::ArrayRef<llvm::PassBuilder::PipelineElement>) {
-                    if(Name == "syscall-cfg-pass") {
-                        MPM.addPass(icfg::syscallCFGPass());
+                    passParameters params;
+                    if(parsePassName(Name, "syscall-cfg-pass", params)) {
+                        icfg::syscallCFGOptions options;
+                        if(!icfg::parseOptions(params, options)) return false;
+                        MPM.addPass(icfg::syscallCFGPass(options));
                         return true;
                     }
                     return false;
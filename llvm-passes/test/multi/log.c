@@ -0,0 +1,13 @@
+#include <stdio.h>
+
+static int lines;
+
+void log_line(const char *msg){
+    ++lines;
+    printf("[%d] %s\n",lines,msg);
+}
+
+void log_flush(void){
+    if(lines>0)fflush(stdout);
+    else puts("no output");
+}
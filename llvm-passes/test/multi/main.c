@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+int parse_args(int argc, char **argv);
+void log_line(const char *msg);
+void log_flush(void);
+
+static int check(int v){return v<0?-v:v;}
+
+int main(int argc, char **argv){
+    int n=parse_args(argc,argv);
+    if(n<0){log_line("bad arguments");exit(1);}
+    for(int i=0;i<check(n);++i){
+        if(i%3==0)log_line("tick");
+        else putchar('.');
+    }
+    log_flush();
+    return 0;
+}
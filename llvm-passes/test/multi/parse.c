@@ -0,0 +1,13 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+void log_line(const char *msg);
+
+static int check(int v){return v>100?100:v;}
+
+int parse_args(int argc, char **argv){
+    if(argc<2){log_line("using default");return 5;}
+    int n=atoi(argv[1]);
+    if(n==0){fputs("zero\n",stderr);return -1;}
+    return check(n);
+}
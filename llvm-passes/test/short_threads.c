@@ -0,0 +1,34 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Threads that make one libc call each and return: too few events to fill
+ * an event ring, and no call that enters the kernel to flush it. Built with
+ * -DFSM_ILLEGAL_CALL the threads also call strtol(), which the automaton of
+ * the plain build does not allow: short_threads [count]. */
+
+static void *worker(void *arg){
+    long sum=atoi(arg);
+#ifdef FSM_ILLEGAL_CALL
+    sum+=strtol(arg,NULL,10)&1;
+#endif
+    return (void *)sum;
+}
+
+int main(int argc, char **argv){
+    int count=argc>1?atoi(argv[1]):4;
+    if(count<1){fprintf(stderr,"usage: %s [threads]\n",argv[0]);return 2;}
+    pthread_t *ids=malloc(count*sizeof(*ids));
+    for(int i=0;i<count;++i){
+        if(pthread_create(&ids[i],NULL,worker,"1")){fprintf(stderr,"pthread_create failed\n");exit(1);}
+    }
+    long total=0;
+    for(int i=0;i<count;++i){
+        void *sum;
+        pthread_join(ids[i],&sum);
+        total+=(long)sum;
+    }
+    free(ids);
+    printf("%d threads, %ld\n",count,total);
+    return 0;
+}
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 static int u1(int x){return (x*7)^(x>>1);}
 static int u2(int a,int b){return a>b?a-b:a+b;}
@@ -103,6 +105,7 @@ int main(int c,char**v){
     f6(50);
     f7(x);
     f8(33);
+    syscall(SYS_write,1,"",0);
     putchar('z');
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Threads doing libc-heavy work on their own data, each started in one of
+ * two routines: threads [count] [iterations per thread]. */
+
+static long iterations;
+
+static void *formatter(void *arg){
+    char buf[32];
+    long sum=(long)arg;
+    for(long i=0;i<iterations;++i){
+        snprintf(buf,sizeof(buf),"%ld",i^sum);
+        sum+=strtol(buf,NULL,10)&7;
+    }
+    return (void *)sum;
+}
+
+static void *parser(void *arg){
+    char buf[32];
+    long sum=(long)arg;
+    for(long i=0;i<iterations;++i){
+        snprintf(buf,sizeof(buf),"%lx",i);
+        if(atoi(buf)%3==0)sum+=strtol(buf,NULL,16)&1;
+        else sum++;
+    }
+    return (void *)sum;
+}
+
+int main(int argc, char **argv){
+    int count=argc>1?atoi(argv[1]):4;
+    iterations=argc>2?atol(argv[2]):1000000;
+    if(count<1||iterations<0){fprintf(stderr,"usage: %s [threads] [iterations]\n",argv[0]);return 2;}
+    pthread_t *ids=malloc(count*sizeof(*ids));
+    for(int i=0;i<count;++i){
+        int err;
+        if(i%2==0)err=pthread_create(&ids[i],NULL,formatter,(void *)(long)i);
+        else err=pthread_create(&ids[i],NULL,parser,(void *)(long)i);
+        if(err){fprintf(stderr,"pthread_create failed\n");exit(1);}
+    }
+    long total=0;
+    for(int i=0;i<count;++i){
+        void *sum;
+        pthread_join(ids[i],&sum);
+        total+=(long)sum;
+    }
+    free(ids);
+    printf("%d threads, %ld\n",count,total);
+    return 0;
+}
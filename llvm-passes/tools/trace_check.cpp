@@ -0,0 +1,663 @@
+// Replays recorded event streams against an automaton written by the CFG
+// passes, built against build/libfsm.a without LLVM.
+//
+//     fsm-trace-check [options] AUTOMATON TRACES...
+//
+// AUTOMATON is a <stem>_cfg.fsmt table or a <stem>_cfg.dot graph. TRACES
+// are .fsmtrace recordings (TraceFormat.h) or text files holding one trace
+// per line as blank-separated decimal event IDs; "-" reads standard input.
+// For every trace the automaton rejects, the first offending event is
+// printed as
+//
+//     <file>:<trace>: event <n>: <id> (<label>) illegal in state <state>
+//
+// with traces and events counted from 1, and a summary with the throughput
+// goes to stderr. The exit status is 1 if any trace was rejected.
+//
+// An automaton that is nondeterministic in the events, such as a table
+// written with the passes' lazy option, is determinized on demand while the
+// traces are checked (fsm::LazyDFA, one per worker); its states are then
+// printed as the sets of automaton states "{a,b,...}" they stand for.
+//
+//     --threads N       worker threads (default: one per hardware thread)
+//     --read            read in blocks instead of mapping the file
+//     --block-size MB   how much is checked at a time (default 64)
+//     --complete        also reject traces that stop where the program could
+//                       not have ended: outside a final state and with
+//                       events still to come (a trace cut off by exit()
+//                       ends in a state without edges); tables only, as dot
+//                       graphs do not mark final states
+//     --lazy            determinize on demand even if the automaton is
+//                       deterministic in the events
+//     --cache-size MB   state cache of each lazy worker (default 16)
+//     --quiet           print the summary only
+
+#include "../include/FSM.h"
+#include "../include/AutomatonFormat.h"
+#include "../include/TraceFormat.h"
+#include "../src/DummySyscalls.cpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace {
+    struct checkOptions {
+        unsigned threads = 0;
+        bool mapFiles = true;
+        size_t blockSize = size_t(64) << 20;
+        bool complete = false;
+        bool lazy = false;
+        size_t cacheSize = size_t(16) << 20;
+        bool quiet = false;
+    };
+
+    // Event IDs larger than this are not looked up; no label maps to one.
+    const uint32_t maxEventId = 1u << 20;
+
+    // Dense tables above this many entries are stepped through the CSR
+    // arrays by binary search instead.
+    const uint64_t maxDenseEntries = 1u << 24;
+
+    // The event a label stands for: a bare libc ID (syscall automata), the
+    // "syscall(470) : <id>" of an inline-asm trap, or "call:<name>" for a
+    // libc function (libc automata). FSM_NO_LIBC_ID for anything else.
+    uint32_t eventOf(const std::string &label) {
+        std::string id = label;
+        if(label.compare(0, 5, "call:") == 0) {
+            int libcId = libcMap(std::string_view(label).substr(5));
+            return libcId >= 0 ? static_cast<uint32_t>(libcId) : FSM_NO_LIBC_ID;
+        }
+        size_t space = label.rfind(' ');
+        if(space != std::string::npos) id = label.substr(space + 1);
+        if(id.empty() || id.find_first_not_of("0123456789") != std::string::npos || id.size() > 9) {
+            return FSM_NO_LIBC_ID;
+        }
+        return static_cast<uint32_t>(std::strtoul(id.c_str(), nullptr, 10));
+    }
+
+    // The automaton re-indexed by event: transitions are looked up by the
+    // recorded ID, through a dense state x event table when it is small
+    // enough and a binary search over each state's sorted edges otherwise.
+    class traceMonitor {
+        public:
+            fsm::stateId start = fsm::Automaton::noState;
+            bool knowsFinals = false;
+
+            bool load(const std::string &path, std::string &error);
+
+            fsm::stateId step(fsm::stateId state, uint32_t event) const {
+                if(event >= symbolOf.size()) return fsm::Automaton::noState;
+                uint32_t symbol = symbolOf[event];
+                if(symbol == FSM_NO_SYMBOL) return fsm::Automaton::noState;
+                if(!dense.empty()) return dense[uint64_t(state) * numSymbols + symbol];
+                uint32_t low = offsets[state];
+                uint32_t high = offsets[state + 1];
+                while(low < high) {
+                    uint32_t middle = low + (high - low) / 2;
+                    if(edgeSymbols[middle] < symbol) {
+                        low = middle + 1;
+                    } else {
+                        high = middle;
+                    }
+                }
+                return low < offsets[state + 1] && edgeSymbols[low] == symbol ? targets[low] : fsm::Automaton::noState;
+            }
+            // Whether a run may end in `state`: the program returned, or
+            // nothing can follow, as after exit().
+            bool canStop(fsm::stateId state) const {return finals[state] != 0 || offsets[state] == offsets[state + 1];}
+            const std::string& labelOf(uint32_t event) const;
+            // The compact symbol of `event`, or FSM_NO_SYMBOL.
+            uint32_t symbolFor(uint32_t event) const {return event < symbolOf.size() ? symbolOf[event] : FSM_NO_SYMBOL;}
+            // The automaton with every edge, labelled by its event's symbol
+            // + 1; edges that stand for no event are left out.
+            const fsm::Automaton& eventAutomaton() const {return byEvent;}
+            size_t unmatchedLabels() const {return unmatched;}
+            size_t conflictingEdges() const {return conflicts;}
+        private:
+            std::vector<uint32_t> symbolOf;
+            std::vector<std::string> labels;
+            uint32_t numSymbols = 0;
+            std::vector<uint8_t> finals;
+            std::vector<uint32_t> offsets;
+            std::vector<uint32_t> edgeSymbols;
+            std::vector<fsm::stateId> targets;
+            std::vector<fsm::stateId> dense;
+            fsm::Automaton byEvent;
+            size_t unmatched = 0;
+            size_t conflicts = 0;
+    };
+
+    bool traceMonitor::load(const std::string &path, std::string &error) {
+        fsm::Alphabet alphabet;
+        fsm::Automaton dfa;
+        uint32_t magic = 0;
+        std::ifstream(path, std::ios::binary).read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        if(magic == FSM_TABLE_MAGIC) {
+            if(!fsm::readTable(path, alphabet, dfa)) {
+                error = "malformed transition table";
+                return false;
+            }
+            knowsFinals = true;
+        } else if(!fsm::readDot(path, alphabet, dfa)) {
+            error = "neither a transition table nor a dot graph with edges";
+            return false;
+        }
+        start = dfa.start;
+
+        // Compact symbols for the events the labels stand for.
+        std::vector<uint32_t> symbolOfLabel(alphabet.size(), FSM_NO_SYMBOL);
+        for(fsm::symbolId label = 1; label < alphabet.size(); label++) {
+            uint32_t event = eventOf(alphabet.label(label));
+            if(event == FSM_NO_LIBC_ID || event >= maxEventId) {
+                unmatched++;
+                continue;
+            }
+            if(event >= symbolOf.size()) symbolOf.resize(event + 1, FSM_NO_SYMBOL);
+            if(symbolOf[event] == FSM_NO_SYMBOL) {
+                symbolOf[event] = numSymbols++;
+                labels.push_back(alphabet.label(label));
+            }
+            symbolOfLabel[label] = symbolOf[event];
+        }
+
+        // Two labels for one event out of the same state make the automaton
+        // nondeterministic in the events. The CSR arrays keep the first edge;
+        // byEvent keeps them all for the lazy DFA.
+        finals.resize(dfa.numStates());
+        offsets.push_back(0);
+        std::vector<std::pair<uint32_t, fsm::stateId>> edges;
+        for(fsm::stateId state = 0; state < dfa.numStates(); state++) {
+            finals[state] = dfa.isFinal(state);
+            byEvent.addState(dfa.isFinal(state));
+            edges.clear();
+            for(uint32_t edge = dfa.edgeBegin(state); edge < dfa.edgeEnd(state); edge++) {
+                uint32_t symbol = symbolOfLabel[dfa.label(edge)];
+                if(symbol != FSM_NO_SYMBOL) edges.push_back({symbol, dfa.target(edge)});
+            }
+            std::stable_sort(edges.begin(), edges.end(), [](auto const& a, auto const& b) {return a.first < b.first;});
+            for(size_t i = 0; i < edges.size(); i++) {
+                bool repeated = i > 0 && edges[i].first == edges[i - 1].first;
+                if(!repeated || edges[i].second != edges[i - 1].second) {
+                    byEvent.addEdge(state, edges[i].second, edges[i].first + 1);
+                }
+                if(repeated) {
+                    conflicts += edges[i].second != edges[i - 1].second;
+                    continue;
+                }
+                edgeSymbols.push_back(edges[i].first);
+                targets.push_back(edges[i].second);
+            }
+            offsets.push_back(static_cast<uint32_t>(edgeSymbols.size()));
+        }
+        byEvent.start = dfa.start;
+        byEvent.finalize();
+
+        if(uint64_t(dfa.numStates()) * numSymbols <= maxDenseEntries) {
+            dense.assign(uint64_t(dfa.numStates()) * numSymbols, fsm::Automaton::noState);
+            for(fsm::stateId state = 0; state < dfa.numStates(); state++) {
+                for(uint32_t edge = offsets[state]; edge < offsets[state + 1]; edge++) {
+                    dense[uint64_t(state) * numSymbols + edgeSymbols[edge]] = targets[edge];
+                }
+            }
+        }
+        return true;
+    }
+
+    const std::string& traceMonitor::labelOf(uint32_t event) const {
+        static const std::string none = "not in the automaton";
+        if(event >= symbolOf.size() || symbolOf[event] == FSM_NO_SYMBOL) return none;
+        return labels[symbolOf[event]];
+    }
+
+    // Steps the monitor's tables; the automaton must be deterministic in
+    // the events.
+    struct tableEngine {
+        using state = fsm::stateId;
+        static constexpr state none = fsm::Automaton::noState;
+
+        const traceMonitor &monitor;
+
+        state start() {return monitor.start;}
+        state step(state from, uint32_t event) {return monitor.step(from, event);}
+        bool canStop(state at) {return monitor.canStop(at);}
+        std::string describe(state at) {return std::to_string(at);}
+    };
+
+    // Steps the subset construction of the event automaton, built as the
+    // traces need it.
+    struct lazyEngine {
+        using state = fsm::LazyDFA::handle;
+        static constexpr state none = fsm::LazyDFA::dead;
+
+        const traceMonitor &monitor;
+        fsm::LazyDFA &dfa;
+
+        state start() {return dfa.start();}
+        state step(state from, uint32_t event) {
+            uint32_t symbol = monitor.symbolFor(event);
+            return symbol == FSM_NO_SYMBOL ? none : dfa.step(from, symbol + 1);
+        }
+        bool canStop(state at) {return dfa.isFinal(at) || !dfa.hasMoves(at);}
+        std::string describe(state at) {
+            if(at == none) return "{}";
+            std::string text = "{";
+            for(fsm::stateId member : dfa.states(at)) {
+                if(text.size() > 1) text += ",";
+                text += std::to_string(member);
+            }
+            return text + "}";
+        }
+    };
+
+    // The first event of a trace the automaton rejects. `event` is
+    // FSM_TRACE_END when the trace was complete but stopped outside a
+    // final state. `state` is described when the violation is found, as a
+    // lazy DFA may have forgotten it by the time it is printed.
+    struct violation {
+        uint64_t trace;
+        uint64_t position;
+        uint32_t event;
+        std::string state;
+    };
+
+    struct pieceResult {
+        uint64_t traces = 0;
+        uint64_t events = 0;
+        std::vector<violation> violations;
+    };
+
+    // Runs one trace from the start state; `next` yields its events until
+    // it returns false.
+    template<typename Engine, typename Next>
+    void runTrace(Engine &engine, bool complete, Next next, pieceResult &result) {
+        typename Engine::state state = engine.start();
+        uint64_t position = 0;
+        uint32_t event;
+        bool rejected = false;
+        while(next(event)) {
+            position++;
+            if(rejected) continue;
+            typename Engine::state following = state == Engine::none ? state : engine.step(state, event);
+            if(following == Engine::none) {
+                result.violations.push_back({result.traces, position, event, engine.describe(state)});
+                rejected = true;
+                continue;
+            }
+            state = following;
+        }
+        if(complete && !rejected && (state == Engine::none || !engine.canStop(state))) {
+            result.violations.push_back({result.traces, position, FSM_TRACE_END, engine.describe(state)});
+        }
+        result.traces++;
+        result.events += position;
+    }
+
+    // A recording of 32-bit events with FSM_TRACE_END after each trace.
+    struct binaryFormat {
+        static constexpr size_t unit = sizeof(uint32_t);
+
+        static bool isEnd(const char *data, size_t offset) {
+            uint32_t word;
+            std::memcpy(&word, data + offset, sizeof(word));
+            return word == FSM_TRACE_END;
+        }
+        // Offset just past the first trace end at or after `from`, or `size`.
+        static size_t nextBoundary(const char *data, size_t from, size_t size) {
+            from = (from + unit - 1) / unit * unit;
+            for(size_t offset = from; offset + unit <= size; offset += unit) {
+                if(isEnd(data, offset)) return offset + unit;
+            }
+            return size;
+        }
+        // Offset just past the last trace end in [0, size), or 0.
+        static size_t lastBoundary(const char *data, size_t size) {
+            for(size_t offset = size / unit * unit; offset >= unit; offset -= unit) {
+                if(isEnd(data, offset - unit)) return offset;
+            }
+            return 0;
+        }
+        template<typename Engine>
+        static void check(Engine &engine, bool complete, const char *data, size_t size, pieceResult &result) {
+            size_t offset = 0;
+            size = size / unit * unit;
+            while(offset < size) {
+                runTrace(engine, complete, [&](uint32_t &event) {
+                    if(offset >= size) return false;
+                    std::memcpy(&event, data + offset, sizeof(event));
+                    offset += unit;
+                    return event != FSM_TRACE_END;
+                }, result);
+            }
+        }
+    };
+
+    // One trace per line, events as decimal IDs separated by blanks.
+    struct textFormat {
+        static constexpr size_t unit = 1;
+
+        static size_t nextBoundary(const char *data, size_t from, size_t size) {
+            const void *newline = from < size ? std::memchr(data + from, '\n', size - from) : nullptr;
+            return newline ? static_cast<const char*>(newline) - data + 1 : size;
+        }
+        static size_t lastBoundary(const char *data, size_t size) {
+            for(size_t offset = size; offset > 0; offset--) {
+                if(data[offset - 1] == '\n') return offset;
+            }
+            return 0;
+        }
+        template<typename Engine>
+        static void check(Engine &engine, bool complete, const char *data, size_t size, pieceResult &result) {
+            size_t offset = 0;
+            while(offset < size) {
+                runTrace(engine, complete, [&](uint32_t &event) {
+                    while(offset < size && (data[offset] == ' ' || data[offset] == '\t' || data[offset] == '\r')) offset++;
+                    if(offset >= size) return false;
+                    if(data[offset] == '\n') {
+                        offset++;
+                        return false;
+                    }
+                    uint64_t value = 0;
+                    bool digits = false;
+                    while(offset < size && data[offset] >= '0' && data[offset] <= '9') {
+                        value = std::min<uint64_t>(value * 10 + uint64_t(data[offset] - '0'), FSM_TRACE_END);
+                        offset++;
+                        digits = true;
+                    }
+                    if(!digits) {
+                        // Not an event ID; let it fail the trace.
+                        offset++;
+                        value = FSM_TRACE_END;
+                    }
+                    event = static_cast<uint32_t>(value);
+                    return true;
+                }, result);
+            }
+        }
+    };
+
+    struct runTotals {
+        uint64_t traces = 0;
+        uint64_t events = 0;
+        uint64_t rejected = 0;
+        uint64_t bytes = 0;
+    };
+
+    // Checks the traces of one file, a block at a time. Each block ends on
+    // a trace boundary and is cut into pieces, again on trace boundaries,
+    // that the workers check independently; results are printed in file
+    // order once the block is done, so the output does not depend on the
+    // thread count.
+    class traceChecker {
+        public:
+            traceChecker(const traceMonitor &monitor, const checkOptions &options, fsm::ThreadPool &pool, runTotals &totals)
+                : monitor(monitor), options(options), pool(pool), totals(totals) {
+                if(options.lazy) {
+                    for(unsigned worker = 0; worker < pool.size(); worker++) {
+                        lazy.emplace_back(monitor.eventAutomaton(), options.cacheSize);
+                    }
+                }
+            }
+
+            bool checkFile(const std::string &path);
+            size_t cacheFlushes() const;
+        private:
+            const traceMonitor &monitor;
+            const checkOptions &options;
+            fsm::ThreadPool &pool;
+            runTotals &totals;
+            // One lazy DFA per worker when options.lazy, so their caches
+            // are never shared.
+            std::vector<fsm::LazyDFA> lazy;
+            std::string name;
+            uint64_t traceBase = 0;
+
+            template<typename Format>
+            void checkBlock(const char *data, size_t size);
+            template<typename Format>
+            void checkMapped(const char *data, size_t size);
+            template<typename Format>
+            bool checkStream(int fd, std::vector<char> &buffer, size_t filled);
+            void report(const violation &found);
+    };
+
+    template<typename Format>
+    void traceChecker::checkBlock(const char *data, size_t size) {
+        std::vector<size_t> cuts = {0};
+        size_t pieces = std::max<size_t>(1, std::min<size_t>(pool.size() * 4, size / (64 << 10)));
+        for(size_t piece = 1; piece < pieces; piece++) {
+            size_t cut = Format::nextBoundary(data, std::max(cuts.back(), size / pieces * piece), size);
+            if(cut > cuts.back() && cut < size) cuts.push_back(cut);
+        }
+        cuts.push_back(size);
+
+        std::vector<pieceResult> results(cuts.size() - 1);
+        pool.parallelFor(results.size(), [&](size_t piece, unsigned worker) {
+            const char *begin = data + cuts[piece];
+            size_t length = cuts[piece + 1] - cuts[piece];
+            if(lazy.empty()) {
+                tableEngine engine{monitor};
+                Format::check(engine, options.complete, begin, length, results[piece]);
+            } else {
+                lazyEngine engine{monitor, lazy[worker]};
+                Format::check(engine, options.complete, begin, length, results[piece]);
+            }
+        });
+        for(auto &result : results) {
+            for(violation &found : result.violations) {
+                found.trace += traceBase;
+                report(found);
+            }
+            traceBase += result.traces;
+            totals.traces += result.traces;
+            totals.events += result.events;
+            totals.rejected += result.violations.size();
+        }
+        totals.bytes += size;
+    }
+
+    template<typename Format>
+    void traceChecker::checkMapped(const char *data, size_t size) {
+        size_t offset = 0;
+        while(offset < size) {
+            size_t end = offset + options.blockSize >= size ? size : Format::nextBoundary(data, offset + options.blockSize, size);
+            checkBlock<Format>(data + offset, end - offset);
+            offset = end;
+        }
+    }
+
+    // `buffer` holds the first `filled` bytes of the input. It grows to the
+    // block size as the input turns out to need it; whatever follows the
+    // last complete trace of a block is carried over to the next one.
+    template<typename Format>
+    bool traceChecker::checkStream(int fd, std::vector<char> &buffer, size_t filled) {
+        bool done = false;
+        while(!done) {
+            while(filled < buffer.size()) {
+                ssize_t got = read(fd, buffer.data() + filled, buffer.size() - filled);
+                if(got < 0) return false;
+                if(got == 0) {
+                    done = true;
+                    break;
+                }
+                filled += static_cast<size_t>(got);
+            }
+            if(!done && buffer.size() < options.blockSize) {
+                buffer.resize(std::min(buffer.size() * 2, options.blockSize));
+                continue;
+            }
+            size_t end = done ? filled : Format::lastBoundary(buffer.data(), filled);
+            if(end == 0 && !done) {
+                // A single trace longer than the block.
+                buffer.resize(buffer.size() * 2);
+                continue;
+            }
+            checkBlock<Format>(buffer.data(), end);
+            std::memmove(buffer.data(), buffer.data() + end, filled - end);
+            filled -= end;
+        }
+        return true;
+    }
+
+    bool traceChecker::checkFile(const std::string &path) {
+        name = path;
+        traceBase = 0;
+        int fd = path == "-" ? STDIN_FILENO : open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            std::fprintf(stderr, "fsm-trace-check: cannot open %s: %s\n", path.c_str(), std::strerror(errno));
+            return false;
+        }
+
+        struct stat st;
+        bool mappable = options.mapFiles && fd != STDIN_FILENO && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+        if(mappable) {
+            size_t size = static_cast<size_t>(st.st_size);
+            void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(mapped != MAP_FAILED) {
+                madvise(mapped, size, MADV_SEQUENTIAL);
+                const char *data = static_cast<const char*>(mapped);
+                fsm_trace_header header = {0, 0};
+                if(size >= sizeof(header)) std::memcpy(&header, data, sizeof(header));
+                bool ok = true;
+                if(header.magic != FSM_TRACE_MAGIC) {
+                    checkMapped<textFormat>(data, size);
+                } else if(header.version == FSM_TRACE_VERSION) {
+                    checkMapped<binaryFormat>(data + sizeof(header), size - sizeof(header));
+                } else {
+                    std::fprintf(stderr, "fsm-trace-check: %s: unsupported recording version %u\n", path.c_str(), header.version);
+                    ok = false;
+                }
+                munmap(mapped, size);
+                close(fd);
+                return ok;
+            }
+        }
+
+        // The header decides the format, so read at least that much first.
+        std::vector<char> buffer(std::min<size_t>(options.blockSize, 1 << 20));
+        size_t filled = 0;
+        while(filled < sizeof(fsm_trace_header)) {
+            ssize_t got = read(fd, buffer.data() + filled, buffer.size() - filled);
+            if(got <= 0) break;
+            filled += static_cast<size_t>(got);
+        }
+        fsm_trace_header header = {0, 0};
+        if(filled >= sizeof(header)) std::memcpy(&header, buffer.data(), sizeof(header));
+        bool ok;
+        if(header.magic == FSM_TRACE_MAGIC) {
+            if(header.version != FSM_TRACE_VERSION) {
+                std::fprintf(stderr, "fsm-trace-check: %s: unsupported recording version %u\n", path.c_str(), header.version);
+                ok = false;
+            } else {
+                std::memmove(buffer.data(), buffer.data() + sizeof(header), filled - sizeof(header));
+                ok = checkStream<binaryFormat>(fd, buffer, filled - sizeof(header));
+            }
+        } else {
+            ok = checkStream<textFormat>(fd, buffer, filled);
+        }
+        if(!ok) std::fprintf(stderr, "fsm-trace-check: cannot read %s: %s\n", path.c_str(), std::strerror(errno));
+        if(fd != STDIN_FILENO) close(fd);
+        return ok;
+    }
+
+    size_t traceChecker::cacheFlushes() const {
+        size_t flushes = 0;
+        for(auto const& dfa : lazy) flushes += dfa.flushes();
+        return flushes;
+    }
+
+    void traceChecker::report(const violation &found) {
+        if(options.quiet) return;
+        if(found.event == FSM_TRACE_END) {
+            std::printf("%s:%llu: ends after event %llu in state %s, where the program cannot stop\n", name.c_str(),
+                        (unsigned long long)found.trace + 1, (unsigned long long)found.position, found.state.c_str());
+        } else {
+            std::printf("%s:%llu: event %llu: %u (%s) illegal in state %s\n", name.c_str(),
+                        (unsigned long long)found.trace + 1, (unsigned long long)found.position, found.event,
+                        monitor.labelOf(found.event).c_str(), found.state.c_str());
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    checkOptions options;
+    std::vector<std::string> paths;
+    bool usage = false;
+    for(int i = 1; i < argc; i++) {
+        if(!std::strcmp(argv[i], "--threads") && i + 1 < argc) {
+            options.threads = std::atoi(argv[++i]);
+        } else if(!std::strcmp(argv[i], "--read")) {
+            options.mapFiles = false;
+        } else if(!std::strcmp(argv[i], "--block-size") && i + 1 < argc) {
+            options.blockSize = size_t(std::max(1, std::atoi(argv[++i]))) << 20;
+        } else if(!std::strcmp(argv[i], "--complete")) {
+            options.complete = true;
+        } else if(!std::strcmp(argv[i], "--lazy")) {
+            options.lazy = true;
+        } else if(!std::strcmp(argv[i], "--cache-size") && i + 1 < argc) {
+            options.cacheSize = size_t(std::max(1, std::atoi(argv[++i]))) << 20;
+        } else if(!std::strcmp(argv[i], "--quiet")) {
+            options.quiet = true;
+        } else if(argv[i][0] == '-' && argv[i][1] != '\0') {
+            usage = true;
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
+    if(usage || paths.size() < 2) {
+        std::fprintf(stderr, "usage: %s [--threads N] [--read] [--block-size MB] [--complete] [--lazy] [--cache-size MB] [--quiet] AUTOMATON TRACES...\n", argv[0]);
+        return 2;
+    }
+
+    traceMonitor monitor;
+    std::string error;
+    if(!monitor.load(paths[0], error)) {
+        std::fprintf(stderr, "fsm-trace-check: %s: %s\n", paths[0].c_str(), error.c_str());
+        return 2;
+    }
+    if(options.complete && !monitor.knowsFinals) {
+        std::fprintf(stderr, "fsm-trace-check: %s: --complete needs a table; dot graphs do not mark final states\n", paths[0].c_str());
+        return 2;
+    }
+    if(monitor.unmatchedLabels() > 0) {
+        std::fprintf(stderr, "fsm-trace-check: %s: %zu labels are not trap events and never match\n",
+                     paths[0].c_str(), monitor.unmatchedLabels());
+    }
+    if(monitor.conflictingEdges() > 0 && !options.lazy) {
+        std::fprintf(stderr, "fsm-trace-check: %s: %zu edges repeat an event of their state with another target; "
+                     "determinizing on demand\n", paths[0].c_str(), monitor.conflictingEdges());
+        options.lazy = true;
+    }
+
+    fsm::ThreadPool pool(options.threads);
+    runTotals totals;
+    traceChecker checker(monitor, options, pool, totals);
+    auto begin = std::chrono::steady_clock::now();
+    bool ok = true;
+    for(size_t i = 1; i < paths.size(); i++) {
+        ok = checker.checkFile(paths[i]) && ok;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::fflush(stdout);
+    if(options.lazy) {
+        std::fprintf(stderr, "fsm-trace-check: lazy DFA cache flushed %zu times\n", checker.cacheFlushes());
+    }
+
+    std::fprintf(stderr, "fsm-trace-check: %llu traces, %llu events, %llu rejected in %.3f s "
+                 "(%.1f M events/s, %.1f MiB/s, %u threads)\n",
+                 (unsigned long long)totals.traces, (unsigned long long)totals.events, (unsigned long long)totals.rejected,
+                 seconds, seconds > 0 ? totals.events / seconds / 1e6 : 0.0,
+                 seconds > 0 ? totals.bytes / seconds / (1 << 20) : 0.0, pool.size());
+    if(!ok) return 2;
+    return totals.rejected > 0 ? 1 : 0;
+}